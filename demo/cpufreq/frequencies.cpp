@@ -0,0 +1,55 @@
+/**
+ * Changes the frequency of all the domains at once with setFrequencies
+ * and compares its latency with the one of one setFrequencyUserspace
+ * call per domain.
+ **/
+#include <mammut/mammut.hpp>
+
+#include <iostream>
+
+using namespace mammut;
+using namespace mammut::cpufreq;
+using namespace mammut::utils;
+using namespace std;
+
+#define ITERATIONS 100
+
+int main(int argc, char** argv){
+    Mammut m;
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    RollbackPoint rp = frequency->getRollbackPoint();
+
+    vector<Domain*> domains = frequency->getDomains();
+    vector<pair<Domain*, Frequency> > lowest, highest;
+    for(Domain* domain : domains){
+        vector<Frequency> frequencies = domain->getAvailableFrequencies();
+        if(!domain->setGovernor(GOVERNOR_USERSPACE) || frequencies.empty()){
+            cerr << "Domain " << domain->getId() << " does not support userspace governor." << endl;
+            return -1;
+        }
+        lowest.push_back(pair<Domain*, Frequency>(domain, frequencies.front()));
+        highest.push_back(pair<Domain*, Frequency>(domain, frequencies.back()));
+    }
+    cout << domains.size() << " frequency domains found" << endl;
+
+    double start = getMillisecondsTime();
+    for(size_t i = 0; i < ITERATIONS; i++){
+        const vector<pair<Domain*, Frequency> >& target = (i % 2) ? highest : lowest;
+        for(size_t j = 0; j < target.size(); j++){
+            target[j].first->setFrequencyUserspace(target[j].second);
+        }
+    }
+    cout << "[setFrequencyUserspace] Microseconds per step: "
+         << (getMillisecondsTime() - start) * 1000.0 / ITERATIONS << endl;
+
+    start = getMillisecondsTime();
+    for(size_t i = 0; i < ITERATIONS; i++){
+        if(!frequency->setFrequencies((i % 2) ? highest : lowest)){
+            cerr << "setFrequencies failed." << endl;
+        }
+    }
+    cout << "[setFrequencies] Microseconds per step: "
+         << (getMillisecondsTime() - start) * 1000.0 / ITERATIONS << endl;
+
+    frequency->rollback(rp);
+}
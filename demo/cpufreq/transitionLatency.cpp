@@ -0,0 +1,27 @@
+/**
+ * Measures the latency of the switch between each pair of
+ * frequencies of the first domain.
+ **/
+#include <mammut/mammut.hpp>
+
+#include <iostream>
+
+using namespace mammut;
+using namespace mammut::cpufreq;
+using namespace std;
+
+int main(int argc, char** argv){
+    Mammut m;
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    Domain* domain = frequency->getDomains().at(0);
+
+    cout << "Declared transition latency: " << domain->getTransitionLatency() << " ns" << endl;
+    TransitionLatencyMatrix matrix = frequency->measureTransitionLatencies(domain);
+    for(auto it = matrix.begin(); it != matrix.end(); it++){
+        cout << it->first.first << " -> " << it->first.second << ": "
+             << it->second / 1000.0 << " us" << endl;
+    }
+    if(matrix.empty()){
+        cout << "No transition could be measured." << endl;
+    }
+}
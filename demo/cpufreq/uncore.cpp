@@ -0,0 +1,40 @@
+/**
+ * Shows the uncore frequency of each CPU, then sets the uncore
+ * frequency of all the CPUs to the minimum for a few seconds.
+ **/
+#include <mammut/mammut.hpp>
+
+#include <iostream>
+#include <unistd.h>
+
+using namespace mammut;
+using namespace mammut::cpufreq;
+using namespace std;
+
+int main(int argc, char** argv){
+    Mammut m;
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    vector<UncoreDomain*> uncores = frequency->getUncoreDomains();
+    if(uncores.empty()){
+        cout << "Uncore frequency control not supported." << endl;
+        return -1;
+    }
+
+    RollbackPoint rp = frequency->getRollbackPoint();
+    for(UncoreDomain* u : uncores){
+        Frequency lb, ub;
+        u->getHardwareBounds(lb, ub);
+        cout << "CPU " << u->getCpu()->getCpuId() << ": "
+             << "current: " << u->getCurrentFrequency() << " "
+             << "hardware bounds: [" << lb << ", " << ub << "]" << endl;
+        if(!u->setBounds(lb, lb)){
+            cout << "Impossible to set the uncore bounds." << endl;
+        }
+    }
+    sleep(5);
+    for(UncoreDomain* u : uncores){
+        cout << "CPU " << u->getCpu()->getCpuId() << ": "
+             << "current: " << u->getCurrentFrequency() << endl;
+    }
+    frequency->rollback(rp);
+}
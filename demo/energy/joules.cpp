@@ -29,4 +29,12 @@ int main(int argc, char** argv){
     sleep(4);
     j = counter->getJoules();
     cout << j << " joules consumed in the last 4 seconds." << endl;
+
+    /** Power, estimated over the last second. **/
+    counter->setPowerWindow(1000);
+    for(size_t i = 0; i < 4; i++){
+        PowerSample sample = counter->getPowerSample();
+        cout << "[" << sample.timestampMs << "] " << sample.watts << " watts." << endl;
+        usleep(500000);
+    }
 }
@@ -33,4 +33,24 @@ int main(int argc, char** argv){
         cout << "Total Graphic Joules: " << counterCpus->getJoulesGraphicAll() << " ";
     }
     cout << endl;
+
+    /** All the components of all the CPUs, read at the same time. **/
+    JoulesCpuSnapshot snapshot;
+    counterCpus->sampleAll(snapshot);
+    for(size_t i = 0; i < snapshot.joules.size(); i++){
+        cout << "Cpu " << i << " Joules: " << snapshot.joules[i] << endl;
+    }
+
+    if(counterCpus->hasJoulesPhysicalCores()){
+        vector<topology::PhysicalCore*> physicalCores = m.getInstanceTopology()->getPhysicalCores();
+        for(size_t i = 0; i < physicalCores.size(); i++){
+            cout << "Physical core " << physicalCores[i]->getPhysicalCoreId() << " Joules: "
+                 << counterCpus->getJoulesPhysicalCore(physicalCores[i]) << endl;
+        }
+    }
+
+    RefresherStats stats = counterCpus->getRefresherStats();
+    cout << "Refresher wakeups: " << stats.wakeups << " "
+         << "Refreshes: " << stats.refreshes << " "
+         << "Last interval: " << stats.lastIntervalMs << " ms" << endl;
 }
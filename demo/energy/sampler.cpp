@@ -0,0 +1,56 @@
+/**
+ * Collects a power trace of the CPUs with a background sampler,
+ * pinned on the last virtual core.
+ **/
+#include <mammut/mammut.hpp>
+
+#include <iostream>
+#include <unistd.h>
+
+using namespace mammut;
+using namespace mammut::energy;
+using namespace mammut::topology;
+using namespace std;
+
+int main(int argc, char** argv){
+    Mammut m;
+    Energy* energy = m.getInstanceEnergy();
+    if(!energy->getCounter()){
+        cout << "Power counters not available on this machine." << endl;
+        return -1;
+    }
+    double periodMs = 10;
+    if(argc > 1){
+        periodMs = atof(argv[1]);
+    }
+
+    vector<VirtualCore*> virtualCores = m.getInstanceTopology()->getVirtualCores();
+    EnergySampler sampler(energy, periodMs, 4096, virtualCores.back());
+    EnergySamplerCursor cursor = sampler.getCursor();
+    sampler.start();
+
+    vector<EnergySamplerRecord> records;
+    vector<EnergySamplerRecord> previous;
+    for(size_t i = 0; i < 10; i++){
+        usleep(100000);
+        records.clear();
+        sampler.read(cursor, records);
+        for(size_t j = 0; j < records.size(); j++){
+            const EnergySamplerRecord& r = records[j];
+            if(r.type == COUNTER_CPUS){
+                if(previous.size() <= r.cpuId){
+                    previous.resize(r.cpuId + 1, r);
+                }
+                const EnergySamplerRecord& p = previous[r.cpuId];
+                if(r.timestampMs > p.timestampMs){
+                    cout << "[" << r.timestampMs << "] Cpu " << r.cpuId << ": "
+                         << (r.joules.cpu - p.joules.cpu) / ((r.timestampMs - p.timestampMs) / 1000.0)
+                         << " watts" << endl;
+                }
+                previous[r.cpuId] = r;
+            }
+        }
+    }
+    sampler.stop();
+    cout << "Lost records: " << cursor.lost << endl;
+}
@@ -0,0 +1,46 @@
+/**
+ * Measures the cost of sampling the CPUs energy counters on simulated
+ * hardware. It can run on any machine and without root privileges.
+ * Usage: ./simulated archRoot (e.g. ../../test/archs/repara after
+ * extracting repara.tar.gz).
+ **/
+#include <mammut/mammut.hpp>
+
+#include <iostream>
+
+using namespace mammut;
+using namespace mammut::energy;
+using namespace mammut::utils;
+using namespace std;
+
+#define ITERATIONS 100000
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        cerr << "Usage: " << argv[0] << " archRoot" << endl;
+        return -1;
+    }
+    MsrBackendSimulated backend(1024);
+    backend.setRaplIntel(130, 50, 30, 0, 10);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = argv[1];
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    CounterCpus* counter = dynamic_cast<CounterCpus*>(m.getInstanceEnergy()->getCounter(COUNTER_CPUS));
+    if(!counter){
+        cout << "Cpu counters not present on the simulated machine." << endl;
+        return -1;
+    }
+
+    JoulesCpuSnapshot snapshot;
+    double start = getMillisecondsTime();
+    for(size_t i = 0; i < ITERATIONS; i++){
+        backend.advanceTime(1);
+        counter->sampleAll(snapshot);
+    }
+    double elapsed = getMillisecondsTime() - start;
+    cout << "Nanoseconds per sample: " << (elapsed * 1000000.0) / ITERATIONS << endl;
+    cout << "Joules: " << snapshot.getTotal() << endl;
+}
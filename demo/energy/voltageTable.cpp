@@ -9,13 +9,18 @@ using namespace mammut;
 using namespace mammut::cpufreq;
 using namespace std;
 
+/**
+ * Computes the voltage tables of all the domains (in parallel).
+ * The tables are checkpointed on voltageTable.<domainId>.txt files.
+ * If the demo is interrupted, running it again resumes the computation.
+ **/
 int main(int argc, char** argv){
     Mammut m;
     CpuFreq* frequency = m.getInstanceCpuFreq();
 
-    Domain* domain = frequency->getDomains().at(0);
-    cout << "Starting computing the voltage table..." << endl;
-    VoltageTable vt = domain->getVoltageTable();
-    dumpVoltageTable(vt, "voltageTable.txt");
-    cout << "Voltage table computed and dumped on file" << endl;
+    VoltageTableBuilder builder(frequency->getDomains());
+    builder.setCheckpoint("voltageTable");
+    cout << "Starting computing the voltage tables..." << endl;
+    vector<VoltageTable> vts = builder.build();
+    cout << vts.size() << " voltage tables computed and dumped on voltageTable.*.txt files" << endl;
 }
@@ -0,0 +1,119 @@
+/**
+ * Compares the number of memory allocations (and the time) needed to parse
+ * and format sysfs/procfs values with the string based utilities and with
+ * the allocation-free ones.
+ **/
+#include <mammut/mammut.hpp>
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+using namespace mammut;
+using namespace mammut::utils;
+using namespace std;
+
+static size_t allocations = 0;
+
+void* operator new(size_t size){
+    ++allocations;
+    void* p = malloc(size);
+    if(!p){
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept{
+    free(p);
+}
+
+#define ITERATIONS 100000
+
+static const char* procStatLine =
+        "cpu12 4705 356 584 3699176 23 0 6 0 0 0\n";
+
+static void report(const string& name, size_t allocs, double start, uint64_t check){
+    double elapsed = getMillisecondsTime() - start;
+    cout << "[" << name << "] "
+         << "Allocations per call: " << (double) allocs / ITERATIONS << " "
+         << "Nanoseconds per call: " << (elapsed * 1000000.0) / ITERATIONS << " "
+         << "(checksum: " << check << ")" << endl;
+}
+
+int main(int argc, char** argv){
+    uint64_t check = 0;
+    size_t startAllocs;
+    double start;
+
+    /** Parsing of a /proc/stat line. **/
+    string line(procStatLine);
+    startAllocs = allocations;
+    start = getMillisecondsTime();
+    for(size_t i = 0; i < ITERATIONS; i++){
+        vector<string> fields = split(line, ' ');
+        check += stringToInt(fields[4]);
+    }
+    report("split + stringToInt", allocations - startAllocs, start, check);
+
+    check = 0;
+    const char* last = procStatLine + strlen(procStatLine);
+    startAllocs = allocations;
+    start = getMillisecondsTime();
+    for(size_t i = 0; i < ITERATIONS; i++){
+        int64_t fields[11];
+        parseFields(procStatLine, last, fields, 11);
+        check += fields[4];
+    }
+    report("parseFields", allocations - startAllocs, start, check);
+
+    /** Formatting of a frequency. **/
+    check = 0;
+    startAllocs = allocations;
+    start = getMillisecondsTime();
+    for(size_t i = 0; i < ITERATIONS; i++){
+        stringstream out;
+        out << 2401000 + i;
+        check += out.str().length();
+    }
+    report("stringstream", allocations - startAllocs, start, check);
+
+    check = 0;
+    startAllocs = allocations;
+    start = getMillisecondsTime();
+    for(size_t i = 0; i < ITERATIONS; i++){
+        char buffer[20];
+        check += formatU64(2401000 + i, buffer, sizeof(buffer));
+    }
+    report("formatU64", allocations - startAllocs, start, check);
+
+    /** Reading of a value from a sysfs file. **/
+    string fileName = "/sys/devices/system/cpu/cpu0/cpufreq/scaling_cur_freq";
+    if(existsFile(fileName)){
+        check = 0;
+        startAllocs = allocations;
+        start = getMillisecondsTime();
+        for(size_t i = 0; i < ITERATIONS; i++){
+            check += stringToInt(readFirstLineFromFile(fileName));
+        }
+        report("readFirstLineFromFile", allocations - startAllocs, start, check);
+
+        check = 0;
+        SysfsFile file(fileName);
+        startAllocs = allocations;
+        start = getMillisecondsTime();
+        for(size_t i = 0; i < ITERATIONS; i++){
+            char buffer[32];
+            size_t length = file.read(buffer, sizeof(buffer));
+            uint64_t value = 0;
+            parseU64(buffer, buffer + length, value);
+            check += value;
+        }
+        report("SysfsFile + parseU64", allocations - startAllocs, start, check);
+    }
+}
@@ -3,15 +3,36 @@
 
 #include "../cpufreq/cpufreq.hpp"
 
+#include "atomic"
 #include "vector"
 #include "map"
 
 namespace mammut{
 namespace cpufreq{
 
+/**
+ * Distance (in kHz) between the frequencies returned by
+ * DomainLinuxPstate::getAvailableFrequencies (i.e. the bus clock).
+ **/
+#define MAMMUT_CPUFREQ_PSTATE_STEP 100000
+
+/**
+ * Frequency (in kHz) of a unit of the uncore ratio (MSR_UNCORE_RATIO_LIMIT
+ * and MSR_UNCORE_PERF_STATUS).
+ **/
+#define MAMMUT_CPUFREQ_UNCORE_RATIO_UNIT 100000
+
 class DomainLinux: public Domain{
 public:
-    DomainLinux(DomainId domainIdentifier, std::vector<topology::VirtualCore*> virtualCores);
+    /**
+     * @param domainIdentifier The identifier of the domain.
+     * @param virtualCores The virtual cores belonging to the domain.
+     * @param epyc True if the frequencies must be managed through the
+     *        AMD EPYC P-state registers instead of sysfs.
+     */
+    DomainLinux(DomainId domainIdentifier, std::vector<topology::VirtualCore*> virtualCores,
+                bool epyc);
+    ~DomainLinux();
     void removeTurboFrequencies();
     void reinsertTurboFrequencies();
     std::vector<Frequency> getAvailableFrequencies() const;
@@ -28,26 +49,285 @@ public:
     Voltage getCurrentVoltage() const;
     VoltageTable getVoltageTable(bool onlyPhysicalCores = true) const;
     VoltageTable getVoltageTable(uint numVirtualCores, bool onlyPhysicalCores) const;
-private:
-    std::vector<Governor> _availableGovernors;
+
+    /**
+     * Enables or disables the caching of governor, governor bounds and
+     * userspace frequency. When enabled, these values are read from sysfs
+     * only once and then updated whenever Mammut changes them.
+     * @param caching True to enable the caching, false to disable it.
+     */
+    void setCaching(bool caching);
+
+    /**
+     * Invalidates the cached values, forcing the next reads
+     * to be performed on sysfs.
+     */
+    void invalidateCache() const;
+
+    /**
+     * Returns the files whose content is cached.
+     * @return The files whose content is cached.
+     */
+    std::vector<std::string> getCachedFiles() const;
+
+    /**
+     * Enables or disables the direct control of the frequency.
+     * On EPYC processors the control is always direct. On Intel
+     * processors IA32_PERF_CTL is written on each virtual core.
+     * This is not possible if HWP is enabled. When enabled,
+     * the cpufreq governor is set to userspace (if available)
+     * to avoid conflicting writes.
+     * @param direct True to enable the direct control, false to disable it.
+     * @return true if the operation succeeded, false otherwise.
+     */
+    bool setDirectControl(bool direct);
+    bool isDirectControlEnabled() const;
+    Frequency getEffectiveFrequency(const topology::VirtualCore* virtualCore) const;
+    std::vector<Frequency> getEffectiveFrequencies() const;
+    std::vector<Frequency> getResidencyFrequencies() const;
+    bool getFrequencyResidency(std::vector<uint64_t>& times) const;
+    bool getFrequencyTransitions(std::vector<uint64_t>& transitions) const;
+    void resetFrequencyResidency();
+protected:
     std::vector<Frequency> _availableFrequencies;
     std::vector<std::string> _paths;
+
+    void writeToDomainFiles(const char* what, size_t length, const char* where) const;
+    void writeToDomainFiles(const std::string& what, const char* where) const;
+    void writeToDomainFiles(Frequency what, const char* where) const;
+
+    /**
+     * Writes the governor bounds, without checking them.
+     * @param lowerBound The new frequency lower bound.
+     * @param upperBound The new frequency upper bound.
+     */
+    void writeGovernorBounds(Frequency lowerBound, Frequency upperBound) const;
+private:
+    std::vector<Governor> _availableGovernors;
     mutable utils::Msr _msr;
     std::vector<Frequency> _turboFrequencies;
     bool _epyc;
+    utils::SysfsFile* _currentFrequencyFile;
+    // scaling_setspeed files of the virtual cores, kept open for writing.
+    std::vector<utils::SysfsFile*> _setspeedFiles;
+    // Last known governor (GOVERNOR_NUM if unknown).
+    mutable std::atomic<Governor> _governor;
+    // Cached values (0 if unknown). Only used when _caching is true.
+    mutable std::atomic<Frequency> _lowerBound;
+    mutable std::atomic<Frequency> _upperBound;
+    mutable std::atomic<Frequency> _userspaceFrequency;
+    std::atomic<bool> _caching;
+    // Direct control through IA32_PERF_CTL.
+    bool _direct;
+    // Governor to restore when the direct control is disabled.
+    Governor _governorBeforeDirect;
+    std::vector<utils::Msr*> _perfCtlMsrs;
+    std::vector<uint64_t> _perfCtlValues;
+    uint64_t _turboRatio;
+    // Counters read at the previous getEffectiveFrequency call.
+    typedef struct{
+        double timestamp;
+        uint64_t tsc;
+        uint64_t aperf;
+        uint64_t mperf;
+    }AperfMperfSample;
+    mutable utils::LockPthreadMutex _aperfMperfLock;
+    mutable std::vector<utils::Msr*> _aperfMperfMsrs;
+    mutable std::vector<AperfMperfSample> _aperfMperfSamples;
+
+    // Residency statistics (stats/time_in_state and stats/trans_table).
+    std::vector<Frequency> _residencyFrequencies;
+    // For each line of the files, the index in _residencyFrequencies.
+    std::vector<size_t> _residencyIndexes;
+    utils::SysfsFile* _timeInStateFile;
+    utils::SysfsFile* _transTableFile;
+    long _clockTicksPerSecond;
+    std::vector<uint64_t> _lastTimes;
+    std::vector<uint64_t> _lastTransitions;
+
+    Governor readGovernor() const;
+    Frequency getEffectiveFrequency(size_t index) const;
+    void initResidency();
+    bool readTimeInState(std::vector<uint64_t>& ticks) const;
+    bool readTransTable(std::vector<uint64_t>& transitions) const;
+    uint64_t frequencyToRatio(Frequency frequency) const;
+    Frequency ratioToFrequency(uint64_t ratio) const;
+};
+
+/**
+ * A domain managed by the intel_pstate (or intel_cpufreq) and
+ * amd-pstate (or amd-pstate-epp) drivers.
+ * These drivers don't expose a list of available frequencies. The
+ * governor bounds can be set to any frequency between the hardware
+ * bounds and getAvailableFrequencies returns the frequencies between
+ * the hardware bounds in steps of MAMMUT_CPUFREQ_PSTATE_STEP kHz.
+ * If hardware managed P-states are enabled (Intel HWP or AMD CPPC),
+ * performance hints are directly written in the request register
+ * of each virtual core.
+ */
+class DomainLinuxPstate: public DomainLinux{
+public:
+    /**
+     * @param domainIdentifier The identifier of the domain.
+     * @param virtualCores The virtual cores belonging to the domain.
+     * @param amd True if the processor is an AMD one (CPPC registers
+     *        are used instead of HWP ones).
+     */
+    DomainLinuxPstate(DomainId domainIdentifier, std::vector<topology::VirtualCore*> virtualCores,
+                      bool amd);
+    ~DomainLinuxPstate();
+    bool setGovernorBounds(Frequency lowerBound, Frequency upperBound) const;
+    std::vector<std::string> getAvailableEnergyPerformancePreferences() const;
+    std::string getEnergyPerformancePreference() const;
+    bool setEnergyPerformancePreference(const std::string& preference) const;
+    bool getPerformanceCapabilities(PerformanceCapabilities& capabilities) const;
+    bool getPerformanceHint(PerformanceHint& hint) const;
+    bool setPerformanceHint(const PerformanceHint& hint) const;
+    bool setPerformanceHint(const topology::VirtualCore* virtualCore,
+                            const PerformanceHint& hint) const;
+private:
+    bool _amd;
+    Frequency _hardwareLowerBound, _hardwareUpperBound;
+    std::vector<std::string> _availablePreferences;
+    // Request registers of the virtual cores.
+    std::vector<utils::Msr*> _msrs;
+    // Last value written in (or read from) the request registers.
+    mutable std::vector<uint64_t> _requests;
+    mutable std::vector<bool> _requestsValid;
+    bool _hardwarePstates;
+
+    bool setPerformanceHint(size_t index, const PerformanceHint& hint) const;
+};
+
+/**
+ * Uncore domain controlled through the intel_uncore_frequency
+ * driver (if loaded) or directly through MSR_UNCORE_RATIO_LIMIT.
+ **/
+class UncoreDomainLinux: public UncoreDomain{
+private:
+    std::string _path;
+    utils::Msr* _msr;
+    Frequency _hardwareLowerBound;
+    Frequency _hardwareUpperBound;
+public:
+    explicit UncoreDomainLinux(topology::Cpu* cpu);
+    ~UncoreDomainLinux();
+
+    /**
+     * Returns true if the uncore frequency can be controlled.
+     * @return True if the uncore frequency can be controlled.
+     **/
+    bool available() const;
+
+    Frequency getCurrentFrequency() const;
+    bool getHardwareBounds(Frequency& lowerBound, Frequency& upperBound) const;
+    bool getBounds(Frequency& lowerBound, Frequency& upperBound) const;
+    bool setBounds(Frequency lowerBound, Frequency upperBound);
+};
+
+/**
+ * A set of frequency changes shared by the threads which apply it.
+ * The thread with index i changes the domains i, i + stride, ...
+ */
+class FrequenciesBatch{
+public:
+    const std::vector<std::pair<Domain*, Frequency> >* frequencies;
+    size_t stride;
+    std::atomic<size_t> pending;
+    std::atomic<bool> failed;
+    utils::Monitor done;
+
+    FrequenciesBatch();
+
+    /**
+     * Applies the frequency changes assigned to a thread.
+     * @param index The index of the thread.
+     */
+    void apply(size_t index);
+};
 
-    void writeToDomainFiles(const std::string& what, const std::string& where) const;
+/**
+ * A persistent thread used to change the frequencies of
+ * many domains in parallel.
+ */
+class FrequenciesSetter: public utils::Thread{
+private:
+    FrequenciesBatch& _batch;
+    size_t _index;
+    utils::Monitor _start;
+    std::atomic<bool> _stop;
+public:
+    FrequenciesSetter(FrequenciesBatch& batch, size_t index);
+    void run();
+
+    /**
+     * Wakes up the thread to apply its part of the batch.
+     */
+    void notify();
+
+    /**
+     * Terminates the thread. It must be joined afterwards.
+     */
+    void stop();
+};
+
+/**
+ * A thread which watches (through inotify) the cached files of the
+ * domains and invalidates their cache when the files are written.
+ * ATTENTION: Only writes performed through the write system call are
+ *            notified (e.g. by tuned or cpupower). Changes performed
+ *            by the kernel itself are not.
+ * If the files can't be watched anymore, the thread disables caching
+ * on the domains and terminates.
+ */
+class CpuFreqWatcher: public utils::Thread{
+private:
+    int _inotifyFd;
+    int _stopFd;
+    std::map<int, DomainLinux*> _domains;
+    std::atomic<bool> _failed;
+public:
+    /**
+     * @param domains The domains to watch.
+     * @throw runtime_error If the files can't be watched.
+     */
+    explicit CpuFreqWatcher(const std::vector<Domain*>& domains);
+    ~CpuFreqWatcher();
+    void run();
+
+    /**
+     * Returns true if the thread terminated because the files
+     * can't be watched anymore. It must be joined anyway.
+     * @return True if the thread terminated because of an error.
+     */
+    bool failed() const;
+
+    /**
+     * Terminates the thread. It must be joined afterwards.
+     */
+    void stop();
 };
 
 class CpuFreqLinux: public CpuFreq{
 private:
     std::vector<Domain*> _domains;
+    std::vector<UncoreDomain*> _uncoreDomains;
     std::string _boostingFile;
     topology::Topology* _topology;
+    mutable utils::LockPthreadMutex _settersLock;
+    mutable FrequenciesBatch _batch;
+    mutable std::vector<FrequenciesSetter*> _setters;
+    CpuFreqWatcher* _watcher;
+
+    void stopWatcher();
 public:
     CpuFreqLinux();
     ~CpuFreqLinux();
     std::vector<Domain*> getDomains() const;
+    std::vector<UncoreDomain*> getUncoreDomains() const;
+    bool setFrequencies(const std::vector<std::pair<Domain*, Frequency> >& frequencies) const;
+    bool enableCaching(bool watch = true);
+    void disableCaching();
     bool isBoostingSupported() const;
     bool isBoostingEnabled() const;
     void enableBoosting() const;
@@ -10,6 +10,7 @@
 #include "stddef.h"
 #include "stdint.h"
 #include "string"
+#include "utility"
 #include "vector"
 
 namespace mammut{
@@ -33,6 +34,16 @@ using VoltageTableKey = std::pair<topology::VirtualCoreId, Frequency>;
 using VoltageTable = std::map<VoltageTableKey, Voltage>;
 using VoltageTableIterator = std::map<VoltageTableKey, Voltage>::const_iterator;
 
+/**
+ * A pair <from, to> of frequencies.
+ */
+using TransitionLatencyKey = std::pair<Frequency, Frequency>;
+/**
+ * For each pair of frequencies <from, to>, the time (nanoseconds)
+ * needed to switch from the first to the second one.
+ */
+using TransitionLatencyMatrix = std::map<TransitionLatencyKey, double>;
+
 /**
  * Represents a rollback point. It can be used to bring
  * the domains back to a previous state.
@@ -42,6 +53,32 @@ struct RollbackPoint{
     std::vector<Frequency> lowerBounds;
     std::vector<Frequency> upperBounds;
     std::vector<Governor> governors;
+    std::vector<Frequency> uncoreLowerBounds;
+    std::vector<Frequency> uncoreUpperBounds;
+};
+
+/**
+ * Performance capabilities of a processor with hardware managed
+ * P-states (Intel HWP or AMD CPPC). Values are expressed on the
+ * abstract performance scale of the processor.
+ */
+struct PerformanceCapabilities{
+    uint8_t lowest;
+    uint8_t efficient; // Most efficient (Intel) or lowest non linear (AMD).
+    uint8_t guaranteed; // Guaranteed (Intel) or nominal (AMD).
+    uint8_t highest;
+};
+
+/**
+ * A performance hint for hardware managed P-states (Intel HWP or
+ * AMD CPPC). Values are expressed on the same scale of
+ * PerformanceCapabilities.
+ */
+struct PerformanceHint{
+    uint8_t minimum;
+    uint8_t maximum;
+    uint8_t desired; // 0 lets the hardware choose.
+    uint8_t energyPerformancePreference; // From 0 (performance) to 255 (energy).
 };
 
 /**
@@ -229,11 +266,244 @@ public:
      */
     virtual VoltageTable getVoltageTable(uint numVirtualCores,
                                          bool onlyPhysicalCores) const = 0;
+
+    /**
+     * Returns the energy performance preferences (e.g. "performance",
+     * "balance_power") supported by this domain.
+     * @return The energy performance preferences supported by this domain.
+     *         If empty, energy performance preferences are not supported.
+     */
+    virtual std::vector<std::string> getAvailableEnergyPerformancePreferences() const;
+
+    /**
+     * Returns the current energy performance preference.
+     * @return The current energy performance preference, or an empty
+     *         string if not supported.
+     */
+    virtual std::string getEnergyPerformancePreference() const;
+
+    /**
+     * Changes the energy performance preference.
+     * @param preference One of the preferences returned by
+     *        getAvailableEnergyPerformancePreferences or a
+     *        raw value between 0 and 255.
+     * @return true if the preference has been changed, false otherwise.
+     */
+    virtual bool setEnergyPerformancePreference(const std::string& preference) const;
+
+    /**
+     * Gets the performance capabilities of the hardware managed P-states.
+     * @param capabilities The performance capabilities.
+     * @return true if hardware managed P-states are available, false otherwise.
+     */
+    virtual bool getPerformanceCapabilities(PerformanceCapabilities& capabilities) const;
+
+    /**
+     * Gets the performance hint of the first virtual core of the domain.
+     * @param hint The performance hint.
+     * @return true if hardware managed P-states are available, false otherwise.
+     */
+    virtual bool getPerformanceHint(PerformanceHint& hint) const;
+
+    /**
+     * Sets the performance hint of all the virtual cores of the domain.
+     * ATTENTION: The hint may be overwritten by the driver when the
+     *            governor or its bounds are changed.
+     * @param hint The performance hint.
+     * @return true if the hint has been set, false otherwise.
+     */
+    virtual bool setPerformanceHint(const PerformanceHint& hint) const;
+
+    /**
+     * Sets the performance hint of a single virtual core of the domain.
+     * It costs one register write.
+     * @param virtualCore The virtual core.
+     * @param hint The performance hint.
+     * @return true if the hint has been set, false otherwise (e.g. if the
+     *         virtual core doesn't belong to this domain).
+     */
+    virtual bool setPerformanceHint(const topology::VirtualCore* virtualCore,
+                                    const PerformanceHint& hint) const;
+
+    /**
+     * Enables or disables the direct control of the frequency. When
+     * enabled, the userspace frequency is changed by directly writing
+     * the P-state registers of the virtual cores, bypassing the
+     * cpufreq files and governor. In this mode the only available
+     * governor is GOVERNOR_USERSPACE. When disabled, the governor which
+     * was active before enabling it is restored.
+     * @param direct True to enable the direct control, false to disable it.
+     * @return true if the operation succeeded, false if the direct
+     *         control is not supported (e.g. if the userspace governor
+     *         is not available).
+     */
+    virtual bool setDirectControl(bool direct);
+
+    /**
+     * Checks if the direct control of the frequency is enabled.
+     * @return true if the direct control of the frequency is enabled.
+     */
+    virtual bool isDirectControlEnabled() const;
+
+    /**
+     * Returns the average frequency at which a virtual core of this
+     * domain ran while not idle, since the previous call of
+     * getEffectiveFrequency or getEffectiveFrequencies for the same
+     * virtual core. Differently from getCurrentFrequency, this is
+     * the frequency actually delivered by the hardware (e.g. including
+     * turbo and power capping effects).
+     * @param virtualCore The virtual core.
+     * @return The average effective frequency (kHz) of the virtual core.
+     *         0 is returned at the first call, if the virtual core was
+     *         always idle, if the virtual core doesn't belong to the
+     *         domain or if the effective frequency can't be measured.
+     */
+    virtual Frequency getEffectiveFrequency(const topology::VirtualCore* virtualCore) const;
+
+    /**
+     * Returns the average effective frequencies of all the virtual cores
+     * of this domain. See getEffectiveFrequency.
+     * @return The average effective frequencies (kHz), in the same order
+     *         of getVirtualCores().
+     */
+    virtual std::vector<Frequency> getEffectiveFrequencies() const;
+
+    /**
+     * Returns the frequencies for which residency statistics are
+     * available, in ascending order.
+     * @return The frequencies for which residency statistics are
+     *         available. If empty, statistics are not available.
+     */
+    virtual std::vector<Frequency> getResidencyFrequencies() const;
+
+    /**
+     * Gets the time spent by the domain at each frequency since the
+     * last call of resetFrequencyResidency (or since the creation of
+     * the domain). No memory is allocated if times already has the
+     * right size.
+     * @param times The times (milliseconds). The i-th element is the
+     *        time spent at the i-th frequency returned by
+     *        getResidencyFrequencies.
+     * @return true if the times have been read, false otherwise.
+     */
+    virtual bool getFrequencyResidency(std::vector<uint64_t>& times) const;
+
+    /**
+     * Gets the number of transitions between each pair of frequencies
+     * since the last call of resetFrequencyResidency (or since the
+     * creation of the domain). No memory is allocated if transitions
+     * already has the right size.
+     * @param transitions The transitions. The element i*N + j is the
+     *        number of transitions from the i-th to the j-th frequency
+     *        returned by getResidencyFrequencies (N is the number of
+     *        frequencies).
+     * @return true if the transitions have been read, false otherwise.
+     */
+    virtual bool getFrequencyTransitions(std::vector<uint64_t>& transitions) const;
+
+    /**
+     * Resets the residency times and the transitions counters.
+     */
+    virtual void resetFrequencyResidency();
+};
+
+/**
+ * Represents the uncore (ring/mesh, LLC, memory controller) frequency
+ * of a CPU. The uncore frequency is chosen by the hardware between
+ * two bounds, which can be changed.
+ */
+class UncoreDomain{
+private:
+    topology::Cpu* const _cpu;
+protected:
+    explicit UncoreDomain(topology::Cpu* cpu);
+public:
+    virtual inline ~UncoreDomain(){;}
+
+    /**
+     * Returns the CPU of this uncore domain.
+     * @return The CPU of this uncore domain.
+     */
+    topology::Cpu* getCpu() const;
+
+    /**
+     * Returns the current uncore frequency.
+     * @return The current uncore frequency (KHz), or 0 if
+     *         it can't be read.
+     */
+    virtual Frequency getCurrentFrequency() const = 0;
+
+    /**
+     * Gets the bounds that can be set for the uncore frequency.
+     * @param lowerBound The lowest frequency (KHz).
+     * @param upperBound The highest frequency (KHz).
+     * @return true if the bounds have been read, false otherwise.
+     */
+    virtual bool getHardwareBounds(Frequency& lowerBound, Frequency& upperBound) const = 0;
+
+    /**
+     * Gets the current bounds of the uncore frequency.
+     * @param lowerBound The current lower bound (KHz).
+     * @param upperBound The current upper bound (KHz).
+     * @return true if the bounds have been read, false otherwise.
+     */
+    virtual bool getBounds(Frequency& lowerBound, Frequency& upperBound) const = 0;
+
+    /**
+     * Changes the bounds of the uncore frequency.
+     * @param lowerBound The new lower bound (KHz).
+     * @param upperBound The new upper bound (KHz).
+     * @return true if the bounds have been changed, false if they
+     *         are outside the hardware bounds or can't be changed.
+     */
+    virtual bool setBounds(Frequency lowerBound, Frequency upperBound) = 0;
+};
+
+/**
+ * Records the start time and the duration of consecutive iterations of
+ * a fixed amount of work executed on a domain. Since the duration
+ * depends on the frequency of the domain, it is used to detect when a
+ * frequency change takes effect.
+ * Times are in nanoseconds and are taken with CLOCK_MONOTONIC.
+ */
+class TransitionProbe{
+public:
+    virtual inline ~TransitionProbe(){;}
+
+    /**
+     * Returns the number of iterations recorded since the probe started.
+     * @return The number of iterations recorded since the probe started.
+     */
+    virtual size_t getCount() const = 0;
+
+    /**
+     * Returns the number of iterations kept by the probe. Older
+     * iterations are overwritten.
+     * @return The number of iterations kept by the probe.
+     */
+    virtual size_t getCapacity() const = 0;
+
+    /**
+     * Returns the start time of an iteration.
+     * @param i The index of the iteration (less than getCount()).
+     * @return The start time of the iteration.
+     */
+    virtual double getStart(size_t i) const = 0;
+
+    /**
+     * Returns the duration of an iteration.
+     * @param i The index of the iteration (less than getCount()).
+     * @return The duration of the iteration.
+     */
+    virtual double getDuration(size_t i) const = 0;
 };
 
 class CpuFreq: public Module{
     MAMMUT_MODULE_DECL(CpuFreq)
 private:
+    mutable utils::LockPthreadMutex _transitionLatenciesLock;
+    std::map<DomainId, TransitionLatencyMatrix> _transitionLatencies;
+
     bool processMessage(const std::string& messageIdIn, const std::string& messageIn,
                         std::string& messageIdOut, std::string& messageOut);
 protected:
@@ -253,6 +523,21 @@ public:
      */
     virtual std::vector<Domain*> getDomains() const = 0;
 
+    /**
+     * Gets the uncore domains, one for each CPU.
+     * @return A vector of uncore domains. It is empty if the uncore
+     *         frequency can't be controlled.
+     */
+    virtual std::vector<UncoreDomain*> getUncoreDomains() const;
+
+    /**
+     * Returns the uncore domain of a CPU.
+     * @param cpu The CPU.
+     * @return The uncore domain of the CPU, or NULL if the
+     *         uncore frequency can't be controlled.
+     */
+    UncoreDomain* getUncoreDomain(const topology::Cpu* cpu) const;
+
     /**
      * Removes the turbo frequencies from the available
      * frequencies from all the domains.
@@ -314,12 +599,87 @@ public:
      */
     RollbackPoint getRollbackPoint() const;
 
+    /**
+     * Measures the latency of the switch between each pair of available
+     * frequencies of a domain. A busy loop is executed on one virtual
+     * core of the domain and its iterations are timed. The switch is
+     * detected when the duration of the iterations becomes the one
+     * calibrated for the target frequency. Pairs of frequencies that
+     * can't be distinguished this way (e.g. because turbo is not
+     * engaged) are not present in the matrix. The result is stored and
+     * can be queried with getTransitionLatency.
+     * NOTE: This call may block the caller for some seconds.
+     * @param domain The domain. It must be local.
+     * @param repetitions How many times each transition is measured.
+     * @param probe The probe used to time the iterations. It must be
+     *        already running and is not stopped by this call. If NULL,
+     *        the busy loop described above is used.
+     * @return The transition latency matrix of the domain.
+     * @throw runtime_error If probe is NULL and none of the virtual
+     *        cores of the domain can be used by the calling process.
+     */
+    TransitionLatencyMatrix measureTransitionLatencies(const Domain* domain, uint repetitions = 3,
+                                                       const TransitionProbe* probe = NULL);
+
+    /**
+     * Returns the transition latency matrix of a domain, as measured
+     * by the last measureTransitionLatencies call.
+     * @param domain The domain.
+     * @return The transition latency matrix of the domain. It is empty
+     *         if the latencies have not been measured.
+     */
+    TransitionLatencyMatrix getTransitionLatencies(const Domain* domain) const;
+
+    /**
+     * Returns the latency of the switch between two frequencies.
+     * @param domain The domain.
+     * @param from The starting frequency.
+     * @param to The target frequency.
+     * @return The latency (nanoseconds) measured by
+     *         measureTransitionLatencies. If not measured, the latency
+     *         declared by the domain (Domain::getTransitionLatency).
+     */
+    double getTransitionLatency(const Domain* domain, Frequency from, Frequency to) const;
+
     /**
      * Bring the domain to a rollback point.
      * @param rollbackPoint A rollback point.
      */
     void rollback(const RollbackPoint& rollbackPoint) const;
 
+    /**
+     * Changes the userspace frequency of many domains at once.
+     * Each domain must be using the userspace governor.
+     * The domains may be changed in parallel, accordingly
+     * the same domain must not appear twice.
+     * @param frequencies Pairs <domain, frequency> to be set.
+     * @return True if all the frequencies have been changed, false
+     *         if at least one of them could not be changed (also if
+     *         the domain threw an exception).
+     */
+    virtual bool setFrequencies(const std::vector<std::pair<Domain*, Frequency> >& frequencies) const;
+
+    /**
+     * Enables the caching of governors, governor bounds and userspace
+     * frequencies of all the domains. Each value is read only once and
+     * then updated whenever it is changed through Mammut, so that
+     * reading it does not require to access the system files.
+     * @param watch If true, the system files are watched and the cached
+     *        values are invalidated when someone else (e.g. tuned or
+     *        cpupower) writes them. If false, changes not performed
+     *        through Mammut are not seen. If the files can't be
+     *        watched anymore, the caching is disabled and can be
+     *        enabled again with this call.
+     * @return True if the caching has been enabled, false if it
+     *         (or the watching) is not supported.
+     */
+    virtual bool enableCaching(bool watch = true);
+
+    /**
+     * Disables the caching enabled with enableCaching.
+     */
+    virtual void disableCaching();
+
     /**
      * Checks the availability of a specific governor.
      * @param governor The governor.
@@ -367,19 +727,99 @@ public:
 
 
 /**
- * Loads a voltage table from a file.
+ * Loads a voltage table from a file. Malformed lines are skipped.
  * @param voltageTable The loaded voltage table.
  * @param fileName The name of the file containing the voltage table.
  */
 void loadVoltageTable(VoltageTable& voltageTable, std::string fileName);
 
 /**
- * Dumps the voltage table on a file.
+ * Dumps the voltage table on a file. The file is replaced atomically.
  * @param voltageTable The voltage table.
  * @param fileName The name of the file where the table must be dumped.
  */
 void dumpVoltageTable(const VoltageTable& voltageTable, std::string fileName);
 
+class VoltageTableThread;
+
+/**
+ * Computes the voltage tables of a set of domains. The domains are
+ * characterized in parallel, one thread per domain.
+ * For each point <N, F> of a table, the voltage is sampled until the
+ * relative standard error of the mean falls below a threshold (or
+ * until a maximum number of samples is taken).
+ * If a checkpoint prefix is set, the table of each domain is dumped
+ * (with dumpVoltageTable) after each point, and the points already
+ * present in the file are not computed again. Accordingly, an
+ * interrupted characterization can be resumed.
+ */
+class VoltageTableBuilder{
+    friend class VoltageTableThread;
+private:
+    std::vector<Domain*> _domains;
+    bool _onlyPhysicalCores;
+    uint _samplingInterval;
+    uint _minSamples;
+    uint _maxSamples;
+    double _maxRelativeError;
+    std::string _checkpointPrefix;
+    uint _timeout;
+
+    VoltageTable build(const Domain* domain, double deadline) const;
+    Voltage sample(const Domain* domain) const;
+public:
+    /**
+     * @param domains The domains to characterize.
+     * @param onlyPhysicalCores If true, only physical cores will be considered.
+     */
+    explicit VoltageTableBuilder(const std::vector<Domain*>& domains,
+                                 bool onlyPhysicalCores = true);
+
+    /**
+     * Sets the sampling parameters.
+     * @param samplingInterval The interval between two samples (milliseconds).
+     * @param minSamples The minimum number of samples for each point.
+     * @param maxSamples The maximum number of samples for each point.
+     * @param maxRelativeError The sampling of a point stops when the
+     *        standard error of the mean, divided by the mean, is lower
+     *        than this value.
+     */
+    void setSampling(uint samplingInterval, uint minSamples, uint maxSamples,
+                     double maxRelativeError);
+
+    /**
+     * Sets the prefix of the checkpoint files. The table of each domain
+     * will be stored in the file returned by getCheckpointFile.
+     * @param prefix The prefix of the checkpoint files. If empty,
+     *        no checkpoint will be done.
+     */
+    void setCheckpoint(const std::string& prefix);
+
+    /**
+     * Returns the checkpoint file of a domain.
+     * @param domain The domain.
+     * @return The checkpoint file of the domain, or an empty string
+     *         if checkpointing is disabled.
+     */
+    std::string getCheckpointFile(const Domain* domain) const;
+
+    /**
+     * Sets the maximum duration of build(). When elapsed, the
+     * characterization stops and the tables are returned (and
+     * checkpointed) with the points computed so far.
+     * @param seconds The maximum duration (seconds). 0 means no timeout.
+     */
+    void setTimeout(uint seconds);
+
+    /**
+     * Computes the voltage tables.
+     * NOTE: This call may block the caller for some minutes.
+     * @return The voltage tables, in the same order of the domains.
+     *         If voltages cannot be read, the tables will be empty.
+     */
+    std::vector<VoltageTable> build() const;
+};
+
 }
 }
 
@@ -3,6 +3,8 @@
 
 #include <mammut/energy/energy.hpp>
 #include <mammut/topology/topology.hpp>
+
+#include <atomic>
 #ifdef HAVE_RAPLCAP
 #include <raplcap/raplcap.h>
 #endif
@@ -27,6 +29,7 @@ private:
 public:
     CounterAmesterLinux(std::string jlsSensor, std::string wtsSensor);
     Joules getJoules();
+    PowerSample getPowerSample();
     void reset();
 };
 
@@ -42,6 +45,7 @@ public:
     CounterPlugSmartPower2Linux(); 
     ~CounterPlugSmartPower2Linux(); 
     Joules getJoules();
+    PowerSample getPowerSample();
     void reset();
 };
 
@@ -65,6 +69,7 @@ private:
     bool init(){return CounterAmesterLinux::init();}
 public:
     Joules getJoules(){return CounterAmesterLinux::getJoules();}
+    PowerSample getPowerSample(){return CounterAmesterLinux::getPowerSample();}
     void reset(){CounterAmesterLinux::reset();}
     CounterPlugAmesterLinux():
         CounterAmesterLinux("JLS250US", "PWR250US"){;}
@@ -80,6 +85,7 @@ private:
 public:
     CounterPlugFileLinux();
     Joules getJoules();
+    PowerSample getPowerSample();
     void reset();
 };
 
@@ -115,6 +121,7 @@ public:
     CounterPlugINALinux();
     ~CounterPlugINALinux();
     Joules getJoules();
+    PowerSample getPowerSample();
     void reset();
 };
 
@@ -127,6 +134,7 @@ private:
     bool init();
 public:
     explicit CounterMemoryRaplLinux();
+    ~CounterMemoryRaplLinux();
     Joules getJoules();
     void reset();
 };
@@ -137,15 +145,29 @@ private:
     bool init(){return CounterAmesterLinux::init();}
 public:
     Joules getJoules(){return CounterAmesterLinux::getJoules();}
+    PowerSample getPowerSample(){return CounterAmesterLinux::getPowerSample();}
     void reset(){CounterAmesterLinux::reset();}
     CounterMemoryAmesterLinux():
         CounterAmesterLinux("JLS250USMEM0", "PWR250USMEM0"){;}
 };
 
+class CounterCpusLinuxRefresher;
+
 class CounterCpusLinux: public CounterCpus{
   friend class CounterCpusLinuxRefresher;
 protected:
     utils::Monitor _stopRefresher;
+    CounterCpusLinuxRefresher* _refresher;
+
+    /**
+     * Starts the refresher thread.
+     */
+    void startRefresher();
+
+    /**
+     * Stops the refresher thread (if started).
+     */
+    void stopRefresher();
 public:
     CounterCpusLinux();
 
@@ -154,14 +176,46 @@ public:
     virtual Joules getJoulesCores(topology::CpuId cpuId) = 0;
     virtual Joules getJoulesGraphic(topology::CpuId cpuId) = 0;
     virtual Joules getJoulesDram(topology::CpuId cpuId) = 0;
+    RefresherStats getRefresherStats();
+
+    /**
+     * Returns the maximum interval (seconds) between two reads of
+     * a counter. It is the time needed by the counter to wrap around
+     * when the Cpu consumes its maximum power.
+     * @return The maximum interval between two reads of a counter.
+     */
     virtual double getWrappingInterval() = 0;
+
+    /**
+     * Returns the highest power (watts) that the components of a Cpu
+     * are allowed to consume, according to the enabled power limits
+     * (e.g. PL1 and PL2).
+     * @return The highest power that the components of a Cpu are
+     *         allowed to consume, or 0 if it is not known.
+     */
+    virtual double getPowerLimit();
+
+    /**
+     * Returns the joules after which the counter wraps around.
+     * @return The joules after which the counter wraps around.
+     */
+    virtual Joules getCounterRange() = 0;
 };
 
+/**
+ * Periodically reads the Cpus counters so that they never wrap around
+ * more than once between two reads. Each Cpu has its own deadline,
+ * computed from the power it consumed since the previous read.
+ */
 class CounterCpusLinuxRefresher: public utils::Thread{
 private:
     CounterCpusLinux* _counter;
+    std::atomic<uint64_t> _wakeups;
+    std::atomic<uint64_t> _refreshes;
+    std::atomic<double> _lastIntervalMs;
 public:
     explicit CounterCpusLinuxRefresher(CounterCpusLinux* counter);
+    RefresherStats getStats() const;
     void run();
 };
 
@@ -178,13 +232,13 @@ private:
     CpuFamily _family;
     bool _initialized;
     utils::LockPthreadMutex _lock;
-    CounterCpusLinuxRefresher* _refresher;
     utils::Msr** _msrs;
     topology::CpuId _maxId;
     double _powerPerUnit;
     double _energyPerUnit;
     double _timePerUnit;
     double _thermalSpecPower;
+    double _powerLimit;
 
     JoulesCpu* _joulesCpus;
 
@@ -196,8 +250,18 @@ private:
     bool _hasJoulesCores;
     bool _hasJoulesGraphic;
     bool _hasJoulesDram;
+    bool _hasJoulesPhysicalCores;
+
+    // Indexed by PhysicalCoreId. Only used when per-core counters are present.
+    std::vector<utils::Msr*> _msrsPhysicalCores;
+    std::vector<uint32_t> _lastReadCountersPhysicalCores;
+    std::vector<Joules> _joulesPhysicalCores;
+    std::vector<topology::CpuId> _physicalCoresCpus;
+    // Indexed by CpuId.
+    std::vector<std::vector<topology::PhysicalCoreId> > _cpusPhysicalCores;
 
-    uint32_t readEnergyCounter(topology::CpuId cpuId, int which);
+    uint32_t readEnergyCounter(topology::CpuId cpuId, uint32_t which);
+    uint32_t readPhysicalCoreEnergyCounter(topology::PhysicalCoreId physicalCoreId);
 
     /**
      * Adds to the 'joules' counter the joules consumed from lastReadCounter to
@@ -209,16 +273,47 @@ private:
      */
     void updateCounter(topology::CpuId cpuId, Joules& joules, uint32_t& lastReadCounter, uint32_t counterType);
 
+    /**
+     * Updates all the available counters of a CPU. Must be called
+     * with _lock held.
+     * @param cpuId The identifier of the CPU.
+     */
+    void updateCounters(topology::CpuId cpuId);
+
+    /**
+     * Updates the counters of the physical cores of a CPU and their sum.
+     * Must be called with _lock held.
+     * @param cpuId The identifier of the CPU.
+     */
+    void updatePhysicalCoresCounters(topology::CpuId cpuId);
+
+    /**
+     * Opens the per-core energy registers (AMD only).
+     * @return True if all the physical cores have the register, false otherwise.
+     */
+    bool initPhysicalCoresCounters();
+
     bool hasCoresCounter(topology::Cpu* cpu);
     bool hasGraphicCounter(topology::Cpu* cpu);
     bool hasDramCounter(topology::Cpu* cpu);
     bool isCpuSupported(topology::Cpu* cpu);
     bool isCpuIntelSupported(topology::Cpu* cpu);
     bool isCpuAMDSupported(topology::Cpu* cpu);
+
+    /**
+     * Reads the power limits of the CPUs.
+     * @return The highest enabled power limit, or 0 if some of the
+     *         components have no limit.
+     */
+    double readPowerLimit();
     double getWrappingInterval();
+    double getPowerLimit();
+    Joules getCounterRange();
 public:
     CounterCpusLinuxMsr();
 
+    JoulesCpu getJoulesComponents(topology::CpuId cpuId);
+    void sampleAll(JoulesCpuSnapshot& snapshot);
     Joules getJoulesCpu(topology::CpuId cpuId);
     Joules getJoulesCores(topology::CpuId cpuId);
     Joules getJoulesGraphic(topology::CpuId cpuId);
@@ -227,6 +322,8 @@ public:
     bool hasJoulesCores();
     bool hasJoulesDram();
     bool hasJoulesGraphic();    
+    bool hasJoulesPhysicalCores();
+    Joules getJoulesPhysicalCore(topology::PhysicalCoreId physicalCoreId);
     void reset();
 private:
     bool init();
@@ -239,15 +336,18 @@ class CounterCpusLinuxSysFs: public CounterCpusLinux{
 private:
     bool _initialized;
     utils::LockPthreadMutex _lock;
-    CounterCpusLinuxRefresher* _refresher;
 
     int _idCores, _idGraphic, _idDram;
     std::vector<Joules> _lastCpu, _lastCores, _lastGraphic, _lastDram;
+    std::vector<utils::SysfsFile*> _filesCpu, _filesCores, _filesGraphic, _filesDram;
     std::vector<JoulesCpu> _joulesCpus;
     double _maxValue;
+    double _maxPower;
 public:
     CounterCpusLinuxSysFs();
 
+    JoulesCpu getJoulesComponents(topology::CpuId cpuId);
+    void sampleAll(JoulesCpuSnapshot& snapshot);
     Joules getJoulesCpu(topology::CpuId cpuId);
     Joules getJoulesCores(topology::CpuId cpuId);
     Joules getJoulesGraphic(topology::CpuId cpuId);
@@ -258,9 +358,13 @@ public:
     bool hasJoulesGraphic();
     void reset();
 private:
-    double getWrappingInterval(){return 10;}
+    double getWrappingInterval();
+    Joules getCounterRange(){return _maxValue;}
     bool init();
-    Joules read(topology::CpuId cpuId, Joules &cumulative, int sub, std::vector<Joules> &last);
+    void openFiles(std::vector<utils::SysfsFile*>& files, int sub);
+    Joules read(topology::CpuId cpuId, Joules &cumulative, const std::vector<utils::SysfsFile*>& files, std::vector<Joules> &last);
+    // Updates all the available counters of a CPU. Must be called with _lock held.
+    void updateCounters(topology::CpuId cpuId);
     ~CounterCpusLinuxSysFs();
 };
 
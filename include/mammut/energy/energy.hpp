@@ -5,11 +5,18 @@
 #include "../module.hpp"
 #include "../topology/topology.hpp"
 
+#include "array"
+#include "atomic"
+#include "deque"
+
+#define MAMMUT_ENERGY_DEFAULT_POWER_WINDOW_MS 1000
+
 namespace mammut{
 namespace energy{
 
 using Joules = double;
 class JoulesCpu;
+class JoulesCpuSnapshot;
 class Energy;
 class PowerCapper;
 
@@ -20,6 +27,54 @@ typedef enum{
     COUNTER_NUM,      ///< Dummy value to indicate last counter
 }CounterType;
 
+/**
+ * @brief The PowerSample struct represents a power reading.
+ */
+struct PowerSample{
+  double timestampMs; ///< The time when the sample was taken (milliseconds).
+  Joules joules;      ///< The joules returned by getJoules() at that time.
+  double watts;       ///< The average power over the estimation window.
+};
+
+/**
+ * @brief The RefresherStats struct represents the activity of the thread
+ *        which prevents the Cpus counters from wrapping around.
+ */
+struct RefresherStats{
+  uint64_t wakeups;      ///< The number of times the thread woke up.
+  uint64_t refreshes;    ///< The number of times a Cpu counter was read.
+  double lastIntervalMs; ///< The last interval chosen for a Cpu (milliseconds).
+};
+
+/*
+ * ! \class PowerEstimator
+ *   \brief Estimates the power from a sequence of cumulative joules.
+ *
+ *   Keeps the samples of the last window and computes the power as the
+ *   ratio between the joules and the time elapsed since the oldest one.
+ *   The history is discarded if the joules decrease (i.e. after a reset).
+ */
+class PowerEstimator: utils::NonCopyable{
+private:
+    utils::LockPthreadMutex _lock;
+    std::deque<std::pair<double, Joules> > _samples;
+public:
+    /**
+     * Adds a sample and returns the power estimated over the window.
+     * The power is 0 until at least two samples are available.
+     * @param timestampMs The time of the sample (milliseconds).
+     * @param joules The cumulative joules at that time.
+     * @param windowMs The length of the window (milliseconds).
+     * @return The power sample.
+     */
+    PowerSample update(double timestampMs, Joules joules, double windowMs);
+
+    /**
+     * Discards all the samples.
+     */
+    void clear();
+};
+
 /*
  * ! \class Counter
  *   \brief A generic energy counter.
@@ -35,6 +90,9 @@ private:
      */
     virtual bool init() = 0;
 protected:
+    PowerEstimator _powerEstimator;
+    double _powerWindowMs;
+    Counter():_powerWindowMs(MAMMUT_ENERGY_DEFAULT_POWER_WINDOW_MS){;}
     virtual ~Counter(){;}
 public:
     /**
@@ -43,6 +101,21 @@ public:
      */
     virtual Joules getJoules() = 0;
 
+    /**
+     * Returns the joules consumed up to this moment, together with the
+     * time of the reading and the power. If the counter does not measure
+     * the power directly, it is estimated over the last window (see
+     * setPowerWindow()).
+     * @return The power sample.
+     */
+    virtual PowerSample getPowerSample();
+
+    /**
+     * Sets the length of the window over which the power is estimated.
+     * @param windowMs The length of the window (milliseconds).
+     */
+    void setPowerWindow(double windowMs);
+
     /**
      * Resets the value of the counter.
      */
@@ -102,6 +175,7 @@ class CounterCpus: public Counter{
 protected:
     topology::Topology* _topology;
     std::vector<topology::Cpu*> _cpus;
+    std::vector<PowerEstimator*> _cpusPowerEstimators;
     explicit CounterCpus(topology::Topology* topology);
 public:
     /**
@@ -110,6 +184,17 @@ public:
      */
     const std::vector<topology::Cpu*>& getCpus(){return _cpus;}
 
+    using Counter::getPowerSample;
+
+    /**
+     * Returns the joules consumed by a Cpu up to this moment, together
+     * with the time of the reading and the power estimated over the
+     * last window (see setPowerWindow()).
+     * @param cpuId The identifier of a Cpu.
+     * @return The power sample.
+     */
+    virtual PowerSample getPowerSample(topology::CpuId cpuId);
+
     /**
      * Returns the Joules consumed by a Cpu and its components
      * since the counter creation (or since the last call of reset()).
@@ -136,6 +221,23 @@ public:
      */
     virtual JoulesCpu getJoulesComponentsAll();
 
+    /**
+     * Samples all the Cpus and their components at once. All the values
+     * are read in the same pass and share the same timestamp.
+     * @param snapshot The snapshot where the values are stored. Its 'joules'
+     *        vector is indexed by CpuId and is resized only if needed, so
+     *        the same snapshot can be reused without allocations.
+     */
+    virtual void sampleAll(JoulesCpuSnapshot& snapshot);
+
+    /**
+     * Returns the statistics of the thread which periodically reads
+     * the counters to prevent them from wrapping around. They are all
+     * zero if there is no such thread.
+     * @return The statistics of the refresher thread.
+     */
+    virtual RefresherStats getRefresherStats();
+
     /**
      * Returns the Joules consumed by a Cpu since the counter creation
      * (or since the last call of reset()).
@@ -194,6 +296,34 @@ public:
      */
     virtual Joules getJoulesCoresAll();
 
+    /**
+     * Returns true if the counters for the individual physical cores are
+     * present, false otherwise.
+     * @return True if the counters for the individual physical cores are
+     *         present, false otherwise.
+     */
+    virtual bool hasJoulesPhysicalCores();
+
+    /**
+     * Returns the Joules consumed by a physical core since the counter
+     * creation (or since the last call of reset()).
+     * @param physicalCoreId The identifier of a physical core.
+     * @return The Joules consumed by the physical core since the counter
+     *         creation (or since the last call of reset()). 0 if the
+     *         counters for the physical cores are not present.
+     */
+    virtual Joules getJoulesPhysicalCore(topology::PhysicalCoreId physicalCoreId);
+
+    /**
+     * Returns the Joules consumed by a physical core since the counter
+     * creation (or since the last call of reset()).
+     * @param physicalCore The physical core.
+     * @return The Joules consumed by the physical core since the counter
+     *         creation (or since the last call of reset()). 0 if the
+     *         counters for the physical cores are not present.
+     */
+    Joules getJoulesPhysicalCore(topology::PhysicalCore* physicalCore);
+
     /**
      * Returns true if the counter for integrated graphic card is present, false otherwise.
      * @return True if the counter for integrated graphic card is present, false otherwise.
@@ -264,7 +394,7 @@ public:
 private:
     virtual bool init() = 0;
 protected:
-    virtual ~CounterCpus(){;}
+    virtual ~CounterCpus();
 };
 
 /**
@@ -523,6 +653,137 @@ inline std::ostream& operator<<(std::ostream& os, const JoulesCpu& obj){
     return os;
 }
 
+/*!
+ * \class JoulesCpuSnapshot
+ * \brief The values read from a Cpu energy counter for all the Cpus at the same time.
+ */
+class JoulesCpuSnapshot{
+public:
+    double timestamp; ///< Time of the sample (milliseconds).
+    std::vector<JoulesCpu> joules; ///< Values of the Cpus, indexed by CpuId.
+
+    JoulesCpuSnapshot():timestamp(0){;}
+
+    /**
+     * Returns the sum of the values of all the Cpus.
+     * @return The sum of the values of all the Cpus.
+     */
+    JoulesCpu getTotal() const{
+        JoulesCpu r;
+        for(size_t i = 0; i < joules.size(); i++){
+            r += joules[i];
+        }
+        return r;
+    }
+};
+
+/**
+ * @brief The EnergySamplerRecord struct represents a value read by the EnergySampler.
+ */
+struct EnergySamplerRecord{
+  uint64_t sample;       ///< Progressive number of the sample the record belongs to.
+  double timestampMs;    ///< The time of the sample (milliseconds).
+  CounterType type;      ///< The counter the value was read from.
+  topology::CpuId cpuId; ///< The Cpu (only meaningful for COUNTER_CPUS).
+  JoulesCpu joules;      ///< The value. For COUNTER_PLUG and COUNTER_MEMORY only 'cpu' is set.
+};
+
+/**
+ * @brief The EnergySamplerCursor struct represents the position of a reader.
+ */
+struct EnergySamplerCursor{
+  uint64_t next; ///< The next record to read.
+  uint64_t lost; ///< Records overwritten before the reader could get them.
+};
+
+/*
+ * ! \class EnergySampler
+ *   \brief A thread which periodically samples all the energy counters.
+ *
+ *   At each period, one record for each Cpu and one record for each other
+ *   available counter are stored in a ring buffer. The buffer has a single
+ *   writer (the sampler) and any number of readers, each one with its own
+ *   cursor. Readers never block the sampler: if a reader is too slow, the
+ *   oldest records are overwritten and counted in the 'lost' field of its
+ *   cursor.
+ *   While the sampler is running, the counters should not be reset.
+ */
+class EnergySampler: public utils::Thread{
+private:
+    typedef struct{
+        std::atomic<uint64_t> sequence;
+        EnergySamplerRecord record;
+    }Slot;
+
+    Energy* _energy;
+    double _periodMs;
+    int _virtualCoreId;
+    Slot* _slots;
+    size_t _mask;
+    std::atomic<uint64_t> _head;
+    std::atomic<bool> _stop;
+    std::atomic<bool> _failed;
+    std::string _error;
+    JoulesCpuSnapshot _snapshot;
+
+    void push(uint64_t sample, double timestampMs, CounterType type,
+              topology::CpuId cpuId, const JoulesCpu& joules);
+    void sample(uint64_t sample);
+public:
+    /**
+     * Creates the sampler. It must be started with start().
+     * @param energy The energy module.
+     * @param periodMs The sampling period (milliseconds).
+     * @param capacity The minimum number of records in the ring buffer.
+     *        It is rounded up to the next power of two.
+     * @param virtualCore If not NULL, the sampler thread is pinned on
+     *        this virtual core.
+     */
+    EnergySampler(Energy* energy, double periodMs, size_t capacity = 4096,
+                  const topology::VirtualCore* virtualCore = NULL);
+
+    ~EnergySampler();
+
+    /**
+     * Stops the sampler and waits for its termination.
+     */
+    void stop();
+
+    /**
+     * Returns the error which made the sampler terminate, if any
+     * (e.g. if it was not possible to pin it on the virtual core or
+     * to read the counters).
+     * @return The error, or an empty string if the sampler did not fail.
+     */
+    std::string getError() const;
+
+    /**
+     * Returns a cursor positioned after the last stored record.
+     * @return A cursor positioned after the last stored record.
+     */
+    EnergySamplerCursor getCursor() const;
+
+    /**
+     * Reads the next record.
+     * @param cursor The cursor of the reader. It is advanced past the
+     *        read record.
+     * @param record The read record.
+     * @return True if a record was read, false if there are no new records.
+     */
+    bool read(EnergySamplerCursor& cursor, EnergySamplerRecord& record) const;
+
+    /**
+     * Reads all the available records.
+     * @param cursor The cursor of the reader. It is advanced past the
+     *        read records.
+     * @param records The read records are appended here.
+     * @return The number of read records.
+     */
+    size_t read(EnergySamplerCursor& cursor, std::vector<EnergySamplerRecord>& records) const;
+
+    void run();
+};
+
 }
 }
 
@@ -12,12 +12,19 @@ class ExecutionUnitLinux: public virtual Task{
 private:
     TaskId _id;
     std::string _path;
+    utils::SysfsFile _statFile;
+    utils::SysfsFile _upTimeFile;
     double _hertz;
     double _lastCpuTime;
     double _lastUpTime;
     double getUpTime() const;
     double getCpuTime() const;
-    std::vector<std::string> getStatFields() const;
+    /**
+     * Reads the fields of the stat file of this execution unit.
+     * @param fields An array of PROC_STAT_NUM elements where the fields
+     *        will be stored (the command name and state are stored as 0).
+     */
+    void getStatFields(int64_t* fields) const;
     virtual std::string getSetPriorityIdentifiers() const = 0;
 public:
     ExecutionUnitLinux(TaskId id, std::string path);
@@ -31,6 +38,8 @@ public:
     bool move(const topology::Cpu* cpu) const;
     bool move(const topology::PhysicalCore* physicalCore) const;
     bool move(const topology::VirtualCore* virtualCore) const;
+    bool move(const topology::NumaNode* numaNode) const;
+    bool move(const topology::CacheDomain* cacheDomain) const;
     bool move(topology::VirtualCoreId virtualCoreId) const;
     bool move(const std::vector<topology::VirtualCore*>& virtualCores) const;
     bool move(const std::vector<const topology::VirtualCore*>& virtualCores) const;
@@ -111,6 +120,8 @@ public:
     std::vector<TaskId> getActiveThreadsIdentifiers() const;
     ThreadHandler* getThreadHandler(TaskId tid) const;
     void releaseThreadHandler(ThreadHandler* thread) const;
+    bool moveThreads(const std::vector<TaskId>& threads,
+                     const std::vector<std::vector<topology::VirtualCoreId> >& virtualCoresIds) const;
     bool move(const std::vector<topology::VirtualCoreId>& virtualCoresIds) const;
     bool getInstructions(double& instructions);
     bool resetInstructions();
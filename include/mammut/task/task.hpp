@@ -106,6 +106,24 @@ public:
      */
     virtual bool move(const topology::VirtualCore* virtualCore) const = 0;
 
+    /**
+     * Move this execution unit on a specified NUMA node.
+     * NOTE: If executed on a process, all its threads will be moved too.
+     * @param numaNode The NUMA node on which this execution unit must be moved.
+     * @return If false is returned, this execution unit is no more active and the call failed.
+     *         Otherwise, true is returned.
+     */
+    virtual bool move(const topology::NumaNode* numaNode) const = 0;
+
+    /**
+     * Move this execution unit on the virtual cores sharing a specified cache.
+     * NOTE: If executed on a process, all its threads will be moved too.
+     * @param cacheDomain The cache domain on which this execution unit must be moved.
+     * @return If false is returned, this execution unit is no more active and the call failed.
+     *         Otherwise, true is returned.
+     */
+    virtual bool move(const topology::CacheDomain* cacheDomain) const = 0;
+
     /**
      * Move this execution unit on a specified virtual core.
      * NOTE: If executed on a process, all its threads will be moved too.
@@ -178,6 +196,19 @@ public:
      */
     virtual void releaseThreadHandler(ThreadHandler* thread) const = 0;
 
+    /**
+     * Moves many threads of this process at once, each one on a
+     * different set of virtual cores. Threads which are no more
+     * active are skipped.
+     * @param threads The identifiers of the threads.
+     * @param virtualCoresIds The virtual cores on which each thread must be
+     *        moved, in the same order of threads.
+     * @return If false is returned, this process is no more active and the
+     *         call failed. Otherwise, true is returned.
+     */
+    virtual bool moveThreads(const std::vector<TaskId>& threads,
+                             const std::vector<std::vector<topology::VirtualCoreId> >& virtualCoresIds) const = 0;
+
     virtual ~ProcessHandler(){;}
 
     /**
@@ -301,6 +332,81 @@ public:
     virtual void releaseThreadHandler(ThreadHandler* thread) const = 0;
 };
 
+typedef enum{
+    /**
+     * Threads are placed on consecutive virtual cores, filling all
+     * the virtual cores of a physical core (and then of a CPU) before
+     * moving to the next one.
+     **/
+    PLACEMENT_COMPACT = 0,
+    /**
+     * Threads are distributed in round robin over the CPUs. On each CPU,
+     * all its physical cores are used before using SMT siblings.
+     **/
+    PLACEMENT_SCATTER,
+    /**
+     * Threads are distributed in round robin over the last level cache
+     * domains (e.g. the CCXs on AMD Zen), to maximize the cache available
+     * to each thread.
+     **/
+    PLACEMENT_PER_CACHE,
+    /**
+     * Threads are distributed in round robin over the NUMA nodes.
+     **/
+    PLACEMENT_PER_NUMA,
+    /**
+     * One thread per physical core, in compact order. SMT siblings are
+     * used only when there are more threads than physical cores.
+     **/
+    PLACEMENT_AVOID_SMT
+}PlacementPolicy;
+
+/**
+ * Computes the placement of a set of threads on the virtual cores of
+ * a topology according to a policy, and applies it to a process.
+ */
+class PlacementPlanner{
+private:
+    const topology::Topology* _topology;
+
+    std::vector<topology::VirtualCore*> interleave(const std::vector<std::vector<topology::VirtualCore*> >& groups) const;
+public:
+    /**
+     * @param topology The topology. It must be valid for the whole
+     *        lifetime of the planner.
+     */
+    explicit PlacementPlanner(const topology::Topology* topology);
+
+    /**
+     * Returns the order in which a policy uses the virtual cores.
+     * @param policy The policy.
+     * @return The virtual cores, in the order in which they are assigned
+     *         to the threads.
+     */
+    std::vector<topology::VirtualCore*> getOrder(PlacementPolicy policy) const;
+
+    /**
+     * Computes the placement of a given number of threads.
+     * If there are more threads than virtual cores, the virtual cores
+     * are reused in the same order.
+     * @param numThreads The number of threads.
+     * @param policy The policy.
+     * @return The virtual core of each thread.
+     */
+    std::vector<topology::VirtualCore*> plan(size_t numThreads, PlacementPolicy policy) const;
+
+    /**
+     * Places all the active threads of a process according to a policy.
+     * Threads are assigned to the virtual cores in increasing order of
+     * identifier (i.e. the main thread is the first one).
+     * @param process The process.
+     * @param policy The policy.
+     * @return If false is returned, the process is no more active and
+     *         the call failed. Otherwise, true is returned.
+     */
+    bool apply(const ProcessHandler* process, PlacementPolicy policy) const;
+};
+
 }
 }
 
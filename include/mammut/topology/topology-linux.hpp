@@ -3,28 +3,204 @@
 
 #include "topology.hpp"
 
+#include "string"
+#include "unordered_map"
+
 namespace mammut{
 namespace topology{
 
 std::string getTopologyPathFromVirtualCoreId(VirtualCoreId id);
 
+typedef enum{
+    PROC_STAT_NAME = 0,
+    PROC_STAT_USER,
+    PROC_STAT_NICE,
+    PROC_STAT_SYSTEM,
+    PROC_STAT_IDLE,
+    PROC_STAT_IOWAIT,
+    PROC_STAT_IRQ,
+    PROC_STAT_SOFTIRQ,
+    PROC_STAT_STEAL,
+    PROC_STAT_GUEST,
+    PROC_STAT_GUEST_NICE
+}ProcStatTimeType;
+
+/**
+ * A snapshot of the per virtual core lines of /proc/stat.
+ * The file is parsed once for all the virtual cores and the ticks are
+ * stored as a structure of arrays indexed by virtual core identifier.
+ */
+class ProcStatSnapshot{
+private:
+    utils::SysfsFile _file;
+    std::vector<char> _buffer;
+    std::vector<uint64_t> _ticks[PROC_STAT_GUEST_NICE];
+    std::vector<bool> _present;
+    double _clockTicksPerSecond;
+public:
+    /**
+     * @param maxVirtualCoreId The highest identifier of the virtual cores.
+     */
+    explicit ProcStatSnapshot(VirtualCoreId maxVirtualCoreId);
+
+    /**
+     * Reads /proc/stat again and updates the snapshot.
+     */
+    void update();
+
+    /**
+     * Returns true if the virtual core was present (i.e. online) in
+     * the last snapshot.
+     * @param virtualCoreId The identifier of the virtual core.
+     * @return True if the virtual core was present in the last snapshot.
+     */
+    bool isPresent(VirtualCoreId virtualCoreId) const;
+
+    /**
+     * Returns a field of the line of a virtual core (in ticks).
+     * @param virtualCoreId The identifier of the virtual core.
+     * @param type The field.
+     * @return The value of the field (in ticks).
+     */
+    uint64_t getTicks(VirtualCoreId virtualCoreId, ProcStatTimeType type) const;
+
+    /**
+     * Returns a field of the line of a virtual core (in microseconds).
+     * @param virtualCoreId The identifier of the virtual core.
+     * @param type The field.
+     * @return The value of the field (in microseconds), -1 if the
+     *         virtual core was not present in the last snapshot.
+     */
+    double getTime(VirtualCoreId virtualCoreId, ProcStatTimeType type) const;
+};
+
+/**
+ * The information about a virtual core reported by /proc/cpuinfo.
+ */
+typedef struct{
+    std::string vendorId;
+    std::string family;
+    std::string model;
+    std::string modelName;
+    // Bitset of the flags, indexed as specified by CpuInfoLinux.
+    std::vector<uint64_t> flags;
+}VirtualCoreInfo;
+
+/**
+ * The content of /proc/cpuinfo, parsed once when the topology is built.
+ * On x86 machines where the file is not available, the information is
+ * read through the CPUID instruction.
+ */
+class CpuInfoLinux{
+private:
+    std::vector<VirtualCoreInfo> _infos;
+    std::vector<bool> _present;
+    std::unordered_map<std::string, size_t> _flagsIndexes;
+
+    void addFlag(VirtualCoreInfo& info, const std::string& flagName);
+    bool parseProcCpuInfo();
+    void parseCpuId();
+public:
+    /**
+     * @param maxVirtualCoreId The highest identifier of the virtual cores.
+     */
+    explicit CpuInfoLinux(VirtualCoreId maxVirtualCoreId);
+
+    /**
+     * Returns the information about a virtual core. If the virtual core
+     * is not listed (e.g. because it was offline when the topology was
+     * built), the information about the first listed one is returned.
+     * @param virtualCoreId The identifier of the virtual core.
+     * @return The information about the virtual core.
+     */
+    const VirtualCoreInfo& getInfo(VirtualCoreId virtualCoreId) const;
+
+    /**
+     * Checks if a virtual core has a specific flag.
+     * @param virtualCoreId The identifier of the virtual core.
+     * @param flagName The name of the flag.
+     * @return True if the virtual core has the flag, false otherwise.
+     */
+    bool hasFlag(VirtualCoreId virtualCoreId, const std::string& flagName) const;
+};
+
+class IdleResidencyCounterLinux: public IdleResidencyCounter{
+    friend class IdleResidencyLinux;
+private:
+    const utils::Msr& _msr;
+    uint32_t _register;
+    uint64_t _lastTicks;
+    uint64_t _lastTsc;
+public:
+    IdleResidencyCounterLinux(const utils::Msr& msr, uint32_t reg,
+                              uint levelId, bool package);
+    uint64_t getAbsoluteTicks() const;
+    uint64_t getTicks() const;
+    double getResidency() const;
+    void resetTicks();
+};
+
+/**
+ * The residency counters of the core (or package) idle levels, seen
+ * from a virtual core. The counters which are present are found by
+ * probing the MSRs. All the counters are read in a single batch,
+ * together with the TSC.
+ */
+class IdleResidencyLinux{
+private:
+    utils::Msr _msr;
+    std::vector<IdleResidencyCounter*> _counters;
+    // The TSC followed by the registers of the counters.
+    std::vector<uint32_t> _registers;
+    mutable std::vector<uint64_t> _values;
+public:
+    /**
+     * @param virtualCoreId The virtual core used to read the MSRs.
+     * @param package If true, the package counters are read, otherwise
+     *        the core ones.
+     */
+    IdleResidencyLinux(VirtualCoreId virtualCoreId, bool package);
+    ~IdleResidencyLinux();
+    std::vector<IdleResidencyCounter*> getCounters() const;
+    void getResidencies(std::vector<double>& residencies) const;
+    void reset();
+};
+
 class TopologyLinux: public Topology{
+private:
+    CpuInfoLinux _cpuInfo;
+    mutable utils::LockPthreadMutex _procStatLock;
+    mutable ProcStatSnapshot _procStat;
+
+    std::vector<VirtualCore*> getVirtualCores(const std::string& cpuList) const;
+    void buildNumaNodes();
+    void buildCacheDomains();
 public:
     TopologyLinux();
     void maximizeUtilization() const;
     void resetUtilization() const;
+    void getIdleTimes(std::vector<double>& idleTimes) const;
+    void resetIdleTimes();
 };
 
 class CpuLinux: public Cpu{
+    friend class TopologyLinux;
 private:
-    std::string getCpuInfo(const std::string& infoName) const;
+    const CpuInfoLinux* _cpuInfo;
+    mutable IdleResidencyLinux* _idleResidency;
+    const VirtualCoreInfo& getCpuInfo() const;
+    IdleResidencyLinux* getIdleResidency() const;
 public:
     CpuLinux(CpuId cpuId, std::vector<PhysicalCore*> physicalCores);
+    ~CpuLinux();
     std::string getVendorId() const;
     std::string getFamily() const;
     std::string getModel() const;
     void maximizeUtilization() const;
     void resetUtilization() const;
+    std::vector<IdleResidencyCounter*> getIdleResidencyCounters() const;
+    void getIdleResidencies(std::vector<double>& residencies) const;
+    void resetIdleResidencies();
 };
 
 class PhysicalCoreLinux: public PhysicalCore{
@@ -40,8 +216,13 @@ class VirtualCoreIdleLevelLinux: public VirtualCoreIdleLevel{
 private:
     const VirtualCoreLinux& _virtualCore;
     std::string _path;
-    uint _lastAbsTime;
-    uint _lastAbsCount;
+    utils::SysfsFile _timeFile;
+    utils::SysfsFile _usageFile;
+    mutable uint64_t _lastAbsTime;
+    mutable uint64_t _lastAbsCount;
+    mutable bool _baseline;
+
+    void takeBaseline() const;
 public:
     VirtualCoreIdleLevelLinux(const VirtualCoreLinux& virtualCore, uint levelId);
     std::string getName() const;
@@ -52,11 +233,11 @@ public:
     void disable() const;
     uint getExitLatency() const;
     uint getConsumedPower() const;
-    uint getAbsoluteTime() const;
-    uint getTime() const;
+    uint64_t getAbsoluteTime() const;
+    uint64_t getTime() const;
     void resetTime();
-    uint getAbsoluteCount() const;
-    uint getCount() const;
+    uint64_t getAbsoluteCount() const;
+    uint64_t getCount() const;
     void resetCount();
 };
 
@@ -82,30 +263,21 @@ public:
     void run();
 };
 
-typedef enum{
-    PROC_STAT_NAME = 0,
-    PROC_STAT_USER,
-    PROC_STAT_NICE,
-    PROC_STAT_SYSTEM,
-    PROC_STAT_IDLE,
-    PROC_STAT_IOWAIT,
-    PROC_STAT_IRQ,
-    PROC_STAT_SOFTIRQ,
-    PROC_STAT_STEAL,
-    PROC_STAT_GUEST,
-    PROC_STAT_GUEST_NICE
-}ProcStatTimeType;
-
 class VirtualCoreLinux: public VirtualCore{
+    friend class TopologyLinux;
 private:
+    const CpuInfoLinux* _cpuInfo;
     std::string _hotplugFile;
     std::vector<VirtualCoreIdleLevel*> _idleLevels;
     double _lastProcIdleTime;
+    utils::SysfsFile _procStatFile;
+    mutable std::vector<char> _procStatBuffer;
     SpinnerThread* _utilizationThread;
     utils::Msr _clkModMsr;
     uint _clkModLowBit;
     double _clkModStep;
     std::vector<double> _clkModValues;
+    mutable IdleResidencyLinux* _idleResidency;
 
     /**
      * Returns a specified time field of the line of this virtual core in /proc/stat file (in microseconds).
@@ -119,6 +291,12 @@ private:
      * @return The absolute idle time of this virtual core (in microseconds).
      */
     double getAbsoluteIdleTime() const;
+
+    /**
+     * Returns the residency counters, probing them at the first call.
+     * @return The residency counters.
+     */
+    IdleResidencyLinux* getIdleResidency() const;
 public:
     VirtualCoreLinux(CpuId cpuId, PhysicalCoreId physicalCoreId, VirtualCoreId virtualCoreId);
     ~VirtualCoreLinux();
@@ -130,6 +308,22 @@ public:
     double getIdleTime() const;
     void resetIdleTime();
 
+    /**
+     * Returns the idle time of this virtual core, computed on a snapshot
+     * of /proc/stat.
+     * @param snapshot The snapshot.
+     * @return The idle time (in microseconds) since the last reset,
+     *         or -1 if the virtual core is not in the snapshot.
+     */
+    double getIdleTime(const ProcStatSnapshot& snapshot) const;
+
+    /**
+     * Resets the idle time of this virtual core, by using a snapshot of
+     * /proc/stat.
+     * @param snapshot The snapshot.
+     */
+    void resetIdleTime(const ProcStatSnapshot& snapshot);
+
     bool isHotPluggable() const;
     bool isHotPlugged() const;
     void hotPlug() const;
@@ -141,6 +335,9 @@ public:
     double getClockModulation() const;
 
     std::vector<VirtualCoreIdleLevel*> getIdleLevels() const;
+    std::vector<IdleResidencyCounter*> getIdleResidencyCounters() const;
+    void getIdleResidencies(std::vector<double>& residencies) const;
+    void resetIdleResidencies();
 };
 
 }
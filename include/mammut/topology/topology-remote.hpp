@@ -24,6 +24,7 @@ public:
     std::string getModel() const;
     void maximizeUtilization() const;
     void resetUtilization() const;
+    std::vector<IdleResidencyCounter*> getIdleResidencyCounters() const;
 };
 
 class PhysicalCoreRemote: public PhysicalCore{
@@ -51,11 +52,11 @@ public:
     void disable() const;
     uint getExitLatency() const;
     uint getConsumedPower() const;
-    uint getAbsoluteTime() const;
-    uint getTime() const;
+    uint64_t getAbsoluteTime() const;
+    uint64_t getTime() const;
     void resetTime();
-    uint getAbsoluteCount() const;
-    uint getCount() const;
+    uint64_t getAbsoluteCount() const;
+    uint64_t getCount() const;
     void resetCount();
 };
 
@@ -87,6 +88,7 @@ public:
     double getClockModulation() const;
 
     std::vector<VirtualCoreIdleLevel*> getIdleLevels() const;
+    std::vector<IdleResidencyCounter*> getIdleResidencyCounters() const;
 };
 
 }
@@ -4,6 +4,8 @@
  * CPU: A system is composed by one or more CPU. Each of them has one or more physical core.
  * Physical Core: The basic computation unit of the CPU.
  * Virtual core: When HyperThreading is present, more virtual cores will correspond to a same physical core.
+ * NUMA node: A set of virtual cores sharing the same local memory.
+ * Cache domain: A set of virtual cores sharing the same cache (e.g. on AMD Zen the L3 cache domains are the CCXs).
  **/
 
 #ifndef MAMMUT_TOPOLOGY_HPP_
@@ -11,6 +13,7 @@
 
 #include "../communicator.hpp"
 #include "../module.hpp"
+#include "../utils.hpp"
 
 #include "stdint.h"
 #include "vector"
@@ -21,10 +24,21 @@ namespace topology{
 class VirtualCore;
 class PhysicalCore;
 class Cpu;
+class NumaNode;
+class CacheDomain;
+class VirtualCoreIdleLevel;
+class IdleResidencyCounter;
 
 using CpuId = uint32_t;
 using PhysicalCoreId = uint32_t;
 using VirtualCoreId = uint32_t;
+using NumaNodeId = uint32_t;
+
+typedef enum{
+    CACHE_TYPE_DATA = 0,
+    CACHE_TYPE_INSTRUCTION,
+    CACHE_TYPE_UNIFIED
+}CacheType;
 
 // @cond HIDDEN_SYMBOLS
 typedef struct{
@@ -53,6 +67,28 @@ public:
     virtual void resetUtilization() const = 0;
 };
 
+/**
+ * The residency of the idle levels of all the virtual cores, stored as a
+ * dense matrix. Row i refers to the i-th virtual core returned by
+ * Topology::getVirtualCores(), column j to the idle level with identifier j.
+ * Virtual cores without a level have 0 in the corresponding column.
+ */
+struct IdleLevelsSample{
+    size_t numLevels;
+    // Microseconds spent in each level.
+    std::vector<uint64_t> time;
+    // Number of times each level was entered.
+    std::vector<uint64_t> count;
+
+    inline uint64_t getTime(size_t virtualCoreIndex, uint levelId) const{
+        return time[virtualCoreIndex * numLevels + levelId];
+    }
+
+    inline uint64_t getCount(size_t virtualCoreIndex, uint levelId) const{
+        return count[virtualCoreIndex * numLevels + levelId];
+    }
+};
+
 struct RollbackPoint{
     std::vector<bool> plugged;  
     std::vector<double> clockModulation;
@@ -64,15 +100,36 @@ protected:
     std::vector<Cpu*> _cpus;
     std::vector<PhysicalCore*> _physicalCores;
     std::vector<VirtualCore*> _virtualCores;
+    std::vector<NumaNode*> _numaNodes;
+    std::vector<CacheDomain*> _cacheDomains;
+    // Indexed by virtual core identifier.
+    std::vector<NumaNode*> _virtualCoreNumaNode;
+    std::vector<std::vector<CacheDomain*> > _virtualCoreCacheDomains;
+    // Dense matrix of the idle levels, same layout of IdleLevelsSample.
+    std::vector<VirtualCoreIdleLevel*> _idleLevels;
+    size_t _numIdleLevels;
+    std::vector<uint64_t> _lastIdleLevelsTime;
+    std::vector<uint64_t> _lastIdleLevelsCount;
     Communicator* const _communicator;
 
+    /**
+     * Builds the lookup tables from the virtual cores to their NUMA node
+     * and cache domains. Must be called after _numaNodes and _cacheDomains
+     * have been filled.
+     */
+    void indexLocalityDomains();
+
     Topology();
     explicit Topology(Communicator* const communicator);
     virtual ~Topology();
 private:
-    void buildCpuVector(std::vector<VirtualCoreCoordinates> coord);
-    std::vector<PhysicalCore*> buildPhysicalCoresVector(std::vector<VirtualCoreCoordinates> coord, CpuId cpuId);
-    std::vector<VirtualCore*> buildVirtualCoresVector(std::vector<VirtualCoreCoordinates> coord, CpuId cpuId, PhysicalCoreId physicalCoreId);
+    void buildCpuVector(const std::vector<VirtualCoreCoordinates>& coord);
+    std::vector<PhysicalCore*> buildPhysicalCoresVector(const std::vector<VirtualCoreCoordinates>& coord,
+                                                        const std::vector<std::vector<size_t> >& physicalCoresIndexes);
+    std::vector<VirtualCore*> buildVirtualCoresVector(const std::vector<VirtualCoreCoordinates>& coord,
+                                                      const std::vector<size_t>& virtualCoresIndexes);
+    void buildIdleLevelsMatrix();
+    void readIdleLevels(IdleLevelsSample& sample);
     bool processMessage(const std::string& messageIdIn, const std::string& messageIn,
                                     std::string& messageIdOut, std::string& messageOut);
 public:
@@ -128,6 +185,95 @@ public:
      */
     VirtualCore* getVirtualCore() const;
 
+    /**
+     * Returns the NUMA nodes of the system. On systems without NUMA
+     * support a single node containing all the virtual cores is returned.
+     * @return A vector of NUMA nodes.
+     */
+    std::vector<NumaNode*> getNumaNodes() const;
+
+    /**
+     * Returns the NUMA node with the given identifier, or NULL if it is not present.
+     * @param numaNodeId The identifier of the NUMA node.
+     * @return The NUMA node with the given identifier, or NULL if it is not present.
+     */
+    NumaNode* getNumaNode(NumaNodeId numaNodeId) const;
+
+    /**
+     * Returns the NUMA node of a virtual core, or NULL if it is not known.
+     * @param virtualCore The virtual core.
+     * @return The NUMA node of the virtual core, or NULL if it is not known.
+     */
+    NumaNode* getNumaNode(const VirtualCore* virtualCore) const;
+
+    /**
+     * Returns the cache domains of the system.
+     * @return A vector of cache domains. It is empty if the caches
+     *         information is not available.
+     */
+    std::vector<CacheDomain*> getCacheDomains() const;
+
+    /**
+     * Returns the cache domains of a given level (e.g. 3 for the L3 caches).
+     * @param level The level of the caches.
+     * @return The cache domains of the given level.
+     */
+    std::vector<CacheDomain*> getCacheDomainsAtLevel(uint level) const;
+
+    /**
+     * Returns the cache domains to which a virtual core belongs, from
+     * the lowest to the highest level.
+     * @param virtualCore The virtual core.
+     * @return The cache domains to which the virtual core belongs.
+     */
+    std::vector<CacheDomain*> getCacheDomains(const VirtualCore* virtualCore) const;
+
+    /**
+     * Returns the data (or unified) cache domain of a given level to which a
+     * virtual core belongs, or NULL if it is not present.
+     * @param virtualCore The virtual core.
+     * @param level The level of the cache.
+     * @return The data (or unified) cache domain of the given level to which
+     *         the virtual core belongs, or NULL if it is not present.
+     */
+    CacheDomain* getCacheDomain(const VirtualCore* virtualCore, uint level) const;
+
+    /**
+     * Returns the number of microseconds that each virtual core have been
+     * idle since the last call of resetIdleTime()/resetIdleTimes() (or
+     * since the creation of the virtual core handler).
+     * This is equivalent to calling getIdleTime() on each virtual core but
+     * it may be implemented more efficiently (e.g. with one read of the
+     * idle counters of the whole system).
+     * @param idleTimes The idle times, one for each virtual core, in the
+     *        same order of getVirtualCores(). It is -1 for the virtual
+     *        cores whose idle time can't be read (e.g. offline).
+     */
+    virtual void getIdleTimes(std::vector<double>& idleTimes) const;
+
+    /**
+     * Resets the idle time of all the virtual cores.
+     */
+    virtual void resetIdleTimes();
+
+    /**
+     * Returns, for all the virtual cores and idle levels, the time spent
+     * in the level and the number of times it was entered since the last
+     * call of sampleIdleLevels()/resetIdleLevels(). The first call only
+     * takes the baseline, so all the values are 0. This is equivalent to calling getTime()
+     * and getCount() on each idle level, but all the levels are read in a
+     * single pass and the sample can be reused across calls without
+     * further allocations.
+     * @param sample The sample.
+     */
+    void sampleIdleLevels(IdleLevelsSample& sample);
+
+    /**
+     * Resets the time and count of all the idle levels used by
+     * sampleIdleLevels().
+     */
+    void resetIdleLevels();
+
     /**
      * Returns a rollback point. It can be used to bring the topology
      * back to the point when this function is called.
@@ -251,6 +397,31 @@ public:
      */
     void hotUnplug() const;
 
+    /*****************************************************/
+    /*                   CpuIdle Support                 */
+    /*****************************************************/
+
+    /**
+     * Returns the hardware residency counters of the package idle levels
+     * (package C-States) of this CPU.
+     * @return The residency counters of this CPU. If the vector is empty,
+     *         no counters are available.
+     */
+    virtual std::vector<IdleResidencyCounter*> getIdleResidencyCounters() const = 0;
+
+    /**
+     * Returns the residencies of all the counters returned by
+     * getIdleResidencyCounters(), since their last reset.
+     * @param residencies The residencies, in the same order of
+     *        getIdleResidencyCounters().
+     */
+    virtual void getIdleResidencies(std::vector<double>& residencies) const;
+
+    /**
+     * Resets all the counters returned by getIdleResidencyCounters().
+     */
+    virtual void resetIdleResidencies();
+
     /*****************************************************/
     /*              Clock modulation Support             */
     /*****************************************************/    
@@ -404,6 +575,109 @@ public:
     virtual inline ~PhysicalCore(){;}
 };
 
+class NumaNode: public Unit{
+private:
+    const NumaNodeId _numaNodeId;
+    const std::vector<VirtualCore*> _virtualCores;
+    const std::vector<uint> _distances;
+public:
+    /**
+     * @param numaNodeId The identifier of the NUMA node.
+     * @param virtualCores The virtual cores of the NUMA node.
+     * @param distances The distances from the other NUMA nodes,
+     *        indexed by NUMA node identifier.
+     */
+    NumaNode(NumaNodeId numaNodeId, std::vector<VirtualCore*> virtualCores,
+             std::vector<uint> distances);
+
+    /**
+     * Returns the identifier of this NUMA node.
+     * @return The identifier of this NUMA node.
+     */
+    NumaNodeId getNumaNodeId() const;
+
+    /**
+     * Returns the virtual cores of this NUMA node.
+     * @return A vector of virtual cores.
+     */
+    std::vector<VirtualCore*> getVirtualCores() const;
+
+    /**
+     * Returns a virtual core belonging to this NUMA node, or NULL if it is not present.
+     * @return A virtual core belonging to this NUMA node, or NULL if it is not present.
+     */
+    VirtualCore* getVirtualCore() const;
+
+    /**
+     * Returns the distance of this NUMA node from another NUMA node, as
+     * reported by the firmware (10 is the distance of a node from itself).
+     * @param numaNodeId The identifier of the other NUMA node.
+     * @return The distance between the two NUMA nodes, 0 if not known.
+     */
+    uint getDistance(NumaNodeId numaNodeId) const;
+
+    void maximizeUtilization() const;
+    void resetUtilization() const;
+};
+
+class CacheDomain: public Unit{
+private:
+    const uint _level;
+    const CacheType _type;
+    const uint64_t _size;
+    const uint _lineSize;
+    const std::vector<VirtualCore*> _virtualCores;
+public:
+    /**
+     * @param level The level of the cache.
+     * @param type The type of the cache.
+     * @param size The size of the cache (in bytes).
+     * @param lineSize The size of a cache line (in bytes).
+     * @param virtualCores The virtual cores sharing the cache.
+     */
+    CacheDomain(uint level, CacheType type, uint64_t size, uint lineSize,
+                std::vector<VirtualCore*> virtualCores);
+
+    /**
+     * Returns the level of the cache (e.g. 2 for L2 caches).
+     * @return The level of the cache.
+     */
+    uint getLevel() const;
+
+    /**
+     * Returns the type of the cache.
+     * @return The type of the cache.
+     */
+    CacheType getType() const;
+
+    /**
+     * Returns the size of the cache (in bytes).
+     * @return The size of the cache (in bytes).
+     */
+    uint64_t getSize() const;
+
+    /**
+     * Returns the size of a cache line (in bytes).
+     * @return The size of a cache line (in bytes).
+     */
+    uint getLineSize() const;
+
+    /**
+     * Returns the virtual cores sharing this cache.
+     * @return A vector of virtual cores.
+     */
+    std::vector<VirtualCore*> getVirtualCores() const;
+
+    /**
+     * Returns a virtual core sharing this cache, or NULL if it is not present.
+     * @return A virtual core sharing this cache, or NULL if it is not present.
+     */
+    VirtualCore* getVirtualCore() const;
+
+    void maximizeUtilization() const;
+    void resetUtilization() const;
+};
+
 class VirtualCoreIdleLevel{
 protected:
     const VirtualCoreId _virtualCoreId;
@@ -477,17 +751,17 @@ public:
      * it could be inaccurate.
      * @return The total time spent in this level (in microseconds).
      */
-    virtual uint getAbsoluteTime() const = 0;
+    virtual uint64_t getAbsoluteTime() const = 0;
 
     /**
      * Returns the total time spent in this level (in microseconds)
-     * since the last call of resetTime() (or since the creation of
-     * this object).
+     * since the last call of resetTime() (or since the first access
+     * to this level).
      * It is updated only when there is a level change. Accordingly,
      * it could be inaccurate.
      * @return The total time spent in this level (in microseconds).
      */
-    virtual uint getTime() const = 0;
+    virtual uint64_t getTime() const = 0;
 
     /**
      * Resets the time spent in this level.
@@ -500,17 +774,17 @@ public:
      * it could be inaccurate.
      * @return The number of times this level was entered.
      */
-    virtual uint getAbsoluteCount() const = 0;
+    virtual uint64_t getAbsoluteCount() const = 0;
 
     /**
      * Returns the number of times this level was entered.
-     * since the last call of resetCount() (or since the creation of
-     * this object).
+     * since the last call of resetCount() (or since the first access
+     * to this level).
      * It is updated only when there is a level change. Accordingly,
      * it could be inaccurate.
      * @return The number of times this level was entered.
      */
-    virtual uint getCount() const = 0;
+    virtual uint64_t getCount() const = 0;
 
     /**
      * Resets the count of this level.
@@ -521,6 +795,68 @@ public:
     virtual inline ~VirtualCoreIdleLevel(){;}
 };
 
+/**
+ * A hardware counter of the time spent in an idle level (C-State) of a
+ * core or of a package, read from the MSRs. Differently from
+ * VirtualCoreIdleLevel, the counters are continuously updated by the
+ * hardware and also cover the package idle levels, so they can be
+ * sampled at a fine granularity.
+ * The counters advance at the TSC frequency.
+ */
+class IdleResidencyCounter{
+protected:
+    const uint _levelId;
+    const bool _package;
+
+    IdleResidencyCounter(uint levelId, bool package);
+public:
+    /**
+     * Returns the number of the idle level (e.g. 6 for C6).
+     * @return The number of the idle level.
+     */
+    uint getLevelId() const;
+
+    /**
+     * Returns true if this is a package idle level.
+     * @return True if this is a package idle level, false if it
+     *         is a core idle level.
+     */
+    bool isPackage() const;
+
+    /**
+     * Returns the name of the idle level (e.g. "C6" or "PC6").
+     * @return The name of the idle level.
+     */
+    std::string getName() const;
+
+    /**
+     * Returns the value of the counter (in TSC ticks).
+     * @return The value of the counter (in TSC ticks).
+     */
+    virtual uint64_t getAbsoluteTicks() const = 0;
+
+    /**
+     * Returns the ticks spent in this level since the last call of
+     * resetTicks() (or since the creation of this object).
+     * @return The ticks spent in this level.
+     */
+    virtual uint64_t getTicks() const = 0;
+
+    /**
+     * Returns the fraction of time spent in this level since the last
+     * call of resetTicks() (or since the creation of this object).
+     * @return The fraction of time spent in this level, in [0, 1].
+     */
+    virtual double getResidency() const = 0;
+
+    /**
+     * Resets the ticks spent in this level.
+     */
+    virtual void resetTicks() = 0;
+
+    virtual inline ~IdleResidencyCounter(){;}
+};
+
 class VirtualCore: public Unit{
 protected:
     VirtualCore(CpuId cpuId, PhysicalCoreId physicalCoreId, VirtualCoreId virtualCoreId);
@@ -646,6 +982,28 @@ public:
      */
     virtual std::vector<VirtualCoreIdleLevel*> getIdleLevels() const = 0;
 
+    /**
+     * Returns the hardware residency counters of the core idle levels
+     * (core C-States). Since they are per physical core, the same values
+     * are reported by all the virtual cores of a physical core.
+     * @return The residency counters of this virtual core. If the vector
+     *         is empty, no counters are available.
+     */
+    virtual std::vector<IdleResidencyCounter*> getIdleResidencyCounters() const = 0;
+
+    /**
+     * Returns the residencies of all the counters returned by
+     * getIdleResidencyCounters(), since their last reset.
+     * @param residencies The residencies, in the same order of
+     *        getIdleResidencyCounters().
+     */
+    virtual void getIdleResidencies(std::vector<double>& residencies) const;
+
+    /**
+     * Resets all the counters returned by getIdleResidencyCounters().
+     */
+    virtual void resetIdleResidencies();
+
     /*****************************************************/
     /*              Clock modulation Support             */
     /*****************************************************/    
@@ -679,6 +1037,55 @@ public:
     virtual inline ~VirtualCore(){;}
 };
 
+/**
+ * Limits the wake-up latency of the virtual cores while this object is
+ * alive, so that they only enter the idle levels (C-States) whose exit
+ * latency is within the bound. This is much cheaper than disabling the
+ * idle levels one by one, and the constraint is automatically removed
+ * when the object is destroyed.
+ */
+class IdleLatencyGuard: utils::NonCopyable{
+private:
+    int _fd;
+    std::vector<utils::SysfsFile*> _files;
+    std::vector<std::string> _oldValues;
+    bool _active;
+public:
+    /**
+     * Limits the latency of all the virtual cores of the system,
+     * through /dev/cpu_dma_latency. The constraint is held as long as
+     * the file is kept open.
+     * @param latency The maximum wake-up latency (in microseconds).
+     *        0 keeps the virtual cores in the shallowest idle level.
+     */
+    explicit IdleLatencyGuard(uint latency);
+
+    /**
+     * Limits the latency of some virtual cores only, through their
+     * power/pm_qos_resume_latency_us files. The previous values are
+     * restored when the object is destroyed.
+     * @param virtualCores The virtual cores.
+     * @param latency The maximum wake-up latency (in microseconds).
+     */
+    IdleLatencyGuard(const std::vector<VirtualCore*>& virtualCores, uint latency);
+
+    ~IdleLatencyGuard();
+
+    /**
+     * Returns true if the constraint has been applied (it may fail e.g.
+     * because of missing privileges or kernel support).
+     * @return True if the constraint has been applied, false otherwise.
+     */
+    bool isActive() const;
+
+    /**
+     * Changes the latency bound, without releasing the constraint.
+     * @param latency The maximum wake-up latency (in microseconds).
+     * @return True if the bound has been changed, false otherwise.
+     */
+    bool setLatency(uint latency);
+};
+
 /**
  * Given a set of virtual cores, returns the number of different physical cores
  * to which these virtual cores belong to.
@@ -3,8 +3,10 @@
 
 #include "pthread.h"
 #include "algorithm"
+#include "atomic"
 #include "iostream"
 #include "iterator"
+#include "map"
 #include "memory"
 #include "string"
 #include "sstream"
@@ -28,6 +30,10 @@
 /* Ticks counter */
 #define MSR_TSC 0x10
 
+/* Actual and maximum performance frequency clock counters */
+#define MSR_MPERF 0xE7
+#define MSR_APERF 0xE8
+
 #define MSR_RAPL_POWER_UNIT_INTEL 0x606
 /*
  * Platform specific RAPL Domains.
@@ -64,8 +70,24 @@
 #define MSR_PP0_ENERGY_STATUS_AMD 0xC001029A
 #define MSR_PKG_ENERGY_STATUS_AMD 0xC001029B
 
-/* Voltage */
+/* Voltage and P-states (Intel) */
 #define MSR_PERF_STATUS 0x198
+#define MSR_PERF_CTL 0x199
+#define MSR_TURBO_RATIO_LIMIT 0x1AD
+
+/* Hardware managed P-states (Intel HWP) */
+#define MSR_PM_ENABLE 0x770
+#define MSR_HWP_CAPABILITIES 0x771
+#define MSR_HWP_REQUEST 0x774
+
+/* Hardware managed P-states (AMD CPPC) */
+#define MSR_CPPC_CAP1_AMD 0xC00102B0
+#define MSR_CPPC_ENABLE_AMD 0xC00102B1
+#define MSR_CPPC_REQ_AMD 0xC00102B3
+
+/* Uncore frequency (Intel) */
+#define MSR_UNCORE_RATIO_LIMIT 0x620
+#define MSR_UNCORE_PERF_STATUS 0x621
 
 /* C states */
 #define MSR_PKG_C2_RESIDENCY 0x60D
@@ -504,6 +526,55 @@ double stringToDouble(const std::string& s);
  */
 std::string intToString(int x);
 
+/**
+ * Parses an unsigned integer from a range of characters, without allocating
+ * any memory (the same contract of C++17 std::from_chars). Leading blanks
+ * are skipped.
+ * @param first Pointer to the first character of the range.
+ * @param last Pointer past the last character of the range.
+ * @param value The parsed value. Not modified if no digits are found.
+ * @return A pointer to the first character not consumed, or NULL if the
+ *         range does not start with a number.
+ */
+const char* parseU64(const char* first, const char* last, uint64_t& value);
+
+/**
+ * Parses a (possibly negative) integer from a range of characters, without
+ * allocating any memory. Leading blanks are skipped.
+ * @param first Pointer to the first character of the range.
+ * @param last Pointer past the last character of the range.
+ * @param value The parsed value. Not modified if no digits are found.
+ * @return A pointer to the first character not consumed, or NULL if the
+ *         range does not start with a number.
+ */
+const char* parseS64(const char* first, const char* last, int64_t& value);
+
+/**
+ * Parses the integer fields of a line (e.g. a line of /proc/stat)
+ * without allocating any memory. Consecutive delimiters are considered
+ * as a single one and fields which are not numbers are stored as 0.
+ * Parsing stops at the end of the range or at the first newline.
+ * @param first Pointer to the first character of the range.
+ * @param last Pointer past the last character of the range.
+ * @param fields The array where the fields will be stored.
+ * @param maxFields The maximum number of fields to parse.
+ * @param delim The delimiter.
+ * @return The number of parsed fields.
+ */
+size_t parseFields(const char* first, const char* last, int64_t* fields,
+                   size_t maxFields, char delim = ' ');
+
+/**
+ * Writes the decimal representation of an unsigned integer into a buffer,
+ * without allocating any memory (the same contract of C++17 std::to_chars).
+ * The buffer is not '\0' terminated.
+ * @param value The value.
+ * @param buffer The buffer.
+ * @param size The size of the buffer.
+ * @return The number of characters written, 0 if the buffer is too small.
+ */
+size_t formatU64(uint64_t value, char* buffer, size_t size);
+
 /**
  * Reads the first line of a file.
  * @param fileName The name of the file.
@@ -540,6 +611,14 @@ void writeFile(const std::string& fileName, const std::string& line);
  */
 void dashedRangeToIntegers(const std::string& dashedRange, int& rangeStart, int& rangeStop);
 
+/**
+ * Extracts the integers from a list of ranges of the form "A-B,C,D-E"
+ * (e.g. the content of cpulist and shared_cpu_list sysfs files).
+ * @param rangesList The list of ranges.
+ * @return The integers contained in the ranges, in the same order.
+ */
+std::vector<uint> rangesListToIntegers(const std::string& rangesList);
+
 /**
  * Call a delete on all the elements of a vector and remove the element itself from the vector.
  * @param v The vector.
@@ -613,13 +692,146 @@ bool isNumber(const std::string& s);
  */
 uint getClockTicksPerSecond();
 
+/**
+ * Provides the access to the MSR registers. By default the registers are
+ * accessed through /dev/cpu/N/msr (or msr_safe). A different backend can
+ * be set in SimulationParameters, for example to run without root
+ * privileges or on machines without the registers.
+ */
+class MsrBackend{
+public:
+    virtual ~MsrBackend(){;}
+
+    /**
+     * Returns true if the registers of a virtual core are available.
+     * @param id The identifier of the virtual core.
+     * @return True if the registers are available, false otherwise.
+     */
+    virtual bool available(uint32_t id) = 0;
+
+    /**
+     * Reads a register of a virtual core.
+     * @param id The identifier of the virtual core.
+     * @param which The register.
+     * @param value The value of the register.
+     * @return True if the register is present, false otherwise.
+     */
+    virtual bool read(uint32_t id, uint32_t which, uint64_t& value) = 0;
+
+    /**
+     * Writes a register of a virtual core.
+     * @param id The identifier of the virtual core.
+     * @param which The register.
+     * @param value The value to write.
+     * @return True if the register is present, false otherwise.
+     */
+    virtual bool write(uint32_t id, uint32_t which, uint64_t value) = 0;
+};
+
+#define MSR_SIMULATED_ALL_CORES 0xFFFFFFFF
+
+/**
+ * An in-memory MsrBackend. Registers which have not been set are not
+ * present. Energy registers advance according to a power which can be
+ * changed at any time (piecewise constant model). Time can either be
+ * the real one or be advanced explicitly, to get deterministic values.
+ */
+class MsrBackendSimulated: public MsrBackend{
+private:
+    typedef struct{
+        double watts;
+        double energyPerUnit;
+        double joules;     // Accumulated up to lastUpdate.
+        double lastUpdate; // Milliseconds.
+    }EnergyRegister;
+
+    typedef std::pair<uint32_t, uint32_t> RegisterId;
+
+    LockPthreadMutex _lock;
+    uint32_t _numVirtualCores;
+    bool _realTime;
+    double _time;
+    std::map<RegisterId, uint64_t> _registers;
+    std::map<RegisterId, EnergyRegister> _energyRegisters;
+
+    double now() const;
+    EnergyRegister* findEnergyRegister(uint32_t id, uint32_t which);
+public:
+    /**
+     * @param numVirtualCores The number of simulated virtual cores.
+     * @param realTime If true, the energy registers advance with the real
+     *        time. Otherwise, they only advance when advanceTime() is called.
+     */
+    explicit MsrBackendSimulated(uint32_t numVirtualCores, bool realTime = false);
+
+    /**
+     * Sets the value of a register.
+     * @param which The register.
+     * @param value The value.
+     * @param id The identifier of the virtual core, or MSR_SIMULATED_ALL_CORES
+     *        to set it for all the virtual cores without a specific value.
+     */
+    void setRegister(uint32_t which, uint64_t value, uint32_t id = MSR_SIMULATED_ALL_CORES);
+
+    /**
+     * Sets a 32 bits energy counter register.
+     * @param which The register.
+     * @param watts The power consumed.
+     * @param energyPerUnit The joules represented by one unit of the counter.
+     * @param id The identifier of the virtual core, or MSR_SIMULATED_ALL_CORES
+     *        to set it for all the virtual cores without a specific value.
+     */
+    void setEnergyRegister(uint32_t which, double watts, double energyPerUnit,
+                           uint32_t id = MSR_SIMULATED_ALL_CORES);
+
+    /**
+     * Changes the power of an energy register set with setEnergyRegister().
+     * The energy consumed up to now is accounted with the old power.
+     * @param which The register.
+     * @param watts The new power consumed.
+     * @param id The identifier used when the register was set.
+     */
+    void setPower(uint32_t which, double watts, uint32_t id = MSR_SIMULATED_ALL_CORES);
+
+    /**
+     * Sets up the Intel RAPL registers (units, TDP and energy counters).
+     * The energy unit is 2^-14 joules and the power unit 1/8 watts.
+     * A power equal to 0 means that the counter is not present.
+     * @param thermalSpecPower The TDP (watts).
+     * @param packageWatts The power of the package.
+     * @param coresWatts The power of the cores (PP0).
+     * @param graphicWatts The power of the graphic card (PP1).
+     * @param dramWatts The power of the DRAM.
+     */
+    void setRaplIntel(double thermalSpecPower, double packageWatts,
+                      double coresWatts, double graphicWatts, double dramWatts);
+
+    /**
+     * Advances the simulated time. Only valid if not in real time.
+     * @param milliseconds The time to advance (milliseconds).
+     */
+    void advanceTime(double milliseconds);
+
+    bool available(uint32_t id);
+    bool read(uint32_t id, uint32_t which, uint64_t& value);
+    bool write(uint32_t id, uint32_t which, uint64_t value);
+};
+
 /** Represents Intel MSR registers of a specific virtual core. **/
 class Msr{
 private:
-    int _fd;
-
+    // Published atomically, since the registers may be accessed
+    // concurrently (e.g. by the RAPL refresher and by the user).
+    mutable std::atomic<int> _fd;
+    mutable std::atomic<bool> _opened;
+    uint32_t _id;
+    int _flags;
+    MsrBackend* _backend;
+
+    void open() const;
 public:
     /**
+     * The registers file is opened lazily, at the first access.
      * @param id The identifier of the virtual core.
      */
     explicit Msr(uint32_t id, int flags = O_RDONLY);
@@ -637,6 +849,16 @@ public:
      * @return True if the register is present, false otherwise.
      */
     bool read(uint32_t which, uint64_t& value) const;
+
+    /**
+     * Reads several registers, one after the other, through the
+     * same open registers file.
+     * @param which The registers.
+     * @param values The values of the registers, in the same order.
+     *        Registers which are not present are set to 0.
+     * @return True if all the registers are present, false otherwise.
+     */
+    bool read(const std::vector<uint32_t>& which, std::vector<uint64_t>& values) const;
     
     /**
      * Writes specified bits of a specified register.
@@ -669,6 +891,155 @@ public:
                    unsigned int lowBit, uint64_t value);
 };
 
+/**
+ * Represents a sysfs (or procfs) file that is read many times.
+ * The file is opened only once and then re-read with pread at offset 0,
+ * which makes the kernel regenerate its content. This avoids the
+ * open/read/close sequence (and the allocations of the stream
+ * machinery) that readFirstLineFromFile performs at each call.
+ **/
+class SysfsFile: NonCopyable{
+private:
+    std::string _fileName;
+    int _flags;
+    mutable int _fd;
+    mutable bool _truncate;
+
+    bool open() const;
+
+    /**
+     * Returns a descriptor of the file. If the process has too many open
+     * files, the file is opened without keeping it open, and the
+     * descriptor must be given back with release().
+     * @return A descriptor of the file, or -1 if it can't be opened.
+     */
+    int acquire() const;
+    void release(int fd) const;
+public:
+    /**
+     * The file is opened lazily, at the first access.
+     * @param fileName The name of the file.
+     * @param flags The flags used to open the file.
+     */
+    explicit SysfsFile(const std::string& fileName, int flags = O_RDONLY);
+    ~SysfsFile();
+
+    /**
+     * Returns the name of the file.
+     * @return The name of the file.
+     */
+    const std::string& getFileName() const;
+
+    /**
+     * Returns true if the file can be opened.
+     * @return True if the file can be opened, false otherwise.
+     */
+    bool available() const;
+
+    /**
+     * Reads the content of the file (starting from the beginning) into a
+     * buffer. The content is always terminated with a '\0'.
+     * @param buffer The buffer.
+     * @param size The size of the buffer.
+     * @return The number of bytes read (excluding the terminator).
+     */
+    size_t read(char* buffer, size_t size) const;
+
+    /**
+     * Reads the first line of the file.
+     * @return The first line of the file.
+     */
+    std::string readFirstLine() const;
+
+    /**
+     * Writes a buffer at the beginning of the file. The file must have
+     * been opened with O_WRONLY or O_RDWR flags. Sysfs and procfs
+     * attributes are replaced by each write. Files on other filesystems
+     * (e.g. when simulating) are truncated to the written length.
+     * @param buffer The buffer.
+     * @param length The length of the buffer.
+     * @return True if the whole buffer has been written, false otherwise
+     *         (errno is set accordingly).
+     */
+    bool write(const char* buffer, size_t length) const;
+};
+
+/**
+ * Represents a sysfs (or procfs) directory. The directory is opened
+ * once and its files and subdirectories are then accessed with
+ * openat, relative to its descriptor, without resolving the whole
+ * path at each access.
+ **/
+class SysfsDirectory: NonCopyable{
+private:
+    std::string _path;
+    int _fd;
+public:
+    /**
+     * @param path The path of the directory.
+     */
+    explicit SysfsDirectory(const std::string& path);
+
+    /**
+     * @param parent The parent directory.
+     * @param name The name of the directory, relative to parent.
+     */
+    SysfsDirectory(const SysfsDirectory& parent, const std::string& name);
+
+    ~SysfsDirectory();
+
+    /**
+     * Returns the path of the directory.
+     * @return The path of the directory.
+     */
+    const std::string& getPath() const;
+
+    /**
+     * Returns true if the directory exists and has been opened.
+     * @return True if the directory exists and has been opened,
+     *         false otherwise.
+     */
+    bool available() const;
+
+    /**
+     * Reads the content of a file of the directory into a buffer.
+     * The content is always terminated with a '\0'.
+     * @param name The name of the file, relative to this directory.
+     * @param buffer The buffer.
+     * @param size The size of the buffer.
+     * @param length The number of bytes read (excluding the terminator).
+     * @return True if the file has been read, false otherwise.
+     */
+    bool read(const std::string& name, char* buffer, size_t size, size_t& length) const;
+
+    /**
+     * Reads an integer from a file of the directory.
+     * @param name The name of the file, relative to this directory.
+     * @param value The value read.
+     * @return True if the file has been read and contains a number,
+     *         false otherwise.
+     */
+    bool readInt(const std::string& name, int64_t& value) const;
+
+    /**
+     * Reads the first line of a file of the directory.
+     * @param name The name of the file, relative to this directory.
+     * @param line The first line of the file.
+     * @return True if the file has been read, false otherwise.
+     */
+    bool readFirstLine(const std::string& name, std::string& line) const;
+
+    /**
+     * Returns the names of the entries of the directory. The type of
+     * the entries is taken from the directory listing itself, without
+     * a stat for each entry (unless the filesystem does not report it).
+     * @param files If true returns the files names in the directory.
+     * @param directories If true returns the directories names in the directory.
+     * @return The names of the entries.
+     */
+    std::vector<std::string> getEntries(bool files = true, bool directories = true) const;
+};
+
 typedef struct{
     ulong timestamp;
     double value;
@@ -818,6 +1189,9 @@ public:
 // Only intended for testing purposes.
 typedef struct SimulationParameters{
     std::string sysfsRootPrefix;
+    // If not NULL, used by Msr instead of /dev/cpu/N/msr. Not owned.
+    utils::MsrBackend* msrBackend;
+    SimulationParameters():msrBackend(NULL){;}
 }SimulationParameters;
 
 }
@@ -7,9 +7,15 @@
 #include "limits"
 #include "sstream"
 #include "stdexcept"
+#include "limits.h"
+#include "stdio.h"
 #include "string"
+#include "string.h"
 #include "unistd.h"
 #include "fstream"
+#include "poll.h"
+#include "sys/eventfd.h"
+#include "sys/inotify.h"
 
 namespace mammut{
 extern SimulationParameters simulationParameters;
@@ -20,15 +26,37 @@ using namespace std;
 using namespace utils;
 
 
-DomainLinux::DomainLinux(DomainId domainIdentifier, vector<topology::VirtualCore*> virtualCores):
+static bool isEpyc(topology::Topology* topology){
+    std::vector<topology::Cpu*> cpus = topology->getCpus();
+    return !cpus[0]->getFamily().compare("23") &&
+           !cpus[0]->getVendorId().compare(0, 12, "AuthenticAMD");
+}
+
+static bool isPstateDriver(const string& driver){
+    return !driver.compare(0, 12, "intel_pstate") ||
+           !driver.compare(0, 13, "intel_cpufreq") ||
+           !driver.compare(0, 10, "amd-pstate");
+}
+
+DomainLinux::DomainLinux(DomainId domainIdentifier, vector<topology::VirtualCore*> virtualCores,
+                         bool epyc):
         Domain(domainIdentifier, virtualCores),
-        _msr(virtualCores.at(0)->getVirtualCoreId(), O_RDWR){
+        _msr(virtualCores.at(0)->getVirtualCoreId(), O_RDWR),
+        _epyc(epyc),
+        _currentFrequencyFile(NULL),
+        _governor(GOVERNOR_NUM),
+        _lowerBound(0),
+        _upperBound(0),
+        _userspaceFrequency(0),
+        _caching(false),
+        _direct(false),
+        _governorBeforeDirect(GOVERNOR_NUM),
+        _turboRatio(0),
+        _timeInStateFile(NULL),
+        _transTableFile(NULL),
+        _clockTicksPerSecond(sysconf(_SC_CLK_TCK)){
 
-    topology::Topology* top = topology::Topology::getInstance();
-    std::vector<topology::Cpu*> cpus = top->getCpus();
-    if(!cpus[0]->getFamily().compare("23") &&
-       !cpus[0]->getVendorId().compare(0, 12, "AuthenticAMD")){
-      _epyc = true;
+    if(_epyc){
       for(int i = 8; i >= 0; i--){
         uint64_t fId = 0, dfsId = 0;
         bool fIdr, dfsIdr;
@@ -42,14 +70,15 @@ DomainLinux::DomainLinux(DomainId domainIdentifier, vector<topology::VirtualCore
       }
       _availableGovernors.push_back(GOVERNOR_USERSPACE);
     }else{
-      _epyc = false;
       /** Reads available frequecies. **/
       for(size_t i = 0; i < virtualCores.size(); i++){
           _paths.push_back(simulationParameters.sysfsRootPrefix +
                            "/sys/devices/system/cpu/cpu" +
                            intToString(virtualCores.at(i)->getVirtualCoreId()) +
                            "/cpufreq/");
+          _setspeedFiles.push_back(new SysfsFile(_paths.back() + "scaling_setspeed", O_WRONLY));
       }
+      _currentFrequencyFile = new SysfsFile(_paths.at(0) + "scaling_cur_freq");
 
       if(existsFile(_paths.at(0) + "scaling_available_frequencies")){
           ifstream freqFile((_paths.at(0) + "scaling_available_frequencies").c_str());
@@ -88,25 +117,188 @@ DomainLinux::DomainLinux(DomainId domainIdentifier, vector<topology::VirtualCore
       }else{
           throw runtime_error("Impossible to open scaling_available_governors file.");
       }
+      initResidency();
     }
 }
 
-void DomainLinux::writeToDomainFiles(const string& what, const string& where) const{
-    for(size_t i = 0; i < _paths.size(); i++){
-        ofstream file;
-        file.open((_paths.at(i) + where).c_str());
-        if(file){
-            file << what;
-            if(file.fail()){
-                throw runtime_error("Write to frequency domain files failed.");
+/**
+ * Maximum size of a sysfs file (the kernel truncates
+ * stats/trans_table to this size).
+ **/
+#define MAMMUT_SYSFS_MAX_SIZE 4096
+
+void DomainLinux::initResidency(){
+    if(!existsFile(_paths.at(0) + "stats/time_in_state")){
+        return;
+    }
+    vector<string> lines = readFile(_paths.at(0) + "stats/time_in_state");
+    vector<Frequency> fileFrequencies;
+    for(size_t i = 0; i < lines.size(); i++){
+        uint64_t frequency;
+        if(parseU64(lines[i].c_str(), lines[i].c_str() + lines[i].length(), frequency)){
+            fileFrequencies.push_back(frequency);
+        }
+    }
+    _residencyFrequencies = fileFrequencies;
+    sort(_residencyFrequencies.begin(), _residencyFrequencies.end());
+    for(size_t i = 0; i < fileFrequencies.size(); i++){
+        _residencyIndexes.push_back(find(_residencyFrequencies.begin(), _residencyFrequencies.end(),
+                                         fileFrequencies[i]) - _residencyFrequencies.begin());
+    }
+    _timeInStateFile = new SysfsFile(_paths.at(0) + "stats/time_in_state");
+    if(existsFile(_paths.at(0) + "stats/trans_table")){
+        _transTableFile = new SysfsFile(_paths.at(0) + "stats/trans_table");
+    }
+    resetFrequencyResidency();
+    if(_transTableFile && _lastTransitions.empty()){
+        // Not readable, transitions are not available.
+        delete _transTableFile;
+        _transTableFile = NULL;
+    }
+}
+
+bool DomainLinux::readTimeInState(vector<uint64_t>& ticks) const{
+    if(!_timeInStateFile){
+        return false;
+    }
+    char buffer[MAMMUT_SYSFS_MAX_SIZE + 1];
+    size_t length;
+    try{
+        length = _timeInStateFile->read(buffer, sizeof(buffer));
+    }catch(const std::runtime_error& e){
+        return false;
+    }
+    const char* p = buffer;
+    const char* last = buffer + length;
+    ticks.resize(_residencyFrequencies.size());
+    for(size_t i = 0; i < _residencyIndexes.size(); i++){
+        uint64_t frequency, time = 0;
+        p = p ? parseU64(p, last, frequency) : NULL;
+        p = p ? parseU64(p, last, time) : NULL;
+        if(!p){
+            return false;
+        }
+        ticks[_residencyIndexes[i]] = time;
+        while(p != last && *p++ != '\n'){
+            ;
+        }
+    }
+    return true;
+}
+
+bool DomainLinux::readTransTable(vector<uint64_t>& transitions) const{
+    if(!_transTableFile){
+        return false;
+    }
+    char buffer[MAMMUT_SYSFS_MAX_SIZE + 1];
+    size_t length;
+    try{
+        length = _transTableFile->read(buffer, sizeof(buffer));
+    }catch(const std::runtime_error& e){
+        // The kernel fails with EFBIG when the table is larger than a page.
+        return false;
+    }
+    const char* p = buffer;
+    const char* last = buffer + length;
+    size_t n = _residencyFrequencies.size();
+    transitions.resize(n * n);
+    /** Skips the two header lines. **/
+    for(size_t i = 0; i < 2; i++){
+        p = (const char*) memchr(p, '\n', last - p);
+        if(!p){
+            return false;
+        }
+        ++p;
+    }
+    for(size_t i = 0; i < _residencyIndexes.size(); i++){
+        uint64_t frequency;
+        p = parseU64(p, last, frequency);
+        if(!p || p == last || *p != ':'){
+            return false;
+        }
+        ++p;
+        for(size_t j = 0; j < _residencyIndexes.size(); j++){
+            uint64_t count = 0;
+            p = parseU64(p, last, count);
+            if(!p){
+                return false;
             }
-            file.close();
-        }else{
+            transitions[_residencyIndexes[i] * n + _residencyIndexes[j]] = count;
+        }
+        while(p != last && *p++ != '\n'){
+            ;
+        }
+    }
+    return true;
+}
+
+vector<Frequency> DomainLinux::getResidencyFrequencies() const{
+    return _residencyFrequencies;
+}
+
+bool DomainLinux::getFrequencyResidency(vector<uint64_t>& times) const{
+    if(!readTimeInState(times) || _lastTimes.size() != times.size()){
+        return false;
+    }
+    for(size_t i = 0; i < times.size(); i++){
+        times[i] = ((times[i] - _lastTimes[i]) * MAMMUT_MILLISECS_IN_SEC) / _clockTicksPerSecond;
+    }
+    return true;
+}
+
+bool DomainLinux::getFrequencyTransitions(vector<uint64_t>& transitions) const{
+    if(!readTransTable(transitions) || _lastTransitions.size() != transitions.size()){
+        return false;
+    }
+    for(size_t i = 0; i < transitions.size(); i++){
+        transitions[i] -= _lastTransitions[i];
+    }
+    return true;
+}
+
+void DomainLinux::resetFrequencyResidency(){
+    if(!readTimeInState(_lastTimes)){
+        _lastTimes.clear();
+    }
+    if(!readTransTable(_lastTransitions)){
+        _lastTransitions.clear();
+    }
+}
+
+DomainLinux::~DomainLinux(){
+    delete _currentFrequencyFile;
+    deleteVectorElements<SysfsFile*>(_setspeedFiles);
+    deleteVectorElements<Msr*>(_perfCtlMsrs);
+    deleteVectorElements<Msr*>(_aperfMperfMsrs);
+    delete _timeInStateFile;
+    delete _transTableFile;
+}
+
+void DomainLinux::writeToDomainFiles(const char* what, size_t length, const char* where) const{
+    char fileName[PATH_MAX];
+    for(size_t i = 0; i < _paths.size(); i++){
+        snprintf(fileName, sizeof(fileName), "%s%s", _paths[i].c_str(), where);
+        int fd = open(fileName, O_WRONLY | O_TRUNC);
+        if(fd == -1){
+            throw runtime_error("Write to frequency domain files failed.");
+        }
+        ssize_t written = write(fd, what, length);
+        close(fd);
+        if(written != (ssize_t) length){
             throw runtime_error("Write to frequency domain files failed.");
         }
     }
 }
 
+void DomainLinux::writeToDomainFiles(const string& what, const char* where) const{
+    writeToDomainFiles(what.c_str(), what.length(), where);
+}
+
+void DomainLinux::writeToDomainFiles(Frequency what, const char* where) const{
+    char buffer[20];
+    writeToDomainFiles(buffer, formatU64(what, buffer, sizeof(buffer)), where);
+}
+
 void DomainLinux::removeTurboFrequencies(){
 #if defined(__x86_64__) // It seems that on Power8 this is not the case
     if(_turboFrequencies.empty()){
@@ -140,9 +332,18 @@ vector<Governor> DomainLinux::getAvailableGovernors() const{
 Frequency DomainLinux::getCurrentFrequency() const{
     if(_epyc){
       return 0; // TODO
+    }else if(_direct){
+      uint64_t ratio;
+      if(!_msr.readBits(MSR_PERF_STATUS, 15, 8, ratio)){
+          return 0;
+      }
+      return ratio * MAMMUT_CPUFREQ_PSTATE_STEP;
     }else{
-      string fileName = _paths.at(0) + "scaling_cur_freq";
-      return stringToInt(readFirstLineFromFile(fileName));
+      char buffer[32];
+      size_t length = _currentFrequencyFile->read(buffer, sizeof(buffer));
+      uint64_t frequency = 0;
+      parseU64(buffer, buffer + length, frequency);
+      return frequency;
     }
 }
 
@@ -155,11 +356,22 @@ static uint64_t getCurrentEpycPstate(const Msr& msr){
 Frequency DomainLinux::getCurrentFrequencyUserspace() const{
     if(_epyc){
       return _availableFrequencies[_availableFrequencies.size() - 1 - getCurrentEpycPstate(_msr)];
+    }else if(_direct){
+      uint64_t ratio;
+      if(!_perfCtlMsrs.at(0)->readBits(MSR_PERF_CTL, 15, 8, ratio)){
+          return 0;
+      }
+      return ratioToFrequency(ratio);
     }else{
       switch(getCurrentGovernor()){
           case GOVERNOR_USERSPACE:{
-              string fileName = _paths.at(0) + "scaling_setspeed";
-              return stringToInt(readFirstLineFromFile(fileName));
+              Frequency frequency = _userspaceFrequency;
+              if(!_caching || !frequency){
+                  string fileName = _paths.at(0) + "scaling_setspeed";
+                  frequency = stringToInt(readFirstLineFromFile(fileName));
+                  _userspaceFrequency = frequency;
+              }
+              return frequency;
           }
           default:{
               return 0;
@@ -168,12 +380,21 @@ Frequency DomainLinux::getCurrentFrequencyUserspace() const{
     }
 }
 
+Governor DomainLinux::readGovernor() const{
+    string fileName = _paths.at(0) + "scaling_governor";
+    _governor = CpuFreq::getGovernorFromGovernorName(readFirstLineFromFile(fileName));
+    return _governor;
+}
+
 Governor DomainLinux::getCurrentGovernor() const{
-    if(_epyc){
+    if(_epyc || _direct){
       return GOVERNOR_USERSPACE;
     }else{
-      string fileName = _paths.at(0) + "scaling_governor";
-      return CpuFreq::getGovernorFromGovernorName(readFirstLineFromFile(fileName));
+      Governor governor = _governor;
+      if(!_caching || governor == GOVERNOR_NUM){
+          governor = readGovernor();
+      }
+      return governor;
     }
 }
 
@@ -193,19 +414,43 @@ bool DomainLinux::setFrequencyUserspace(Frequency frequency) const{
       }else{
         return false;
       }
+    }else if(_direct){
+      if(!utils::contains(_availableFrequencies, frequency)){
+          return false;
+      }
+      uint64_t ratio = frequencyToRatio(frequency);
+      for(size_t i = 0; i < _perfCtlMsrs.size(); i++){
+          if(!_perfCtlMsrs[i]->write(MSR_PERF_CTL, _perfCtlValues[i] | (ratio << 8))){
+              return false;
+          }
+      }
+      return true;
     }else{
-      switch(getCurrentGovernor()){
-          case GOVERNOR_USERSPACE:{
-              if(!utils::contains(_availableFrequencies, frequency)){
+      if(!utils::contains(_availableFrequencies, frequency)){
+          return false;
+      }
+      /**
+       * The governor is only re-read if not known to be userspace.
+       * If it has been changed by someone else, the write fails and
+       * the governor is read again.
+       **/
+      if(_governor != GOVERNOR_USERSPACE &&
+         readGovernor() != GOVERNOR_USERSPACE){
+          return false;
+      }
+      char buffer[20];
+      size_t length = formatU64(frequency, buffer, sizeof(buffer));
+      _userspaceFrequency = 0;
+      for(size_t i = 0; i < _setspeedFiles.size(); i++){
+          if(!_setspeedFiles[i]->write(buffer, length)){
+              if(readGovernor() != GOVERNOR_USERSPACE){
                   return false;
               }
-              writeToDomainFiles(intToString(frequency), "scaling_setspeed");
-              return true;
-          }
-          default:{
-              return false;
+              throw runtime_error("Write to frequency domain files failed.");
           }
       }
+      _userspaceFrequency = frequency;
+      return true;
     }
 }
 
@@ -223,8 +468,14 @@ bool DomainLinux::getCurrentGovernorBounds(Frequency& lowerBound, Frequency& upp
     if(_epyc){
       return false;
     }else{
-      lowerBound = stringToInt(readFirstLineFromFile(_paths.at(0) + "scaling_min_freq"));
-      upperBound = stringToInt(readFirstLineFromFile(_paths.at(0) + "scaling_max_freq"));
+      lowerBound = _lowerBound;
+      upperBound = _upperBound;
+      if(!_caching || !lowerBound || !upperBound){
+          lowerBound = stringToInt(readFirstLineFromFile(_paths.at(0) + "scaling_min_freq"));
+          upperBound = stringToInt(readFirstLineFromFile(_paths.at(0) + "scaling_max_freq"));
+          _lowerBound = lowerBound;
+          _upperBound = upperBound;
+      }
       return true;
     }
 }
@@ -238,15 +489,22 @@ bool DomainLinux::setGovernorBounds(Frequency lowerBound, Frequency upperBound)
          lowerBound > upperBound){
            return false;
       }
-
-      writeToDomainFiles(intToString(lowerBound), "scaling_min_freq");
-      writeToDomainFiles(intToString(upperBound), "scaling_max_freq");
+      writeGovernorBounds(lowerBound, upperBound);
       return true;
     }
 }
 
+void DomainLinux::writeGovernorBounds(Frequency lowerBound, Frequency upperBound) const{
+    _lowerBound = 0;
+    _upperBound = 0;
+    writeToDomainFiles(lowerBound, "scaling_min_freq");
+    writeToDomainFiles(upperBound, "scaling_max_freq");
+    _lowerBound = lowerBound;
+    _upperBound = upperBound;
+}
+
 bool DomainLinux::setGovernor(Governor governor) const{
-    if(_epyc){
+    if(_epyc || _direct){
       if(governor == GOVERNOR_USERSPACE){
         return true;
       }else{
@@ -257,11 +515,167 @@ bool DomainLinux::setGovernor(Governor governor) const{
           return false;
       }
 
+      _governor = GOVERNOR_NUM;
+      _userspaceFrequency = 0;
       writeToDomainFiles(CpuFreq::getGovernorNameFromGovernor(governor), "scaling_governor");
+      _governor = governor;
       return true;
     }
 }
 
+uint64_t DomainLinux::frequencyToRatio(Frequency frequency) const{
+    /** Turbo frequencies (e.g. 2401000) are not multiple of the bus clock. **/
+    if(frequency % MAMMUT_CPUFREQ_PSTATE_STEP){
+        return _turboRatio;
+    }
+    return frequency / MAMMUT_CPUFREQ_PSTATE_STEP;
+}
+
+Frequency DomainLinux::ratioToFrequency(uint64_t ratio) const{
+    Frequency frequency = ratio * MAMMUT_CPUFREQ_PSTATE_STEP;
+    if(ratio == _turboRatio && !utils::contains(_availableFrequencies, frequency) &&
+       !_availableFrequencies.empty()){
+        return _availableFrequencies.back();
+    }
+    return frequency;
+}
+
+bool DomainLinux::setDirectControl(bool direct){
+    if(_epyc){
+        return direct;
+    }
+    if(!direct){
+        if(_direct){
+            _direct = false;
+            _governor = GOVERNOR_NUM;
+            deleteVectorElements<Msr*>(_perfCtlMsrs);
+            _perfCtlValues.clear();
+            /** Gives the control back to the previous governor. **/
+            if(_governorBeforeDirect != GOVERNOR_NUM){
+                setGovernor(_governorBeforeDirect);
+                _governorBeforeDirect = GOVERNOR_NUM;
+            }
+        }
+        return true;
+    }
+    if(_direct){
+        return true;
+    }
+
+    /**
+     * Not possible when the P-states are managed by the hardware (HWP),
+     * or if the governor can't be parked (it would keep changing the
+     * P-states underneath).
+     **/
+    uint64_t value = 0;
+    if(!_msr.available() || (_msr.readBits(MSR_PM_ENABLE, 0, 0, value) && value) ||
+       !utils::contains(_availableGovernors, GOVERNOR_USERSPACE)){
+        return false;
+    }
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        Msr* msr = new Msr(_virtualCores[i]->getVirtualCoreId(), O_RDWR);
+        _perfCtlMsrs.push_back(msr);
+        if(!msr->read(MSR_PERF_CTL, value)){
+            deleteVectorElements<Msr*>(_perfCtlMsrs);
+            _perfCtlValues.clear();
+            return false;
+        }
+        /** Only the target ratio is changed. **/
+        _perfCtlValues.push_back(value & ~((uint64_t) 0xFF00));
+    }
+    if(!_msr.readBits(MSR_TURBO_RATIO_LIMIT, 7, 0, _turboRatio) || !_turboRatio){
+        Frequency lb, ub;
+        getHardwareFrequencyBounds(lb, ub);
+        _turboRatio = ub / MAMMUT_CPUFREQ_PSTATE_STEP + 1;
+    }
+    Governor previous = getCurrentGovernor();
+    if(!setGovernor(GOVERNOR_USERSPACE)){
+        deleteVectorElements<Msr*>(_perfCtlMsrs);
+        _perfCtlValues.clear();
+        return false;
+    }
+    _governorBeforeDirect = previous;
+    _direct = true;
+    return true;
+}
+
+bool DomainLinux::isDirectControlEnabled() const{
+    return _epyc || _direct;
+}
+
+Frequency DomainLinux::getEffectiveFrequency(size_t index) const{
+    if(_aperfMperfMsrs.empty()){
+        for(size_t i = 0; i < _virtualCores.size(); i++){
+            _aperfMperfMsrs.push_back(new Msr(_virtualCores[i]->getVirtualCoreId()));
+        }
+        AperfMperfSample zero = {0, 0, 0, 0};
+        _aperfMperfSamples.resize(_virtualCores.size(), zero);
+    }
+    Msr* msr = _aperfMperfMsrs[index];
+    AperfMperfSample sample;
+    if(!msr->read(MSR_MPERF, sample.mperf) ||
+       !msr->read(MSR_APERF, sample.aperf) ||
+       !msr->read(MSR_TSC, sample.tsc)){
+        return 0;
+    }
+    sample.timestamp = getMillisecondsTime();
+
+    AperfMperfSample& previous = _aperfMperfSamples[index];
+    double interval = sample.timestamp - previous.timestamp;
+    Frequency r = 0;
+    if(previous.timestamp && interval > 0 && sample.mperf != previous.mperf){
+        /** MPERF ticks at the TSC frequency. Ticks per millisecond are kHz. **/
+        double tscFrequency = (sample.tsc - previous.tsc) / interval;
+        r = tscFrequency * ((double) (sample.aperf - previous.aperf) /
+                            (double) (sample.mperf - previous.mperf));
+    }
+    previous = sample;
+    return r;
+}
+
+Frequency DomainLinux::getEffectiveFrequency(const topology::VirtualCore* virtualCore) const{
+    ScopedLock scopedLock(_aperfMperfLock);
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        if(_virtualCores[i]->getVirtualCoreId() == virtualCore->getVirtualCoreId()){
+            return getEffectiveFrequency(i);
+        }
+    }
+    return 0;
+}
+
+vector<Frequency> DomainLinux::getEffectiveFrequencies() const{
+    ScopedLock scopedLock(_aperfMperfLock);
+    vector<Frequency> r;
+    r.reserve(_virtualCores.size());
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        r.push_back(getEffectiveFrequency(i));
+    }
+    return r;
+}
+
+void DomainLinux::setCaching(bool caching){
+    invalidateCache();
+    _caching = caching;
+}
+
+void DomainLinux::invalidateCache() const{
+    _governor = GOVERNOR_NUM;
+    _lowerBound = 0;
+    _upperBound = 0;
+    _userspaceFrequency = 0;
+}
+
+vector<string> DomainLinux::getCachedFiles() const{
+    vector<string> r;
+    if(!_epyc){
+        r.push_back(_paths.at(0) + "scaling_governor");
+        r.push_back(_paths.at(0) + "scaling_min_freq");
+        r.push_back(_paths.at(0) + "scaling_max_freq");
+        r.push_back(_paths.at(0) + "scaling_setspeed");
+    }
+    return r;
+}
+
 int DomainLinux::getTransitionLatency() const{
     if(!_paths.empty() && existsFile(_paths.at(0) + "cpuinfo_transition_latency")){
         return stringToInt(readFirstLineFromFile(_paths.at(0) + "cpuinfo_transition_latency"));
@@ -378,9 +792,426 @@ VoltageTable DomainLinux::getVoltageTable(uint numVirtualCores, bool onlyPhysica
     return r;
 }
 
+DomainLinuxPstate::DomainLinuxPstate(DomainId domainIdentifier,
+                                     vector<topology::VirtualCore*> virtualCores,
+                                     bool amd):
+        DomainLinux(domainIdentifier, virtualCores, false),
+        _amd(amd), _hardwareLowerBound(0), _hardwareUpperBound(0),
+        _hardwarePstates(false){
+    getHardwareFrequencyBounds(_hardwareLowerBound, _hardwareUpperBound);
+    if(_availableFrequencies.empty()){
+        for(Frequency f = _hardwareLowerBound; f < _hardwareUpperBound;
+            f += MAMMUT_CPUFREQ_PSTATE_STEP){
+            _availableFrequencies.push_back(f);
+        }
+        _availableFrequencies.push_back(_hardwareUpperBound);
+    }
+
+    string fileName = _paths.at(0) + "energy_performance_available_preferences";
+    if(existsFile(fileName)){
+        string preferences = readFirstLineFromFile(fileName);
+        _availablePreferences = split(preferences, ' ');
+        for(auto it = _availablePreferences.begin(); it != _availablePreferences.end();){
+            trim(*it);
+            if(it->empty()){
+                it = _availablePreferences.erase(it);
+            }else{
+                ++it;
+            }
+        }
+    }
+
+    for(size_t i = 0; i < virtualCores.size(); i++){
+        _msrs.push_back(new Msr(virtualCores.at(i)->getVirtualCoreId(), O_RDWR));
+    }
+    _requests.resize(virtualCores.size(), 0);
+    _requestsValid.resize(virtualCores.size(), false);
+    uint64_t enabled = 0;
+    _hardwarePstates = _msrs.at(0)->available() &&
+                       _msrs.at(0)->readBits(_amd ? MSR_CPPC_ENABLE_AMD : MSR_PM_ENABLE,
+                                             0, 0, enabled) && enabled;
+}
+
+DomainLinuxPstate::~DomainLinuxPstate(){
+    deleteVectorElements<Msr*>(_msrs);
+}
+
+bool DomainLinuxPstate::setGovernorBounds(Frequency lowerBound, Frequency upperBound) const{
+    if(lowerBound < _hardwareLowerBound || upperBound > _hardwareUpperBound ||
+       lowerBound > upperBound){
+        return false;
+    }
+    writeGovernorBounds(lowerBound, upperBound);
+    return true;
+}
+
+vector<string> DomainLinuxPstate::getAvailableEnergyPerformancePreferences() const{
+    return _availablePreferences;
+}
+
+string DomainLinuxPstate::getEnergyPerformancePreference() const{
+    if(_availablePreferences.empty()){
+        return "";
+    }
+    return readFirstLineFromFile(_paths.at(0) + "energy_performance_preference");
+}
+
+bool DomainLinuxPstate::setEnergyPerformancePreference(const string& preference) const{
+    if(_availablePreferences.empty()){
+        return false;
+    }
+    if(!utils::contains(_availablePreferences, preference)){
+        if(preference.empty() || preference.length() > 3 ||
+           !isNumber(preference) || stringToUint(preference) > 255){
+            return false;
+        }
+    }
+    writeToDomainFiles(preference, "energy_performance_preference");
+    return true;
+}
+
+bool DomainLinuxPstate::getPerformanceCapabilities(PerformanceCapabilities& capabilities) const{
+    uint64_t value;
+    if(!_hardwarePstates ||
+       !_msrs.at(0)->read(_amd ? MSR_CPPC_CAP1_AMD : MSR_HWP_CAPABILITIES, value)){
+        return false;
+    }
+    if(_amd){
+        capabilities.lowest = value & 0xFF;
+        capabilities.efficient = (value >> 8) & 0xFF;
+        capabilities.guaranteed = (value >> 16) & 0xFF;
+        capabilities.highest = (value >> 24) & 0xFF;
+    }else{
+        capabilities.highest = value & 0xFF;
+        capabilities.guaranteed = (value >> 8) & 0xFF;
+        capabilities.efficient = (value >> 16) & 0xFF;
+        capabilities.lowest = (value >> 24) & 0xFF;
+    }
+    return true;
+}
+
+bool DomainLinuxPstate::getPerformanceHint(PerformanceHint& hint) const{
+    uint64_t value;
+    if(!_hardwarePstates ||
+       !_msrs.at(0)->read(_amd ? MSR_CPPC_REQ_AMD : MSR_HWP_REQUEST, value)){
+        return false;
+    }
+    _requests[0] = value;
+    _requestsValid[0] = true;
+    if(_amd){
+        hint.maximum = value & 0xFF;
+        hint.minimum = (value >> 8) & 0xFF;
+    }else{
+        hint.minimum = value & 0xFF;
+        hint.maximum = (value >> 8) & 0xFF;
+    }
+    hint.desired = (value >> 16) & 0xFF;
+    hint.energyPerformancePreference = (value >> 24) & 0xFF;
+    return true;
+}
+
+bool DomainLinuxPstate::setPerformanceHint(size_t index, const PerformanceHint& hint) const{
+    uint32_t which = _amd ? MSR_CPPC_REQ_AMD : MSR_HWP_REQUEST;
+    /**
+     * Only the lowest 32 bits are changed. The others (e.g. the activity
+     * window on Intel) are read once and then preserved.
+     **/
+    if(!_requestsValid[index]){
+        if(!_msrs.at(index)->read(which, _requests[index])){
+            return false;
+        }
+        _requestsValid[index] = true;
+    }
+    uint64_t value = _requests[index] & ~((uint64_t) 0xFFFFFFFF);
+    if(_amd){
+        value |= (uint64_t) hint.maximum | ((uint64_t) hint.minimum << 8);
+    }else{
+        value |= (uint64_t) hint.minimum | ((uint64_t) hint.maximum << 8);
+    }
+    value |= ((uint64_t) hint.desired << 16) |
+             ((uint64_t) hint.energyPerformancePreference << 24);
+    if(!_msrs.at(index)->write(which, value)){
+        _requestsValid[index] = false;
+        return false;
+    }
+    _requests[index] = value;
+    return true;
+}
+
+bool DomainLinuxPstate::setPerformanceHint(const PerformanceHint& hint) const{
+    if(!_hardwarePstates || hint.minimum > hint.maximum){
+        return false;
+    }
+    for(size_t i = 0; i < _msrs.size(); i++){
+        if(!setPerformanceHint(i, hint)){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DomainLinuxPstate::setPerformanceHint(const topology::VirtualCore* virtualCore,
+                                           const PerformanceHint& hint) const{
+    if(!_hardwarePstates || hint.minimum > hint.maximum){
+        return false;
+    }
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        if(_virtualCores[i]->getVirtualCoreId() == virtualCore->getVirtualCoreId()){
+            return setPerformanceHint(i, hint);
+        }
+    }
+    return false;
+}
+
+/**
+ * Minimum number of domains changed by each thread
+ * of a setFrequencies call.
+ **/
+#define MAMMUT_CPUFREQ_DOMAINS_PER_SETTER 4
+/**
+ * Maximum number of threads (including the caller)
+ * used by a setFrequencies call.
+ **/
+#define MAMMUT_CPUFREQ_MAX_SETTERS 8
+
+UncoreDomainLinux::UncoreDomainLinux(topology::Cpu* cpu):
+        UncoreDomain(cpu), _msr(NULL), _hardwareLowerBound(0), _hardwareUpperBound(0){
+    char package[32];
+    snprintf(package, sizeof(package), "package_%02u_die_00/", cpu->getCpuId());
+    string path = simulationParameters.sysfsRootPrefix +
+                  "/sys/devices/system/cpu/intel_uncore_frequency/" + package;
+    _msr = new Msr(cpu->getVirtualCore()->getVirtualCoreId(), O_RDWR);
+    if(existsFile(path + "initial_min_freq_khz")){
+        _path = path;
+        _hardwareLowerBound = stringToInt(readFirstLineFromFile(_path + "initial_min_freq_khz"));
+        _hardwareUpperBound = stringToInt(readFirstLineFromFile(_path + "initial_max_freq_khz"));
+    }else{
+        /**
+         * Without the driver, the hardware bounds are those set
+         * by the BIOS (i.e. the ones found at startup).
+         **/
+        uint64_t lb, ub;
+        if(_msr->available() &&
+           _msr->readBits(MSR_UNCORE_RATIO_LIMIT, 14, 8, lb) &&
+           _msr->readBits(MSR_UNCORE_RATIO_LIMIT, 6, 0, ub)){
+            _hardwareLowerBound = lb * MAMMUT_CPUFREQ_UNCORE_RATIO_UNIT;
+            _hardwareUpperBound = ub * MAMMUT_CPUFREQ_UNCORE_RATIO_UNIT;
+        }
+    }
+}
+
+UncoreDomainLinux::~UncoreDomainLinux(){
+    delete _msr;
+}
+
+bool UncoreDomainLinux::available() const{
+    return _hardwareLowerBound && _hardwareUpperBound;
+}
+
+Frequency UncoreDomainLinux::getCurrentFrequency() const{
+    if(_path.size() && existsFile(_path + "current_freq_khz")){
+        return stringToInt(readFirstLineFromFile(_path + "current_freq_khz"));
+    }
+    uint64_t ratio;
+    if(_msr->readBits(MSR_UNCORE_PERF_STATUS, 6, 0, ratio)){
+        return ratio * MAMMUT_CPUFREQ_UNCORE_RATIO_UNIT;
+    }
+    return 0;
+}
+
+bool UncoreDomainLinux::getHardwareBounds(Frequency& lowerBound, Frequency& upperBound) const{
+    lowerBound = _hardwareLowerBound;
+    upperBound = _hardwareUpperBound;
+    return available();
+}
+
+bool UncoreDomainLinux::getBounds(Frequency& lowerBound, Frequency& upperBound) const{
+    if(_path.size()){
+        lowerBound = stringToInt(readFirstLineFromFile(_path + "min_freq_khz"));
+        upperBound = stringToInt(readFirstLineFromFile(_path + "max_freq_khz"));
+        return true;
+    }
+    uint64_t lb, ub;
+    if(_msr->readBits(MSR_UNCORE_RATIO_LIMIT, 14, 8, lb) &&
+       _msr->readBits(MSR_UNCORE_RATIO_LIMIT, 6, 0, ub)){
+        lowerBound = lb * MAMMUT_CPUFREQ_UNCORE_RATIO_UNIT;
+        upperBound = ub * MAMMUT_CPUFREQ_UNCORE_RATIO_UNIT;
+        return true;
+    }
+    return false;
+}
+
+static bool writeUncoreFile(const string& fileName, Frequency frequency){
+    char buffer[16];
+    size_t length = formatU64(frequency, buffer, sizeof(buffer));
+    return SysfsFile(fileName, O_WRONLY).write(buffer, length);
+}
+
+bool UncoreDomainLinux::setBounds(Frequency lowerBound, Frequency upperBound){
+    if(!available() || lowerBound > upperBound ||
+       lowerBound < _hardwareLowerBound || upperBound > _hardwareUpperBound){
+        return false;
+    }
+    if(_path.size()){
+        /** The driver rejects a minimum higher than the current maximum. **/
+        Frequency currentLowerBound, currentUpperBound;
+        getBounds(currentLowerBound, currentUpperBound);
+        if(lowerBound > currentUpperBound){
+            return writeUncoreFile(_path + "max_freq_khz", upperBound) &&
+                   writeUncoreFile(_path + "min_freq_khz", lowerBound);
+        }else{
+            return writeUncoreFile(_path + "min_freq_khz", lowerBound) &&
+                   writeUncoreFile(_path + "max_freq_khz", upperBound);
+        }
+    }
+    uint64_t value;
+    if(!_msr->read(MSR_UNCORE_RATIO_LIMIT, value)){
+        return false;
+    }
+    value &= ~((uint64_t) 0x7F7F);
+    value |= (uint64_t) (lowerBound / MAMMUT_CPUFREQ_UNCORE_RATIO_UNIT) << 8;
+    value |= (uint64_t) (upperBound / MAMMUT_CPUFREQ_UNCORE_RATIO_UNIT);
+    return _msr->write(MSR_UNCORE_RATIO_LIMIT, value);
+}
+
+FrequenciesBatch::FrequenciesBatch():
+        frequencies(NULL), stride(1), pending(0), failed(false){
+    ;
+}
+
+void FrequenciesBatch::apply(size_t index){
+    for(size_t i = index; i < frequencies->size(); i += stride){
+        const pair<Domain*, Frequency>& p = frequencies->at(i);
+        try{
+            if(!p.first->setFrequencyUserspace(p.second)){
+                failed = true;
+            }
+        }catch(const exception&){
+            failed = true;
+        }
+    }
+}
+
+FrequenciesSetter::FrequenciesSetter(FrequenciesBatch& batch, size_t index):
+        _batch(batch), _index(index), _stop(false){
+    ;
+}
+
+void FrequenciesSetter::run(){
+    while(true){
+        _start.wait();
+        if(_stop){
+            return;
+        }
+        _batch.apply(_index);
+        if(--_batch.pending == 0){
+            _batch.done.notifyOne();
+        }
+    }
+}
+
+void FrequenciesSetter::notify(){
+    _start.notifyOne();
+}
+
+void FrequenciesSetter::stop(){
+    _stop = true;
+    _start.notifyOne();
+}
+
+CpuFreqWatcher::CpuFreqWatcher(const vector<Domain*>& domains):
+        _inotifyFd(-1), _stopFd(-1), _failed(false){
+    _inotifyFd = inotify_init1(IN_CLOEXEC);
+    _stopFd = eventfd(0, EFD_CLOEXEC);
+    if(_inotifyFd == -1 || _stopFd == -1){
+        if(_inotifyFd != -1){
+            close(_inotifyFd);
+        }
+        if(_stopFd != -1){
+            close(_stopFd);
+        }
+        throw runtime_error("CpuFreqWatcher: Impossible to initialize inotify: " + errnoToStr());
+    }
+    for(Domain* domain : domains){
+        DomainLinux* domainLinux = dynamic_cast<DomainLinux*>(domain);
+        vector<string> files = domainLinux->getCachedFiles();
+        for(size_t i = 0; i < files.size(); i++){
+            int wd = inotify_add_watch(_inotifyFd, files[i].c_str(), IN_MODIFY);
+            if(wd == -1){
+                /** e.g. scaling_setspeed is not present on intel_pstate. **/
+                if(errno == ENOENT){
+                    continue;
+                }
+                string error = errnoToStr();
+                close(_inotifyFd);
+                close(_stopFd);
+                throw runtime_error("CpuFreqWatcher: Impossible to watch " + files[i] + ": " + error);
+            }
+            _domains[wd] = domainLinux;
+        }
+    }
+}
+
+CpuFreqWatcher::~CpuFreqWatcher(){
+    close(_inotifyFd);
+    close(_stopFd);
+}
+
+bool CpuFreqWatcher::failed() const{
+    return _failed;
+}
+
+void CpuFreqWatcher::run(){
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2];
+    fds[0].fd = _inotifyFd;
+    fds[0].events = POLLIN;
+    fds[1].fd = _stopFd;
+    fds[1].events = POLLIN;
+    while(true){
+        if(poll(fds, 2, -1) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            /**
+             * Exceptions can't be propagated outside of the thread.
+             * Since changes are no more noticed, caching is disabled.
+             **/
+            for(map<int, DomainLinux*>::const_iterator it = _domains.begin(); it != _domains.end(); ++it){
+                it->second->setCaching(false);
+            }
+            _failed = true;
+            return;
+        }
+        if(fds[1].revents){
+            return;
+        }
+        ssize_t length = read(_inotifyFd, buffer, sizeof(buffer));
+        if(length <= 0){
+            continue;
+        }
+        for(char* p = buffer; p < buffer + length;){
+            const struct inotify_event* event = (const struct inotify_event*) p;
+            map<int, DomainLinux*>::const_iterator it = _domains.find(event->wd);
+            if(it != _domains.end()){
+                it->second->invalidateCache();
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+void CpuFreqWatcher::stop(){
+    uint64_t one = 1;
+    if(write(_stopFd, &one, sizeof(one)) != sizeof(one)){
+        throw runtime_error("CpuFreqWatcher: Impossible to stop: " + errnoToStr());
+    }
+}
+
 CpuFreqLinux::CpuFreqLinux():
     _boostingFile(simulationParameters.sysfsRootPrefix +
-                  "/sys/devices/system/cpu/cpufreq/boost"){
+                  "/sys/devices/system/cpu/cpufreq/boost"),
+    _watcher(NULL){
     if(existsDirectory(simulationParameters.sysfsRootPrefix +
                        "/sys/devices/system/cpu/cpu0/cpufreq")){
         _topology = topology::Topology::local();
@@ -400,6 +1231,14 @@ CpuFreqLinux::CpuFreqLinux():
                                   domainsFiles + " | sort | uniq");
 
         vector<topology::VirtualCore*> vc = _topology->getVirtualCores();
+        bool epyc = isEpyc(_topology);
+        bool pstate = false;
+        string driverFile = simulationParameters.sysfsRootPrefix +
+                            "/sys/devices/system/cpu/cpu0/cpufreq/scaling_driver";
+        if(existsFile(driverFile)){
+            pstate = isPstateDriver(readFirstLineFromFile(driverFile));
+        }
+        bool amd = !_topology->getCpus()[0]->getVendorId().compare(0, 12, "AuthenticAMD");
 
         _domains.resize(output.size());
         for(size_t i = 0; i < output.size(); i++){
@@ -411,25 +1250,44 @@ CpuFreqLinux::CpuFreqLinux():
                 virtualCoresIdentifiers.push_back(num);
             }
             /** Creates a domain based on the vector of cores identifiers. **/
-            _domains.at(i) = new DomainLinux(i, filterVirtualCores(vc, virtualCoresIdentifiers));
+            if(pstate){
+                _domains.at(i) = new DomainLinuxPstate(i, filterVirtualCores(vc, virtualCoresIdentifiers), amd);
+            }else{
+                _domains.at(i) = new DomainLinux(i, filterVirtualCores(vc, virtualCoresIdentifiers), epyc);
+            }
         }
     }else{
-      topology::Topology* top = topology::Topology::getInstance();
-      std::vector<topology::Cpu*> cpus = top->getCpus();
-      if(!cpus[0]->getFamily().compare("23") &&
-         !cpus[0]->getVendorId().compare(0, 12, "AuthenticAMD")){
-        std::vector<topology::PhysicalCore*> cores = top->getPhysicalCores();
+      _topology = topology::Topology::getInstance();
+      if(isEpyc(_topology)){
+        std::vector<topology::PhysicalCore*> cores = _topology->getPhysicalCores();
         size_t i = 0;
         for(auto c : cores){
-          _domains.push_back(new DomainLinux(i, c->getVirtualCores()));
+          _domains.push_back(new DomainLinux(i, c->getVirtualCores(), true));
           i++;
         }
       }
     }
+
+    /** Uncore domains are provided only if all the CPUs support them. **/
+    for(topology::Cpu* c : _topology->getCpus()){
+        UncoreDomainLinux* uncore = new UncoreDomainLinux(c);
+        _uncoreDomains.push_back(uncore);
+        if(!uncore->available()){
+            deleteVectorElements<UncoreDomain*>(_uncoreDomains);
+            break;
+        }
+    }
 }
 
 CpuFreqLinux::~CpuFreqLinux(){
+    stopWatcher();
+    for(FrequenciesSetter* setter : _setters){
+        setter->stop();
+        setter->join();
+    }
+    deleteVectorElements<FrequenciesSetter*>(_setters);
     deleteVectorElements<Domain*>(_domains);
+    deleteVectorElements<UncoreDomain*>(_uncoreDomains);
     topology::Topology::release(_topology);
 }
 
@@ -437,6 +1295,75 @@ vector<Domain*> CpuFreqLinux::getDomains() const{
     return _domains;
 }
 
+vector<UncoreDomain*> CpuFreqLinux::getUncoreDomains() const{
+    return _uncoreDomains;
+}
+
+bool CpuFreqLinux::setFrequencies(const vector<pair<Domain*, Frequency> >& frequencies) const{
+    size_t numThreads = frequencies.size() / MAMMUT_CPUFREQ_DOMAINS_PER_SETTER;
+    numThreads = min(numThreads, (size_t) MAMMUT_CPUFREQ_MAX_SETTERS);
+    numThreads = min(numThreads, _topology->getVirtualCores().size());
+    if(numThreads <= 1){
+        return CpuFreq::setFrequencies(frequencies);
+    }
+
+    ScopedLock scopedLock(_settersLock);
+    /** The threads are created at the first use and then kept alive. **/
+    while(_setters.size() < numThreads - 1){
+        FrequenciesSetter* setter = new FrequenciesSetter(_batch, _setters.size() + 1);
+        setter->start();
+        _setters.push_back(setter);
+    }
+
+    _batch.frequencies = &frequencies;
+    _batch.stride = numThreads;
+    _batch.pending = numThreads - 1;
+    _batch.failed = false;
+    for(size_t i = 0; i < numThreads - 1; i++){
+        _setters[i]->notify();
+    }
+    _batch.apply(0);
+    _batch.done.wait();
+    return !_batch.failed;
+}
+
+void CpuFreqLinux::stopWatcher(){
+    if(_watcher){
+        _watcher->stop();
+        _watcher->join();
+        delete _watcher;
+        _watcher = NULL;
+    }
+}
+
+bool CpuFreqLinux::enableCaching(bool watch){
+    /** A watcher which terminated because of an error is replaced. **/
+    if(_watcher && _watcher->failed()){
+        stopWatcher();
+    }
+    if(watch && !_watcher){
+        try{
+            _watcher = new CpuFreqWatcher(_domains);
+        }catch(const exception&){
+            return false;
+        }
+        _watcher->start();
+    }else if(!watch){
+        stopWatcher();
+    }
+    for(Domain* domain : _domains){
+        dynamic_cast<DomainLinux*>(domain)->setCaching(true);
+    }
+    return true;
+}
+
+void CpuFreqLinux::disableCaching(){
+    stopWatcher();
+    for(Domain* domain : _domains){
+        dynamic_cast<DomainLinux*>(domain)->setCaching(false);
+    }
+}
+
 bool CpuFreqLinux::isBoostingSupported() const{
     //TODO: Se esiste il file è abilitabile dinamicamente. Potrebbe esserci boosting anche se il file non esiste?
     return existsFile(_boostingFile);
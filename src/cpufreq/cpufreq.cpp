@@ -6,9 +6,15 @@
 #endif
 #include <mammut/utils.hpp>
 
+#include "algorithm"
+#include "atomic"
+#include "cmath"
 #include "fstream"
+#include "sched.h"
 #include "sstream"
 #include "stdexcept"
+#include "time.h"
+#include "unistd.h"
 
 #include "iostream"
 
@@ -59,6 +65,67 @@ bool Domain::isGovernorAvailable(Governor governor) const{
     return utils::contains(getAvailableGovernors(), governor);
 }
 
+std::vector<std::string> Domain::getAvailableEnergyPerformancePreferences() const{
+    return std::vector<std::string>();
+}
+
+std::string Domain::getEnergyPerformancePreference() const{
+    return "";
+}
+
+bool Domain::setEnergyPerformancePreference(const std::string& preference) const{
+    return false;
+}
+
+bool Domain::getPerformanceCapabilities(PerformanceCapabilities& capabilities) const{
+    return false;
+}
+
+bool Domain::getPerformanceHint(PerformanceHint& hint) const{
+    return false;
+}
+
+bool Domain::setPerformanceHint(const PerformanceHint& hint) const{
+    return false;
+}
+
+bool Domain::setPerformanceHint(const topology::VirtualCore* virtualCore,
+                                const PerformanceHint& hint) const{
+    return false;
+}
+
+bool Domain::setDirectControl(bool direct){
+    return !direct;
+}
+
+bool Domain::isDirectControlEnabled() const{
+    return false;
+}
+
+Frequency Domain::getEffectiveFrequency(const topology::VirtualCore* virtualCore) const{
+    return 0;
+}
+
+std::vector<Frequency> Domain::getEffectiveFrequencies() const{
+    return std::vector<Frequency>(_virtualCores.size(), 0);
+}
+
+std::vector<Frequency> Domain::getResidencyFrequencies() const{
+    return std::vector<Frequency>();
+}
+
+bool Domain::getFrequencyResidency(std::vector<uint64_t>& times) const{
+    return false;
+}
+
+bool Domain::getFrequencyTransitions(std::vector<uint64_t>& transitions) const{
+    return false;
+}
+
+void Domain::resetFrequencyResidency(){
+    ;
+}
+
 bool Domain::setHighestFrequencyUserspace() const{
     std::vector<Frequency> availableFrequencies = getAvailableFrequencies();
     if(!availableFrequencies.size()){
@@ -77,6 +144,15 @@ bool Domain::setLowestFrequencyUserspace() const{
     }
 }
 
+UncoreDomain::UncoreDomain(topology::Cpu* cpu):
+        _cpu(cpu){
+    ;
+}
+
+topology::Cpu* UncoreDomain::getCpu() const{
+    return _cpu;
+}
+
 Governor CpuFreq::getGovernorFromGovernorName(const std::string& governorName){
     Governor g;
     return utils::stringToEnum(governorName, g);
@@ -157,6 +233,19 @@ std::vector<Domain*> CpuFreq::getDomains(const topology::Cpu* cpu) const{
     return getDomains(cpu->getVirtualCores());
 }
 
+std::vector<UncoreDomain*> CpuFreq::getUncoreDomains() const{
+    return std::vector<UncoreDomain*>();
+}
+
+UncoreDomain* CpuFreq::getUncoreDomain(const topology::Cpu* cpu) const{
+    for(UncoreDomain* d : getUncoreDomains()){
+        if(d->getCpu()->getCpuId() == cpu->getCpuId()){
+            return d;
+        }
+    }
+    return NULL;
+}
+
 std::vector<Domain*> CpuFreq::getDomainsComplete(const std::vector<topology::VirtualCore*>& virtualCores) const{
     std::vector<Domain*> r;
     std::vector<Domain*> domains = getDomains();
@@ -198,6 +287,12 @@ RollbackPoint CpuFreq::getRollbackPoint() const{
         rp.lowerBounds.push_back(lb);
         rp.upperBounds.push_back(ub);
     }
+    for(UncoreDomain* u : getUncoreDomains()){
+        Frequency lb = 0, ub = 0;
+        u->getBounds(lb, ub);
+        rp.uncoreLowerBounds.push_back(lb);
+        rp.uncoreUpperBounds.push_back(ub);
+    }
     return rp;
 }
 
@@ -225,6 +320,308 @@ void CpuFreq::rollback(const RollbackPoint& rollbackPoint) const{
 
         i++;
     }
+
+    std::vector<UncoreDomain*> uncoreDomains = getUncoreDomains();
+    for(i = 0; i < rollbackPoint.uncoreLowerBounds.size() && i < uncoreDomains.size(); i++){
+        Frequency lb = rollbackPoint.uncoreLowerBounds[i];
+        Frequency ub = rollbackPoint.uncoreUpperBounds[i];
+        if(lb && ub && !uncoreDomains[i]->setBounds(lb, ub)){
+            throw std::runtime_error("UncoreDomain: Impossible to rollback the uncore domain to bounds: " +
+                                     utils::intToString(lb) + " " + utils::intToString(ub));
+        }
+    }
+}
+
+bool CpuFreq::setFrequencies(const std::vector<std::pair<Domain*, Frequency> >& frequencies) const{
+    bool r = true;
+    for(size_t i = 0; i < frequencies.size(); i++){
+        try{
+            if(!frequencies[i].first->setFrequencyUserspace(frequencies[i].second)){
+                r = false;
+            }
+        }catch(const std::exception&){
+            r = false;
+        }
+    }
+    return r;
+}
+
+bool CpuFreq::enableCaching(bool watch){
+    return false;
+}
+
+void CpuFreq::disableCaching(){
+    ;
+}
+
+/** Iterations of the busy loop timed by the transition probe. **/
+#define MAMMUT_TRANSITION_PROBE_ITERATIONS 2000
+/** Records kept by the transition probe (power of two). **/
+#define MAMMUT_TRANSITION_PROBE_RECORDS (1 << 16)
+/** Time (milliseconds) to wait for a frequency to be stable. **/
+#define MAMMUT_TRANSITION_SETTLE_MS 20
+/** Maximum time (milliseconds) to wait for a transition. **/
+#define MAMMUT_TRANSITION_TIMEOUT_MS 50
+/** Minimum relative difference between the durations of the loop at two frequencies. **/
+#define MAMMUT_TRANSITION_MIN_DIFFERENCE 0.05
+/** Consecutive iterations at the target frequency needed to detect a switch. **/
+#define MAMMUT_TRANSITION_CONFIRMATIONS 3
+
+static double getNanosecondsTime(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (double) MAMMUT_NANOSECS_IN_SEC + ts.tv_nsec;
+}
+
+/**
+ * Busy loop pinned on a virtual core. It records the start time and
+ * the duration of each iteration in a ring buffer. Records are
+ * overwritten after MAMMUT_TRANSITION_PROBE_RECORDS iterations.
+ */
+class TransitionProbeLoop: public TransitionProbe, public utils::Thread{
+private:
+    topology::VirtualCoreId _virtualCoreId;
+    std::atomic<bool> _stop;
+    std::atomic<size_t> _count;
+    std::vector<double> _starts;
+    std::vector<double> _durations;
+public:
+    explicit TransitionProbeLoop(topology::VirtualCoreId virtualCoreId):
+            _virtualCoreId(virtualCoreId), _stop(false), _count(0),
+            _starts(MAMMUT_TRANSITION_PROBE_RECORDS),
+            _durations(MAMMUT_TRANSITION_PROBE_RECORDS){
+        ;
+    }
+
+    void run(){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(_virtualCoreId, &set);
+        if(sched_setaffinity(0, sizeof(cpu_set_t), &set) == -1){
+            return;
+        }
+        volatile uint64_t work = 0;
+        while(!_stop.load(std::memory_order_relaxed)){
+            double start = getNanosecondsTime();
+            for(size_t i = 0; i < MAMMUT_TRANSITION_PROBE_ITERATIONS; i++){
+                work = work + i;
+            }
+            size_t count = _count.load(std::memory_order_relaxed);
+            _starts[count & (MAMMUT_TRANSITION_PROBE_RECORDS - 1)] = start;
+            _durations[count & (MAMMUT_TRANSITION_PROBE_RECORDS - 1)] = getNanosecondsTime() - start;
+            _count.store(count + 1, std::memory_order_release);
+        }
+    }
+
+    void stop(){
+        _stop = true;
+    }
+
+    size_t getCount() const{
+        return _count.load(std::memory_order_acquire);
+    }
+
+    size_t getCapacity() const{
+        return MAMMUT_TRANSITION_PROBE_RECORDS;
+    }
+
+    double getStart(size_t i) const{
+        return _starts[i & (MAMMUT_TRANSITION_PROBE_RECORDS - 1)];
+    }
+
+    double getDuration(size_t i) const{
+        return _durations[i & (MAMMUT_TRANSITION_PROBE_RECORDS - 1)];
+    }
+};
+
+/**
+ * Returns the median duration of the iterations started in the last
+ * milliseconds.
+ */
+static double getMedianDuration(const TransitionProbe& probe, uint milliseconds){
+    double from = getNanosecondsTime() - milliseconds * MAMMUT_NANOSECS_IN_MSEC;
+    std::vector<double> durations;
+    for(size_t i = probe.getCount(); i > 0 && probe.getCount() - i < probe.getCapacity() / 2 &&
+        probe.getStart(i - 1) >= from; i--){
+        durations.push_back(probe.getDuration(i - 1));
+    }
+    if(durations.empty()){
+        return 0;
+    }
+    std::nth_element(durations.begin(), durations.begin() + durations.size() / 2, durations.end());
+    return durations[durations.size() / 2];
+}
+
+static topology::VirtualCoreId getUsableVirtualCore(const Domain* domain){
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(cpu_set_t), &set) == 0){
+        for(topology::VirtualCoreId id : domain->getVirtualCoresIdentifiers()){
+            if(CPU_ISSET(id, &set)){
+                return id;
+            }
+        }
+    }
+    throw std::runtime_error("CpuFreq: None of the virtual cores of the domain can be used.");
+}
+
+/**
+ * Returns the time (nanoseconds) of the switch from a frequency to another,
+ * or -1 if the switch has not been detected.
+ */
+static double measureTransition(const Domain* domain, const TransitionProbe& probe,
+                                double durationFrom, double durationTo, Frequency to){
+    size_t first = probe.getCount();
+    double start = getNanosecondsTime();
+    domain->setFrequencyUserspace(to);
+    size_t confirmations = 0, candidate = 0;
+    size_t i = first;
+    while(getNanosecondsTime() - start < MAMMUT_TRANSITION_TIMEOUT_MS * MAMMUT_NANOSECS_IN_MSEC){
+        for(size_t count = probe.getCount(); i < count; i++){
+            if(probe.getStart(i) < start){
+                continue;
+            }
+            double d = probe.getDuration(i);
+            if(std::abs(d - durationTo) < std::abs(d - durationFrom)){
+                if(!confirmations++){
+                    candidate = i;
+                }
+                if(confirmations == MAMMUT_TRANSITION_CONFIRMATIONS){
+                    return probe.getStart(candidate) - start;
+                }
+            }else{
+                confirmations = 0;
+            }
+        }
+        usleep(100);
+    }
+    return -1;
+}
+
+/**
+ * Restores the governor of a domain (and stops the busy loop, if any)
+ * when the measurement of the transition latencies terminates, also
+ * if it terminates with an exception.
+ */
+class TransitionLatencyGuard{
+private:
+    const Domain* _domain;
+    TransitionProbeLoop* _loop;
+    Governor _governor;
+    Frequency _frequency;
+    Frequency _lowerBound, _upperBound;
+    bool _bounds;
+public:
+    explicit TransitionLatencyGuard(const Domain* domain):
+            _domain(domain), _loop(NULL), _lowerBound(0), _upperBound(0){
+        _governor = domain->getCurrentGovernor();
+        _frequency = domain->getCurrentFrequencyUserspace();
+        _bounds = domain->getCurrentGovernorBounds(_lowerBound, _upperBound);
+    }
+
+    void setLoop(TransitionProbeLoop* loop){
+        _loop = loop;
+    }
+
+    ~TransitionLatencyGuard(){
+        if(_loop){
+            _loop->stop();
+            _loop->join();
+            delete _loop;
+        }
+        // Destructors must not throw.
+        try{
+            _domain->setGovernor(_governor);
+            if(_governor == GOVERNOR_USERSPACE){
+                _domain->setFrequencyUserspace(_frequency);
+            }else if(_bounds){
+                _domain->setGovernorBounds(_lowerBound, _upperBound);
+            }
+        }catch(const std::exception&){
+            ;
+        }
+    }
+};
+
+TransitionLatencyMatrix CpuFreq::measureTransitionLatencies(const Domain* domain, uint repetitions,
+                                                            const TransitionProbe* probe){
+    TransitionLatencyMatrix r;
+    topology::VirtualCoreId virtualCoreId = probe ? 0 : getUsableVirtualCore(domain);
+    std::vector<Frequency> frequencies = domain->getAvailableFrequencies();
+    if(frequencies.size() < 2){
+        return r;
+    }
+    {
+        TransitionLatencyGuard guard(domain);
+        if(!domain->setGovernor(GOVERNOR_USERSPACE)){
+            return r;
+        }
+        if(!probe){
+            TransitionProbeLoop* loop = new TransitionProbeLoop(virtualCoreId);
+            loop->start();
+            guard.setLoop(loop);
+            probe = loop;
+        }
+
+        /** Duration of the loop at each frequency. **/
+        std::map<Frequency, double> durations;
+        for(Frequency f : frequencies){
+            domain->setFrequencyUserspace(f);
+            usleep(2 * MAMMUT_TRANSITION_SETTLE_MS * MAMMUT_MICROSECS_IN_MILLISEC);
+            durations[f] = getMedianDuration(*probe, MAMMUT_TRANSITION_SETTLE_MS);
+        }
+
+        for(Frequency from : frequencies){
+            for(Frequency to : frequencies){
+                double dFrom = durations[from], dTo = durations[to];
+                if(from == to || !dFrom || !dTo ||
+                   std::abs(dFrom - dTo) / std::max(dFrom, dTo) < MAMMUT_TRANSITION_MIN_DIFFERENCE){
+                    continue;
+                }
+                double sum = 0;
+                uint measured = 0;
+                for(uint i = 0; i < repetitions; i++){
+                    domain->setFrequencyUserspace(from);
+                    usleep(MAMMUT_TRANSITION_SETTLE_MS * MAMMUT_MICROSECS_IN_MILLISEC);
+                    double latency = measureTransition(domain, *probe, dFrom, dTo, to);
+                    if(latency >= 0){
+                        sum += latency;
+                        measured++;
+                    }
+                }
+                if(measured){
+                    r[TransitionLatencyKey(from, to)] = sum / measured;
+                }
+            }
+        }
+    }
+
+    utils::ScopedLock scopedLock(_transitionLatenciesLock);
+    _transitionLatencies[domain->getId()] = r;
+    return r;
+}
+
+TransitionLatencyMatrix CpuFreq::getTransitionLatencies(const Domain* domain) const{
+    utils::ScopedLock scopedLock(_transitionLatenciesLock);
+    std::map<DomainId, TransitionLatencyMatrix>::const_iterator it = _transitionLatencies.find(domain->getId());
+    if(it == _transitionLatencies.end()){
+        return TransitionLatencyMatrix();
+    }
+    return it->second;
+}
+
+double CpuFreq::getTransitionLatency(const Domain* domain, Frequency from, Frequency to) const{
+    {
+        utils::ScopedLock scopedLock(_transitionLatenciesLock);
+        std::map<DomainId, TransitionLatencyMatrix>::const_iterator it = _transitionLatencies.find(domain->getId());
+        if(it != _transitionLatencies.end()){
+            TransitionLatencyMatrix::const_iterator l = it->second.find(TransitionLatencyKey(from, to));
+            if(l != it->second.end()){
+                return l->second;
+            }
+        }
+    }
+    return domain->getTransitionLatency();
 }
 
 bool CpuFreq::isGovernorAvailable(Governor governor) const{
@@ -252,11 +649,16 @@ void loadVoltageTable(VoltageTable& voltageTable, std::string fileName){
     std::vector<std::string> fields;
     VoltageTableKey key;
     while(std::getline(file, line)){
-        /** Skips lines starting with #. **/
-        if(line.at(0) == '#'){
+        /** Skips empty lines and lines starting with #. **/
+        if(line.empty() || line.at(0) == '#'){
             continue;
         }
         fields = utils::split(line, ';');
+        /** Skips malformed lines. **/
+        if(fields.size() != 3 || !utils::isNumber(fields.at(0)) ||
+           !utils::isNumber(fields.at(1)) || fields.at(2).empty()){
+            continue;
+        }
         key.first = utils::stringToInt(fields.at(0));
         key.second = utils::stringToInt(fields.at(1));
         voltageTable.insert(std::pair<VoltageTableKey, Voltage>(key, utils::stringToDouble(fields.at(2))));
@@ -264,8 +666,14 @@ void loadVoltageTable(VoltageTable& voltageTable, std::string fileName){
 }
 
 void dumpVoltageTable(const VoltageTable& voltageTable, std::string fileName){
+    /**
+     * The table is written on a temporary file which then replaces the
+     * old one, so that the file is never left truncated (e.g. if the
+     * process is killed while writing a checkpoint).
+     */
+    std::string tmpFileName = fileName + ".tmp";
     std::ofstream file;
-    file.open(fileName.c_str());
+    file.open(tmpFileName.c_str());
     if(!file){
         throw std::runtime_error("Impossible to open the specified voltage table file.");
     }
@@ -277,6 +685,180 @@ void dumpVoltageTable(const VoltageTable& voltageTable, std::string fileName){
         file << iterator->first.first << ";" << iterator->first.second << ";" << iterator->second << std::endl;
     }
     file.close();
+    if(!file || rename(tmpFileName.c_str(), fileName.c_str())){
+        remove(tmpFileName.c_str());
+        throw std::runtime_error("Impossible to write the specified voltage table file.");
+    }
+}
+
+/**
+ * Computes the voltage table of a domain.
+ */
+class VoltageTableThread: public utils::Thread{
+private:
+    const VoltageTableBuilder& _builder;
+    const Domain* _domain;
+    double _deadline;
+public:
+    VoltageTable table;
+    std::string error;
+
+    VoltageTableThread(const VoltageTableBuilder& builder, const Domain* domain, double deadline):
+            _builder(builder), _domain(domain), _deadline(deadline){
+        ;
+    }
+
+    void run(){
+        try{
+            table = _builder.build(_domain, _deadline);
+        }catch(const std::exception& e){
+            error = e.what();
+        }
+    }
+};
+
+VoltageTableBuilder::VoltageTableBuilder(const std::vector<Domain*>& domains,
+                                         bool onlyPhysicalCores):
+        _domains(domains), _onlyPhysicalCores(onlyPhysicalCores),
+        _samplingInterval(100), _minSamples(5), _maxSamples(50),
+        _maxRelativeError(0.001), _timeout(0){
+    ;
+}
+
+void VoltageTableBuilder::setSampling(uint samplingInterval, uint minSamples, uint maxSamples,
+                                      double maxRelativeError){
+    if(!minSamples || minSamples > maxSamples){
+        throw std::runtime_error("VoltageTableBuilder: Invalid number of samples.");
+    }
+    _samplingInterval = samplingInterval;
+    _minSamples = minSamples;
+    _maxSamples = maxSamples;
+    _maxRelativeError = maxRelativeError;
+}
+
+void VoltageTableBuilder::setCheckpoint(const std::string& prefix){
+    _checkpointPrefix = prefix;
+}
+
+std::string VoltageTableBuilder::getCheckpointFile(const Domain* domain) const{
+    if(_checkpointPrefix.empty()){
+        return "";
+    }
+    return _checkpointPrefix + "." + utils::intToString(domain->getId()) + ".txt";
+}
+
+void VoltageTableBuilder::setTimeout(uint seconds){
+    _timeout = seconds;
+}
+
+Voltage VoltageTableBuilder::sample(const Domain* domain) const{
+    /** Welford's algorithm. **/
+    double mean = 0, m2 = 0;
+    for(uint n = 1; n <= _maxSamples; n++){
+        usleep(_samplingInterval * MAMMUT_MICROSECS_IN_MILLISEC);
+        Voltage v = domain->getCurrentVoltage();
+        double delta = v - mean;
+        mean += delta / n;
+        m2 += delta * (v - mean);
+        if(n >= _minSamples){
+            double standardError = sqrt(m2 / (n - 1 ? n - 1 : 1) / n);
+            if(!mean || standardError / mean <= _maxRelativeError){
+                break;
+            }
+        }
+    }
+    return mean;
+}
+
+VoltageTable VoltageTableBuilder::build(const Domain* domain, double deadline) const{
+    VoltageTable r;
+    std::string checkpointFile = getCheckpointFile(domain);
+    if(!checkpointFile.empty() && utils::existsFile(checkpointFile)){
+        loadVoltageTable(r, checkpointFile);
+    }
+
+    std::vector<topology::VirtualCore*> vcToMax;
+    if(_onlyPhysicalCores){
+        vcToMax = topology::getOneVirtualPerPhysical(domain->getVirtualCores());
+    }else{
+        vcToMax = domain->getVirtualCores();
+    }
+    std::vector<Frequency> frequencies = domain->getAvailableFrequencies();
+
+    Governor oldGovernor = domain->getCurrentGovernor();
+    Frequency oldFrequency = domain->getCurrentFrequencyUserspace();
+    Frequency oldLb = 0, oldUb = 0;
+    bool oldBounds = domain->getCurrentGovernorBounds(oldLb, oldUb);
+    if(!domain->setGovernor(GOVERNOR_USERSPACE)){
+        return r;
+    }
+
+    for(size_t n = 0; n <= vcToMax.size(); n++){
+        std::vector<Frequency> missing;
+        for(Frequency f : frequencies){
+            if(r.find(VoltageTableKey(n, f)) == r.end()){
+                missing.push_back(f);
+            }
+        }
+        if(missing.empty()){
+            continue;
+        }
+        if(deadline && utils::getMillisecondsTime() >= deadline){
+            break;
+        }
+
+        for(size_t i = 0; i < n; i++){
+            vcToMax.at(i)->maximizeUtilization();
+        }
+        for(Frequency f : missing){
+            if(deadline && utils::getMillisecondsTime() >= deadline){
+                break;
+            }
+            domain->setFrequencyUserspace(f);
+            r[VoltageTableKey(n, f)] = sample(domain);
+            if(!checkpointFile.empty()){
+                dumpVoltageTable(r, checkpointFile);
+            }
+        }
+        for(size_t i = 0; i < n; i++){
+            vcToMax.at(i)->resetUtilization();
+        }
+    }
+
+    domain->setGovernor(oldGovernor);
+    if(oldGovernor == GOVERNOR_USERSPACE){
+        domain->setFrequencyUserspace(oldFrequency);
+    }else if(oldBounds){
+        domain->setGovernorBounds(oldLb, oldUb);
+    }
+    return r;
+}
+
+std::vector<VoltageTable> VoltageTableBuilder::build() const{
+    double deadline = 0;
+    if(_timeout){
+        deadline = utils::getMillisecondsTime() + _timeout * MAMMUT_MILLISECS_IN_SEC;
+    }
+    std::vector<VoltageTableThread*> threads;
+    for(Domain* domain : _domains){
+        VoltageTableThread* thread = new VoltageTableThread(*this, domain, deadline);
+        thread->start();
+        threads.push_back(thread);
+    }
+    std::vector<VoltageTable> r;
+    std::string error;
+    for(VoltageTableThread* thread : threads){
+        thread->join();
+        r.push_back(thread->table);
+        if(error.empty()){
+            error = thread->error;
+        }
+    }
+    utils::deleteVectorElements<VoltageTableThread*>(threads);
+    if(!error.empty()){
+        throw std::runtime_error("VoltageTableBuilder: " + error);
+    }
+    return r;
 }
 
 #ifdef MAMMUT_REMOTE
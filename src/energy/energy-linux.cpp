@@ -2,7 +2,9 @@
 
 #include "../external/odroid-smartpower-linux/smartgauge.hpp"
 
+#include "algorithm"
 #include "cmath"
+#include "limits"
 #include "errno.h"
 #include "fcntl.h"
 #include "fstream"
@@ -27,6 +29,7 @@
 using namespace mammut::utils;
 
 namespace mammut{
+extern SimulationParameters simulationParameters;
 namespace energy{
 
 CounterAmesterLinux::CounterAmesterLinux(string jlsSensor, string wtsSensor):
@@ -58,6 +61,14 @@ Joules CounterAmesterLinux::getJoules(){
     return getAdjustedValue() - _lastValue;
 }
 
+PowerSample CounterAmesterLinux::getPowerSample(){
+    PowerSample r;
+    r.joules = getJoules();
+    r.timestampMs = getMillisecondsTime();
+    r.watts = _sensorWatts.readSum().value;
+    return r;
+}
+
 void CounterAmesterLinux::reset(){
     _lastValue = getAdjustedValue();
 }
@@ -122,12 +133,19 @@ double CounterPlugSmartPower2Linux::getWatts(){
   return p;
 }
 
-Joules CounterPlugSmartPower2Linux::getJoules(){
-    double watts = getWatts();
+PowerSample CounterPlugSmartPower2Linux::getPowerSample(){
+    PowerSample r;
+    r.watts = getWatts();
     ulong now = getMillisecondsTime();
-    _cumulativeJoules += watts*((now - _lastTimestamp)/1000.0);
+    _cumulativeJoules += r.watts*((now - _lastTimestamp)/1000.0);
     _lastTimestamp = now;
-    return _cumulativeJoules;
+    r.timestampMs = now;
+    r.joules = _cumulativeJoules;
+    return r;
+}
+
+Joules CounterPlugSmartPower2Linux::getJoules(){
+    return getPowerSample().joules;
 }
 
 void CounterPlugSmartPower2Linux::reset(){
@@ -184,12 +202,19 @@ double CounterPlugFileLinux::getWatts(){
 	return atof(values[0].c_str());
 }
 
-Joules CounterPlugFileLinux::getJoules(){
-	double watts = getWatts();
+PowerSample CounterPlugFileLinux::getPowerSample(){
+	PowerSample r;
+	r.watts = getWatts();
 	ulong now = getMillisecondsTime();
-	_cumulativeJoules += watts*((now - _lastTimestamp)/1000.0);
+	_cumulativeJoules += r.watts*((now - _lastTimestamp)/1000.0);
 	_lastTimestamp = now;
-	return _cumulativeJoules;
+	r.timestampMs = now;
+	r.joules = _cumulativeJoules;
+	return r;
+}
+
+Joules CounterPlugFileLinux::getJoules(){
+	return getPowerSample().joules;
 }
 
 void CounterPlugFileLinux::reset(){
@@ -252,12 +277,19 @@ CounterPlugINALinux::~CounterPlugINALinux(){
 
 }
 
-Joules CounterPlugINALinux::getJoules(){
+PowerSample CounterPlugINALinux::getPowerSample(){
+  PowerSample r;
   double now = getMillisecondsTime();
-  Joules j = (_sensorA7.getWatts() + _sensorA15.getWatts()) * ((now - _lastRead)/1000.0);
-  _cumulativeJoules += j;
+  r.watts = _sensorA7.getWatts() + _sensorA15.getWatts();
+  _cumulativeJoules += r.watts * ((now - _lastRead)/1000.0);
   _lastRead = now;
-  return j;
+  r.timestampMs = now;
+  r.joules = _cumulativeJoules;
+  return r;
+}
+
+Joules CounterPlugINALinux::getJoules(){
+  return getPowerSample().joules;
 }
 
 void CounterPlugINALinux::reset(){
@@ -280,6 +312,11 @@ CounterMemoryRaplLinux::CounterMemoryRaplLinux():_ccl(new CounterCpusLinuxMsr())
     }
 }
 
+CounterMemoryRaplLinux::~CounterMemoryRaplLinux(){
+    // Also stops the refresher of the counter.
+    delete _ccl;
+}
+
 Joules CounterMemoryRaplLinux::getJoules(){
     if(_ccl){
         return _ccl->getJoulesDramAll();
@@ -294,23 +331,141 @@ void CounterMemoryRaplLinux::reset(){
     }
 }
 
-CounterCpusLinuxRefresher::CounterCpusLinuxRefresher(CounterCpusLinux *counter):_counter(counter){
+/**
+ * Fraction of the time needed to wrap around (at the measured power)
+ * after which a counter is read again.
+ */
+#define REFRESHER_MARGIN 0.5
+/**
+ * Fraction of the time needed to wrap around at the power limit
+ * (if known) after which a counter is read in any case.
+ */
+#define REFRESHER_LIMIT_MARGIN 0.9
+#define REFRESHER_MIN_INTERVAL_MS 100.0
+
+double CounterCpusLinux::getPowerLimit(){
+    return 0;
+}
+
+CounterCpusLinuxRefresher::CounterCpusLinuxRefresher(CounterCpusLinux *counter):
+        _counter(counter), _wakeups(0), _refreshes(0), _lastIntervalMs(0){
     ;
 }
 
+RefresherStats CounterCpusLinuxRefresher::getStats() const{
+    RefresherStats r;
+    r.wakeups = _wakeups.load();
+    r.refreshes = _refreshes.load();
+    r.lastIntervalMs = _lastIntervalMs.load();
+    return r;
+}
+
 void CounterCpusLinuxRefresher::run(){
-    double sleepingIntervalMs = (_counter->getWrappingInterval() / 2) * 1000;
-    while(!_counter->_stopRefresher.timedWait(sleepingIntervalMs)){
-        _counter->getJoulesComponentsAll();
+    const std::vector<topology::Cpu*>& cpus = _counter->getCpus();
+    /**
+     * Since the wrap around of a counter is detected by comparing
+     * two consecutive reads, it must be read before it wraps twice,
+     * whatever the power consumed after the previous read. If the
+     * power limit is known, this bounds the interval. Otherwise the
+     * power may exceed TDP for short periods (e.g. PL2), and the
+     * margin is applied also to the wrapping interval at TDP, so that
+     * a burst after an idle period is not lost.
+     **/
+    Joules range = _counter->getCounterRange();
+    double powerLimit = _counter->getPowerLimit();
+    double maxIntervalMs;
+    if(powerLimit > 0){
+        maxIntervalMs = REFRESHER_LIMIT_MARGIN * (range / powerLimit) * MAMMUT_MILLISECS_IN_SEC;
+    }else{
+        maxIntervalMs = REFRESHER_MARGIN * _counter->getWrappingInterval() * MAMMUT_MILLISECS_IN_SEC;
+    }
+    double minIntervalMs = std::min(REFRESHER_MIN_INTERVAL_MS, maxIntervalMs);
+
+    topology::CpuId maxId = 0;
+    for(size_t i = 0; i < cpus.size(); i++){
+        maxId = std::max(maxId, cpus[i]->getCpuId());
+    }
+    std::vector<double> deadlines(maxId + 1), lastTimes(maxId + 1);
+    std::vector<JoulesCpu> lastJoules(maxId + 1);
+    double now = getMillisecondsTime();
+    for(size_t i = 0; i < cpus.size(); i++){
+        topology::CpuId cpuId = cpus[i]->getCpuId();
+        lastJoules[cpuId] = _counter->getJoulesComponents(cpuId);
+        lastTimes[cpuId] = now;
+        deadlines[cpuId] = now + maxIntervalMs;
+    }
+
+    while(true){
+        double next = std::numeric_limits<double>::max();
+        for(size_t i = 0; i < cpus.size(); i++){
+            next = std::min(next, deadlines[cpus[i]->getCpuId()]);
+        }
+        double sleepMs = std::max(0.0, next - getMillisecondsTime());
+        sleepMs = std::min(sleepMs, (double) std::numeric_limits<int>::max());
+        if(_counter->_stopRefresher.timedWait(std::ceil(sleepMs))){
+            break;
+        }
+        ++_wakeups;
+
+        now = getMillisecondsTime();
+        for(size_t i = 0; i < cpus.size(); i++){
+            topology::CpuId cpuId = cpus[i]->getCpuId();
+            if(deadlines[cpuId] > now){
+                continue;
+            }
+            JoulesCpu joules = _counter->getJoulesComponents(cpuId);
+            ++_refreshes;
+            // The components wrap independently. The one consuming more
+            // is the first one to wrap.
+            JoulesCpu delta = joules - lastJoules[cpuId];
+            Joules maxDelta = std::max(std::max(delta.cpu, delta.cores),
+                                       std::max(delta.graphic, delta.dram));
+            double elapsedMs = now - lastTimes[cpuId];
+            double intervalMs = maxIntervalMs;
+            if(maxDelta > 0 && elapsedMs > 0){
+                double watts = maxDelta / (elapsedMs / MAMMUT_MILLISECS_IN_SEC);
+                intervalMs = REFRESHER_MARGIN * (range / watts) * MAMMUT_MILLISECS_IN_SEC;
+            }
+            // If the counter was reset the delta is meaningless and
+            // the maximum interval is used.
+            intervalMs = std::max(minIntervalMs, std::min(intervalMs, maxIntervalMs));
+            lastJoules[cpuId] = joules;
+            lastTimes[cpuId] = now;
+            deadlines[cpuId] = now + intervalMs;
+            _lastIntervalMs = intervalMs;
+        }
     }
 }
 
 CounterCpusLinux::CounterCpusLinux():
   CounterCpus(topology::Topology::getInstance()),
-  _stopRefresher(){
+  _stopRefresher(),
+  _refresher(NULL){
   ;
 }
 
+void CounterCpusLinux::startRefresher(){
+  _refresher = new CounterCpusLinuxRefresher(this);
+  _refresher->start();
+}
+
+void CounterCpusLinux::stopRefresher(){
+  if(_refresher){
+    _stopRefresher.notifyAll();
+    _refresher->join();
+    delete _refresher;
+    _refresher = NULL;
+  }
+}
+
+RefresherStats CounterCpusLinux::getRefresherStats(){
+  if(_refresher){
+    return _refresher->getStats();
+  }else{
+    return CounterCpus::getRefresherStats();
+  }
+}
+
 JoulesCpu CounterCpusLinux::getJoulesComponents(topology::CpuId cpuId){
   return JoulesCpu(getJoulesCpu(cpuId), getJoulesCores(cpuId), getJoulesGraphic(cpuId), getJoulesDram(cpuId));
 }
@@ -320,7 +475,9 @@ bool CounterCpusLinuxMsr::hasCoresCounter(topology::Cpu* cpu){
     uint64_t dummy;
     return Msr(cpu->getVirtualCore()->getVirtualCoreId()).read(MSR_PP0_ENERGY_STATUS_INTEL, dummy) && dummy > 0;
   }else if(_family == CPU_FAMILY_AMD){
-    return false; // TODO Return true and implement per-core readings
+    // Per-core counters, checked on the first physical core of the CPU.
+    uint64_t dummy;
+    return Msr(cpu->getVirtualCore()->getVirtualCoreId()).read(MSR_PP0_ENERGY_STATUS_AMD, dummy) && dummy > 0;
   }
   return false;
 }
@@ -371,13 +528,13 @@ bool CounterCpusLinuxMsr::isCpuSupported(topology::Cpu* cpu){
 CounterCpusLinuxMsr::CounterCpusLinuxMsr():
         _initialized(false),
         _lock(),
-        _refresher(NULL),
         _msrs(NULL),
         _maxId(0),
         _powerPerUnit(0),
         _energyPerUnit(0),
         _timePerUnit(0),
         _thermalSpecPower(0),
+        _powerLimit(0),
         _joulesCpus(NULL),
         _lastReadCountersCpu(NULL),
         _lastReadCountersCores(NULL),
@@ -385,7 +542,8 @@ CounterCpusLinuxMsr::CounterCpusLinuxMsr():
         _lastReadCountersDram(NULL),
         _hasJoulesCores(false),
         _hasJoulesGraphic(false),
-        _hasJoulesDram(false){
+        _hasJoulesDram(false),
+        _hasJoulesPhysicalCores(false){
     ;
 }
 
@@ -405,7 +563,6 @@ bool CounterCpusLinuxMsr::init(){
     }
 
     _initialized = true;
-    _refresher = new CounterCpusLinuxRefresher(this);
 
     /**
      * I have one msr for each CPU. Since I have no guarantee that the CPU
@@ -476,17 +633,20 @@ bool CounterCpusLinuxMsr::init(){
             _hasJoulesGraphic = false;
         }
     }
+    if(_family == CPU_FAMILY_AMD && _hasJoulesCores){
+        _hasJoulesPhysicalCores = initPhysicalCoresCounters();
+        _hasJoulesCores = _hasJoulesPhysicalCores;
+    }
+    _powerLimit = readPowerLimit();
 
     reset();
-    _refresher->start();
+    startRefresher();
     return true;
 }
 
 CounterCpusLinuxMsr::~CounterCpusLinuxMsr(){
     if(_initialized){
-        _stopRefresher.notifyAll();
-        _refresher->join();
-        delete _refresher;
+        stopRefresher();
 
         for(size_t i = 0; i < _maxId + 1; i++){
             if(_msrs[i]){
@@ -500,10 +660,74 @@ CounterCpusLinuxMsr::~CounterCpusLinuxMsr(){
         delete[] _lastReadCountersCores;
         delete[] _lastReadCountersGraphic;
         delete[] _lastReadCountersDram;
+        deleteVectorElements<Msr*>(_msrsPhysicalCores);
+    }
+}
+
+static uint32_t deltaDiff(uint32_t c1, uint32_t c2){
+    if(c2 > c1){
+        return c2 - c1;
+    }else{
+        return (((uint32_t)0xFFFFFFFF) - c1) + (uint32_t)1 + c2;
     }
 }
 
-uint32_t CounterCpusLinuxMsr::readEnergyCounter(topology::CpuId cpuId, int which){
+bool CounterCpusLinuxMsr::initPhysicalCoresCounters(){
+    topology::CpuId maxCpuId = 0;
+    topology::PhysicalCoreId maxPhysicalCoreId = 0;
+    for(size_t i = 0; i < _cpus.size(); i++){
+        maxCpuId = std::max(maxCpuId, _cpus[i]->getCpuId());
+        std::vector<topology::PhysicalCore*> physicalCores = _cpus[i]->getPhysicalCores();
+        for(size_t j = 0; j < physicalCores.size(); j++){
+            maxPhysicalCoreId = std::max(maxPhysicalCoreId, physicalCores[j]->getPhysicalCoreId());
+        }
+    }
+    _msrsPhysicalCores.resize(maxPhysicalCoreId + 1, NULL);
+    _lastReadCountersPhysicalCores.resize(maxPhysicalCoreId + 1, 0);
+    _joulesPhysicalCores.resize(maxPhysicalCoreId + 1, 0);
+    _physicalCoresCpus.resize(maxPhysicalCoreId + 1, 0);
+    _cpusPhysicalCores.resize(maxCpuId + 1);
+    bool available = true;
+    for(size_t i = 0; i < _cpus.size(); i++){
+        std::vector<topology::PhysicalCore*> physicalCores = _cpus[i]->getPhysicalCores();
+        for(size_t j = 0; j < physicalCores.size(); j++){
+            topology::PhysicalCoreId id = physicalCores[j]->getPhysicalCoreId();
+            // One register per physical core, read from any of its virtual cores.
+            Msr* msr = new Msr(physicalCores[j]->getVirtualCore()->getVirtualCoreId());
+            uint64_t dummy;
+            if(!msr->available() || !msr->read(MSR_PP0_ENERGY_STATUS_AMD, dummy)){
+                available = false;
+            }
+            _msrsPhysicalCores[id] = msr;
+            _physicalCoresCpus[id] = _cpus[i]->getCpuId();
+            _cpusPhysicalCores[_cpus[i]->getCpuId()].push_back(id);
+        }
+    }
+    return available;
+}
+
+uint32_t CounterCpusLinuxMsr::readPhysicalCoreEnergyCounter(topology::PhysicalCoreId physicalCoreId){
+    uint64_t result;
+    if(!_msrsPhysicalCores[physicalCoreId]->read(MSR_PP0_ENERGY_STATUS_AMD, result)){
+        throw std::runtime_error("Fatal error. Counter has been created but registers are not present.");
+    }
+    return result & 0xFFFFFFFF;
+}
+
+void CounterCpusLinuxMsr::updatePhysicalCoresCounters(topology::CpuId cpuId){
+    const std::vector<topology::PhysicalCoreId>& physicalCores = _cpusPhysicalCores[cpuId];
+    Joules sum = 0;
+    for(size_t i = 0; i < physicalCores.size(); i++){
+        topology::PhysicalCoreId id = physicalCores[i];
+        uint32_t currentCounter = readPhysicalCoreEnergyCounter(id);
+        _joulesPhysicalCores[id] += ((double) deltaDiff(_lastReadCountersPhysicalCores[id], currentCounter)) * _energyPerUnit;
+        _lastReadCountersPhysicalCores[id] = currentCounter;
+        sum += _joulesPhysicalCores[id];
+    }
+    _joulesCpus[cpuId].cores = sum;
+}
+
+uint32_t CounterCpusLinuxMsr::readEnergyCounter(topology::CpuId cpuId, uint32_t which){
     switch(which){
         case MSR_PKG_ENERGY_STATUS_INTEL:
         case MSR_PP0_ENERGY_STATUS_INTEL:
@@ -524,15 +748,45 @@ uint32_t CounterCpusLinuxMsr::readEnergyCounter(topology::CpuId cpuId, int which
 }
 
 double CounterCpusLinuxMsr::getWrappingInterval(){
-    return ((double) 0xFFFFFFFF) * _energyPerUnit / _thermalSpecPower;
+    return getCounterRange() / _thermalSpecPower;
 }
 
-static uint32_t deltaDiff(uint32_t c1, uint32_t c2){
-    if(c2 > c1){
-        return c2 - c1;
-    }else{
-        return (((uint32_t)0xFFFFFFFF) - c1) + (uint32_t)1 + c2;
+double CounterCpusLinuxMsr::readPowerLimit(){
+    if(_family != CPU_FAMILY_INTEL){
+        return 0;
+    }
+    double limit = 0;
+    for(size_t i = 0; i < _cpus.size(); i++){
+        Msr* msr = _msrs[_cpus[i]->getCpuId()];
+        uint64_t value;
+        // PL2 bounds the power of the package also during bursts,
+        // without it the power may exceed PL1 for short periods.
+        if(!msr->read(MSR_PKG_RAPL_POWER_LIMIT_INTEL, value) ||
+           !((value >> 47) & 0x1)){
+            return 0;
+        }
+        limit = std::max(limit, _powerPerUnit * (double) ((value >> 32) & 0x7FFF));
+        if((value >> 15) & 0x1){
+            limit = std::max(limit, _powerPerUnit * (double) (value & 0x7FFF));
+        }
+        if(_hasJoulesDram){
+            // DRAM is not part of the package, its maximum power is used.
+            if(!msr->read(MSR_DRAM_POWER_INFO_INTEL, value) ||
+               !((value >> 32) & 0x7FFF)){
+                return 0;
+            }
+            limit = std::max(limit, _powerPerUnit * (double) ((value >> 32) & 0x7FFF));
+        }
     }
+    return limit;
+}
+
+double CounterCpusLinuxMsr::getPowerLimit(){
+    return _powerLimit;
+}
+
+Joules CounterCpusLinuxMsr::getCounterRange(){
+    return ((double) 0xFFFFFFFF) * _energyPerUnit;
 }
 
 void CounterCpusLinuxMsr::updateCounter(topology::CpuId cpuId, double& joules, uint32_t& lastReadCounter, uint32_t counterType){
@@ -541,6 +795,43 @@ void CounterCpusLinuxMsr::updateCounter(topology::CpuId cpuId, double& joules, u
     lastReadCounter = currentCounter;
 }
 
+void CounterCpusLinuxMsr::updateCounters(topology::CpuId cpuId){
+    if(_family == CPU_FAMILY_INTEL){
+        updateCounter(cpuId, _joulesCpus[cpuId].cpu, _lastReadCountersCpu[cpuId], MSR_PKG_ENERGY_STATUS_INTEL);
+        if(hasJoulesCores()){
+            updateCounter(cpuId, _joulesCpus[cpuId].cores, _lastReadCountersCores[cpuId], MSR_PP0_ENERGY_STATUS_INTEL);
+        }
+        if(hasJoulesGraphic()){
+            updateCounter(cpuId, _joulesCpus[cpuId].graphic, _lastReadCountersGraphic[cpuId], MSR_PP1_ENERGY_STATUS_INTEL);
+        }
+        if(hasJoulesDram()){
+            updateCounter(cpuId, _joulesCpus[cpuId].dram, _lastReadCountersDram[cpuId], MSR_DRAM_ENERGY_STATUS_INTEL);
+        }
+    }else if(_family == CPU_FAMILY_AMD){
+        updateCounter(cpuId, _joulesCpus[cpuId].cpu, _lastReadCountersCpu[cpuId], MSR_PKG_ENERGY_STATUS_AMD);
+        if(hasJoulesPhysicalCores()){
+            updatePhysicalCoresCounters(cpuId);
+        }
+    }
+}
+
+JoulesCpu CounterCpusLinuxMsr::getJoulesComponents(topology::CpuId cpuId){
+    ScopedLock sLock(_lock);
+    updateCounters(cpuId);
+    return _joulesCpus[cpuId];
+}
+
+void CounterCpusLinuxMsr::sampleAll(JoulesCpuSnapshot& snapshot){
+    ScopedLock sLock(_lock);
+    snapshot.timestamp = getMillisecondsTime();
+    snapshot.joules.resize(_maxId + 1);
+    for(size_t i = 0; i < _cpus.size(); i++){
+        topology::CpuId cpuId = _cpus[i]->getCpuId();
+        updateCounters(cpuId);
+        snapshot.joules[cpuId] = _joulesCpus[cpuId];
+    }
+}
+
 Joules CounterCpusLinuxMsr::getJoulesCpu(topology::CpuId cpuId){
     ScopedLock sLock(_lock);
     if(_family == CPU_FAMILY_INTEL){
@@ -557,7 +848,7 @@ Joules CounterCpusLinuxMsr::getJoulesCores(topology::CpuId cpuId){
         if(_family == CPU_FAMILY_INTEL){
           updateCounter(cpuId, _joulesCpus[cpuId].cores, _lastReadCountersCores[cpuId], MSR_PP0_ENERGY_STATUS_INTEL);
         }else{
-          // TODO Read joules from each individual core and sum them.
+          updatePhysicalCoresCounters(cpuId);
         }
         return _joulesCpus[cpuId].cores;
     }else{
@@ -595,7 +886,13 @@ void CounterCpusLinuxMsr::reset(){
         }else if(_family == CPU_FAMILY_AMD){
           _lastReadCountersCpu[i] = readEnergyCounter(i, MSR_PKG_ENERGY_STATUS_AMD);
         }
-        if(hasJoulesCores()){
+        if(hasJoulesPhysicalCores()){
+            for(size_t j = 0; j < _cpusPhysicalCores[i].size(); j++){
+                topology::PhysicalCoreId id = _cpusPhysicalCores[i][j];
+                _lastReadCountersPhysicalCores[id] = readPhysicalCoreEnergyCounter(id);
+                _joulesPhysicalCores[id] = 0;
+            }
+        }else if(hasJoulesCores()){
           _lastReadCountersCores[i] = readEnergyCounter(i, MSR_PP0_ENERGY_STATUS_INTEL);
         }
         if(hasJoulesGraphic()){
@@ -615,6 +912,24 @@ bool CounterCpusLinuxMsr::hasJoulesCores(){
     return _hasJoulesCores;
 }
 
+bool CounterCpusLinuxMsr::hasJoulesPhysicalCores(){
+    return _hasJoulesPhysicalCores;
+}
+
+Joules CounterCpusLinuxMsr::getJoulesPhysicalCore(topology::PhysicalCoreId physicalCoreId){
+    if(!hasJoulesPhysicalCores()){
+        return 0;
+    }
+    ScopedLock sLock(_lock);
+    topology::CpuId cpuId = _physicalCoresCpus.at(physicalCoreId);
+    uint32_t currentCounter = readPhysicalCoreEnergyCounter(physicalCoreId);
+    Joules delta = ((double) deltaDiff(_lastReadCountersPhysicalCores[physicalCoreId], currentCounter)) * _energyPerUnit;
+    _joulesPhysicalCores[physicalCoreId] += delta;
+    _lastReadCountersPhysicalCores[physicalCoreId] = currentCounter;
+    _joulesCpus[cpuId].cores += delta;
+    return _joulesPhysicalCores[physicalCoreId];
+}
+
 bool CounterCpusLinuxMsr::hasJoulesDram(){
     return _hasJoulesDram;
 }
@@ -626,14 +941,15 @@ bool CounterCpusLinuxMsr::hasJoulesGraphic(){
 CounterCpusLinuxSysFs::CounterCpusLinuxSysFs():
   _initialized(false),
   _lock(),
-  _refresher(NULL),
   _idCores(-1),
   _idGraphic(-1),
-  _idDram(-1){
+  _idDram(-1),
+  _maxValue(0),
+  _maxPower(0){
   ;
 }
 
-#define RAPL_SYSFS_PREFIX std::string("/sys/class/powercap/intel-rapl/intel-rapl:")
+#define RAPL_SYSFS_PREFIX (simulationParameters.sysfsRootPrefix + "/sys/class/powercap/intel-rapl/intel-rapl:")
 
 bool CounterCpusLinuxSysFs::init(){
   for(size_t i = 0; i < _cpus.size(); i++){
@@ -642,7 +958,6 @@ bool CounterCpusLinuxSysFs::init(){
       }
   }
   _initialized = true;
-  _refresher = new CounterCpusLinuxRefresher(this);
   int sub = 0;
   while(utils::existsFile(RAPL_SYSFS_PREFIX + "0/intel-rapl:0:" + utils::intToString(sub) + "/name")){
     std::string name = utils::readFirstLineFromFile(RAPL_SYSFS_PREFIX + "0/intel-rapl:0:" + utils::intToString(sub) + "/name");
@@ -660,20 +975,54 @@ bool CounterCpusLinuxSysFs::init(){
   _lastDram.resize(_cpus.size());
   _lastGraphic.resize(_cpus.size());
   _joulesCpus.resize(_cpus.size());
+  openFiles(_filesCpu, -1);
+  if(_idCores != -1){
+    openFiles(_filesCores, _idCores);
+  }
+  if(_idGraphic != -1){
+    openFiles(_filesGraphic, _idGraphic);
+  }
+  if(_idDram != -1){
+    openFiles(_filesDram, _idDram);
+  }
   _maxValue = atof(utils::readFirstLineFromFile(RAPL_SYSFS_PREFIX + "0/max_energy_range_uj").c_str()) / 1000000.0;
+  // Maximum power of the package, used to bound the refresh interval.
+  const char* powerFiles[] = {"0/constraint_0_max_power_uw", "0/constraint_0_power_limit_uw"};
+  for(size_t i = 0; i < sizeof(powerFiles) / sizeof(powerFiles[0]) && !_maxPower; i++){
+    if(utils::existsFile(RAPL_SYSFS_PREFIX + powerFiles[i])){
+      _maxPower = atof(utils::readFirstLineFromFile(RAPL_SYSFS_PREFIX + powerFiles[i]).c_str()) / 1000000.0;
+    }
+  }
   reset();
-  _refresher->start();
+  startRefresher();
   return true;
 }
 
-Joules CounterCpusLinuxSysFs::read(topology::CpuId cpuId, Joules& cumulative, int sub, std::vector<Joules> &last){
-  ScopedLock sLock(_lock);
-  Joules now;
-  if(sub != -1){
-    now = atof(utils::readFirstLineFromFile(RAPL_SYSFS_PREFIX + utils::intToString(cpuId) + "/intel-rapl:" + utils::intToString(cpuId) + ":" + utils::intToString(sub) + "/energy_uj").c_str()) / 1000000.0;
+double CounterCpusLinuxSysFs::getWrappingInterval(){
+  if(_maxPower > 0){
+    return _maxValue / _maxPower;
   }else{
-    now = atof(utils::readFirstLineFromFile(RAPL_SYSFS_PREFIX + utils::intToString(cpuId) + "/energy_uj").c_str()) / 1000000.0;
+    return 10;
+  }
+}
+
+void CounterCpusLinuxSysFs::openFiles(std::vector<utils::SysfsFile*>& files, int sub){
+  for(size_t i = 0; i < _cpus.size(); i++){
+    std::string cpuId = utils::intToString(i);
+    if(sub != -1){
+      files.push_back(new utils::SysfsFile(RAPL_SYSFS_PREFIX + cpuId + "/intel-rapl:" + cpuId + ":" + utils::intToString(sub) + "/energy_uj"));
+    }else{
+      files.push_back(new utils::SysfsFile(RAPL_SYSFS_PREFIX + cpuId + "/energy_uj"));
+    }
   }
+}
+
+Joules CounterCpusLinuxSysFs::read(topology::CpuId cpuId, Joules& cumulative, const std::vector<utils::SysfsFile*>& files, std::vector<Joules> &last){
+  char buffer[32];
+  size_t length = files[cpuId]->read(buffer, sizeof(buffer));
+  uint64_t microJoules = 0;
+  utils::parseU64(buffer, buffer + length, microJoules);
+  Joules now = microJoules / 1000000.0;
   Joules r;
   if(last[cpuId] > now){
     r = _maxValue - last[cpuId] + now;
@@ -685,13 +1034,44 @@ Joules CounterCpusLinuxSysFs::read(topology::CpuId cpuId, Joules& cumulative, in
   return cumulative;
 }
 
+void CounterCpusLinuxSysFs::updateCounters(topology::CpuId cpuId){
+  read(cpuId, _joulesCpus[cpuId].cpu, _filesCpu, _lastCpu);
+  if(_idCores != -1){
+    read(cpuId, _joulesCpus[cpuId].cores, _filesCores, _lastCores);
+  }
+  if(_idGraphic != -1){
+    read(cpuId, _joulesCpus[cpuId].graphic, _filesGraphic, _lastGraphic);
+  }
+  if(_idDram != -1){
+    read(cpuId, _joulesCpus[cpuId].dram, _filesDram, _lastDram);
+  }
+}
+
+JoulesCpu CounterCpusLinuxSysFs::getJoulesComponents(topology::CpuId cpuId){
+  ScopedLock sLock(_lock);
+  updateCounters(cpuId);
+  return _joulesCpus[cpuId];
+}
+
+void CounterCpusLinuxSysFs::sampleAll(JoulesCpuSnapshot& snapshot){
+  ScopedLock sLock(_lock);
+  snapshot.timestamp = getMillisecondsTime();
+  snapshot.joules.resize(_cpus.size());
+  for(size_t i = 0; i < _cpus.size(); i++){
+    updateCounters(i);
+    snapshot.joules[i] = _joulesCpus[i];
+  }
+}
+
 Joules CounterCpusLinuxSysFs::getJoulesCpu(topology::CpuId cpuId){
-  return read(cpuId, _joulesCpus[cpuId].cpu, -1, _lastCpu);
+  ScopedLock sLock(_lock);
+  return read(cpuId, _joulesCpus[cpuId].cpu, _filesCpu, _lastCpu);
 }
 
 Joules CounterCpusLinuxSysFs::getJoulesCores(topology::CpuId cpuId){
   if(_idCores != -1){
-    return read(cpuId, _joulesCpus[cpuId].cores, _idCores, _lastCores);
+    ScopedLock sLock(_lock);
+    return read(cpuId, _joulesCpus[cpuId].cores, _filesCores, _lastCores);
   }else{
     return 0;
   }
@@ -699,7 +1079,8 @@ Joules CounterCpusLinuxSysFs::getJoulesCores(topology::CpuId cpuId){
 
 Joules CounterCpusLinuxSysFs::getJoulesGraphic(topology::CpuId cpuId){
   if(_idGraphic != -1){
-    return read(cpuId, _joulesCpus[cpuId].graphic, _idGraphic, _lastGraphic);
+    ScopedLock sLock(_lock);
+    return read(cpuId, _joulesCpus[cpuId].graphic, _filesGraphic, _lastGraphic);
   }else{
     return 0;
   }
@@ -707,7 +1088,8 @@ Joules CounterCpusLinuxSysFs::getJoulesGraphic(topology::CpuId cpuId){
 
 Joules CounterCpusLinuxSysFs::getJoulesDram(topology::CpuId cpuId){
   if(_idDram != -1){
-    return read(cpuId, _joulesCpus[cpuId].dram, _idDram, _lastDram);
+    ScopedLock sLock(_lock);
+    return read(cpuId, _joulesCpus[cpuId].dram, _filesDram, _lastDram);
   }else{
     return 0;
   }
@@ -726,11 +1108,9 @@ bool CounterCpusLinuxSysFs::hasJoulesGraphic(){
 }
 
 void CounterCpusLinuxSysFs::reset(){
+  ScopedLock sLock(_lock);
   for(size_t i = 0; i < _cpus.size(); i++){
-    getJoulesCpu(i);
-    getJoulesCores(i);
-    getJoulesGraphic(i);
-    getJoulesDram(i);
+    updateCounters(i);
     _joulesCpus[i].cpu = 0;
     _joulesCpus[i].cores = 0;
     _joulesCpus[i].graphic = 0;
@@ -740,10 +1120,12 @@ void CounterCpusLinuxSysFs::reset(){
 
 CounterCpusLinuxSysFs::~CounterCpusLinuxSysFs(){
   if(_initialized){
-      _stopRefresher.notifyAll();
-      _refresher->join();
-      delete _refresher;
+      stopRefresher();
   }
+  utils::deleteVectorElements<utils::SysfsFile*>(_filesCpu);
+  utils::deleteVectorElements<utils::SysfsFile*>(_filesCores);
+  utils::deleteVectorElements<utils::SysfsFile*>(_filesGraphic);
+  utils::deleteVectorElements<utils::SysfsFile*>(_filesDram);
 }
 
 PowerCapperLinux::PowerCapperLinux(CounterType type):PowerCapper(type), _good(false){
@@ -6,23 +6,99 @@
 #endif
 #include <mammut/topology/topology.hpp>
 
+#include "algorithm"
+#include "errno.h"
+#include "sched.h"
 #include "stdexcept"
+#include "time.h"
 
 namespace mammut{
 namespace energy{
 
+PowerSample PowerEstimator::update(double timestampMs, Joules joules, double windowMs){
+    utils::ScopedLock sLock(_lock);
+    if(!_samples.empty() && joules < _samples.back().second){
+        _samples.clear();
+    }
+    _samples.push_back(std::pair<double, Joules>(timestampMs, joules));
+    /**
+     * Keeps as oldest sample the most recent one which is at
+     * least one window old.
+     */
+    while(_samples.size() > 2 && _samples[1].first <= timestampMs - windowMs){
+        _samples.pop_front();
+    }
+    PowerSample r;
+    r.timestampMs = timestampMs;
+    r.joules = joules;
+    r.watts = 0;
+    if(_samples.size() >= 2 && timestampMs > _samples.front().first){
+        r.watts = (joules - _samples.front().second) /
+                  ((timestampMs - _samples.front().first) / MAMMUT_MILLISECS_IN_SEC);
+    }
+    return r;
+}
+
+void PowerEstimator::clear(){
+    utils::ScopedLock sLock(_lock);
+    _samples.clear();
+}
+
+PowerSample Counter::getPowerSample(){
+    Joules joules = getJoules();
+    return _powerEstimator.update(utils::getMillisecondsTime(), joules, _powerWindowMs);
+}
+
+void Counter::setPowerWindow(double windowMs){
+    _powerWindowMs = windowMs;
+}
+
 CounterCpus::CounterCpus(topology::Topology* topology):
         _topology(topology),
         _cpus(_topology->getCpus()){
-    ;
+    for(size_t i = 0; i < _cpus.size(); i++){
+        topology::CpuId cpuId = _cpus[i]->getCpuId();
+        if(cpuId >= _cpusPowerEstimators.size()){
+            _cpusPowerEstimators.resize(cpuId + 1, NULL);
+        }
+        _cpusPowerEstimators[cpuId] = new PowerEstimator();
+    }
+}
+
+CounterCpus::~CounterCpus(){
+    utils::deleteVectorElements<PowerEstimator*>(_cpusPowerEstimators);
+}
+
+PowerSample CounterCpus::getPowerSample(topology::CpuId cpuId){
+    Joules joules = getJoulesCpu(cpuId);
+    return _cpusPowerEstimators.at(cpuId)->update(utils::getMillisecondsTime(), joules, _powerWindowMs);
+}
+
+RefresherStats CounterCpus::getRefresherStats(){
+    RefresherStats r;
+    r.wakeups = 0;
+    r.refreshes = 0;
+    r.lastIntervalMs = 0;
+    return r;
 }
 
 JoulesCpu CounterCpus::getJoulesComponentsAll(){
-    JoulesCpu r;
+    JoulesCpuSnapshot snapshot;
+    sampleAll(snapshot);
+    return snapshot.getTotal();
+}
+
+void CounterCpus::sampleAll(JoulesCpuSnapshot& snapshot){
+    topology::CpuId maxId = 0;
     for(size_t i = 0; i < _cpus.size(); i++){
-        r += getJoulesComponents(_cpus.at(i)->getCpuId());
+        maxId = std::max(maxId, _cpus[i]->getCpuId());
+    }
+    snapshot.timestamp = utils::getMillisecondsTime();
+    snapshot.joules.resize(maxId + 1);
+    for(size_t i = 0; i < _cpus.size(); i++){
+        topology::CpuId cpuId = _cpus[i]->getCpuId();
+        snapshot.joules[cpuId] = getJoulesComponents(cpuId);
     }
-    return r;
 }
 
 Joules CounterCpus::getJoulesCpuAll(){
@@ -41,6 +117,18 @@ Joules CounterCpus::getJoulesCoresAll(){
     return r;
 }
 
+bool CounterCpus::hasJoulesPhysicalCores(){
+    return false;
+}
+
+Joules CounterCpus::getJoulesPhysicalCore(topology::PhysicalCoreId physicalCoreId){
+    return 0;
+}
+
+Joules CounterCpus::getJoulesPhysicalCore(topology::PhysicalCore* physicalCore){
+    return getJoulesPhysicalCore(physicalCore->getPhysicalCoreId());
+}
+
 Joules CounterCpus::getJoulesGraphicAll(){
     Joules r = 0;
     for(size_t i = 0; i < _cpus.size(); i++){
@@ -426,7 +514,180 @@ bool Energy::processMessage(const std::string& messageIdIn, const std::string& m
 }
 #endif
 
+EnergySampler::EnergySampler(Energy* energy, double periodMs, size_t capacity,
+                             const topology::VirtualCore* virtualCore):
+        _energy(energy), _periodMs(periodMs),
+        _virtualCoreId(virtualCore ? (int) virtualCore->getVirtualCoreId() : -1),
+        _slots(NULL), _mask(0), _head(0), _stop(false), _failed(false){
+    if(periodMs <= 0){
+        throw std::runtime_error("EnergySampler: The period must be positive.");
+    }
+    size_t size = 1;
+    while(size < capacity){
+        size <<= 1;
+    }
+    _slots = new Slot[size];
+    for(size_t i = 0; i < size; i++){
+        _slots[i].sequence.store(0, std::memory_order_relaxed);
+    }
+    _mask = size - 1;
+}
+
+EnergySampler::~EnergySampler(){
+    stop();
+    delete[] _slots;
+}
+
+void EnergySampler::stop(){
+    _stop.store(true);
+    // The thread must be joined even if it already terminated (or did
+    // not set itself as running yet), before the slots are released.
+    // The pid is set when the thread is started and reset by join().
+    if(getPidAndTid().first){
+        join();
+    }
+    // So that the sampler can be started again.
+    _stop.store(false);
+}
+
+std::string EnergySampler::getError() const{
+    if(_failed.load(std::memory_order_acquire)){
+        return _error;
+    }
+    return "";
+}
+
+/**
+ * Each slot is protected by a sequence number (seqlock). It is odd while
+ * the slot is written and 2 * (n + 1) once record n has been stored in it.
+ */
+void EnergySampler::push(uint64_t sample, double timestampMs, CounterType type,
+                         topology::CpuId cpuId, const JoulesCpu& joules){
+    uint64_t n = _head.load(std::memory_order_relaxed);
+    Slot& slot = _slots[n & _mask];
+    slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    slot.record.sample = sample;
+    slot.record.timestampMs = timestampMs;
+    slot.record.type = type;
+    slot.record.cpuId = cpuId;
+    slot.record.joules = joules;
+    slot.sequence.store(2 * (n + 1), std::memory_order_release);
+    _head.store(n + 1, std::memory_order_release);
+}
+
+void EnergySampler::sample(uint64_t sample){
+    CounterCpus* counterCpus = dynamic_cast<CounterCpus*>(_energy->getCounter(COUNTER_CPUS));
+    if(counterCpus){
+        counterCpus->sampleAll(_snapshot);
+        const std::vector<topology::Cpu*>& cpus = counterCpus->getCpus();
+        for(size_t i = 0; i < cpus.size(); i++){
+            topology::CpuId cpuId = cpus[i]->getCpuId();
+            push(sample, _snapshot.timestamp, COUNTER_CPUS, cpuId, _snapshot.joules[cpuId]);
+        }
+    }
+    CounterType others[] = {COUNTER_MEMORY, COUNTER_PLUG};
+    for(size_t i = 0; i < sizeof(others) / sizeof(others[0]); i++){
+        Counter* counter = _energy->getCounter(others[i]);
+        if(counter){
+            Joules joules = counter->getJoules();
+            push(sample, utils::getMillisecondsTime(), others[i], 0,
+                 JoulesCpu(joules, 0, 0, 0));
+        }
+    }
+}
+
+void EnergySampler::run(){
+    if(_virtualCoreId != -1){
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(_virtualCoreId, &set);
+        if(sched_setaffinity(0, sizeof(cpu_set_t), &set) == -1){
+            // Exceptions can't be propagated outside of the thread.
+            _error = "EnergySampler: Impossible to pin the thread: " +
+                     utils::errnoToStr();
+            _failed.store(true, std::memory_order_release);
+            return;
+        }
+    }
+
+    uint64_t periodNs = _periodMs * MAMMUT_NANOSECS_IN_MSEC;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t sampleId = 0;
+    while(!_stop.load(std::memory_order_relaxed)){
+        try{
+            sample(sampleId++);
+        }catch(const std::exception& e){
+            _error = std::string("EnergySampler: Impossible to sample: ") + e.what();
+            _failed.store(true, std::memory_order_release);
+            return;
+        }
+
+        /**
+         * Absolute deadlines, so that the time spent sampling does not
+         * accumulate as drift. If we are late by more than a period,
+         * the missed samples are skipped.
+         */
+        uint64_t next = deadline.tv_sec * (uint64_t) MAMMUT_NANOSECS_IN_SEC +
+                        deadline.tv_nsec + periodNs;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        uint64_t nowNs = now.tv_sec * (uint64_t) MAMMUT_NANOSECS_IN_SEC + now.tv_nsec;
+        if(next < nowNs){
+            next = nowNs + periodNs - ((nowNs - next) % periodNs);
+        }
+        deadline.tv_sec = next / MAMMUT_NANOSECS_IN_SEC;
+        deadline.tv_nsec = next % MAMMUT_NANOSECS_IN_SEC;
+        while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR){
+            ;
+        }
+    }
 }
+
+EnergySamplerCursor EnergySampler::getCursor() const{
+    EnergySamplerCursor cursor;
+    cursor.next = _head.load(std::memory_order_acquire);
+    cursor.lost = 0;
+    return cursor;
 }
 
+bool EnergySampler::read(EnergySamplerCursor& cursor, EnergySamplerRecord& record) const{
+    while(true){
+        uint64_t head = _head.load(std::memory_order_acquire);
+        if(cursor.next >= head){
+            return false;
+        }
+        if(head - cursor.next > _mask + 1){
+            cursor.lost += head - cursor.next - (_mask + 1);
+            cursor.next = head - (_mask + 1);
+        }
+        const Slot& slot = _slots[cursor.next & _mask];
+        uint64_t expected = 2 * (cursor.next + 1);
+        uint64_t before = slot.sequence.load(std::memory_order_acquire);
+        if(before == expected){
+            record = slot.record;
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if(slot.sequence.load(std::memory_order_relaxed) == expected){
+                ++cursor.next;
+                return true;
+            }
+        }
+        // Overwritten by the sampler while we were reading it.
+        ++cursor.lost;
+        ++cursor.next;
+    }
+}
 
+size_t EnergySampler::read(EnergySamplerCursor& cursor, std::vector<EnergySamplerRecord>& records) const{
+    size_t r = 0;
+    EnergySamplerRecord record;
+    while(read(cursor, record)){
+        records.push_back(record);
+        ++r;
+    }
+    return r;
+}
+
+}
+}
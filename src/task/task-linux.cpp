@@ -70,7 +70,8 @@ typedef enum{
     PROC_STAT_ARG_END,
     PROC_STAT_ENV_START,
     PROC_STAT_ENV_END,
-    PROC_STAT_EXIT_CODE
+    PROC_STAT_EXIT_CODE,
+    PROC_STAT_NUM
 }ProcStatFields;
 
 #define EXECUTE_AND_CHECK_ACTIVE(COMMAND) do{ \
@@ -86,7 +87,8 @@ typedef enum{
                                    }while(0)\
 
 ExecutionUnitLinux::ExecutionUnitLinux(TaskId id, std::string path):_id(id),
-    _path(path), _hertz(utils::getClockTicksPerSecond()){
+    _path(path), _statFile(path + "stat"), _upTimeFile("/proc/uptime"),
+    _hertz(utils::getClockTicksPerSecond()){
     resetCoreUsage();
 }
 
@@ -99,18 +101,23 @@ std::string ExecutionUnitLinux::getPath() const{
 }
 
 double ExecutionUnitLinux::getUpTime() const{
-    return utils::stringToInt(utils::split(utils::readFirstLineFromFile(std::string("/proc/uptime")), ' ').at(0));
+    char buffer[64];
+    size_t length = _upTimeFile.read(buffer, sizeof(buffer));
+    uint64_t upTime = 0;
+    utils::parseU64(buffer, buffer + length, upTime);
+    return upTime;
 }
 
 double ExecutionUnitLinux::getCpuTime() const{
-    std::vector<std::string> statValues = getStatFields();
+    int64_t statValues[PROC_STAT_NUM];
+    getStatFields(statValues);
 
-    double uTime = (double) utils::stringToInt(statValues.at(PROC_STAT_UTIME));
-    double sTime = (double) utils::stringToInt(statValues.at(PROC_STAT_STIME));
+    double uTime = (double) statValues[PROC_STAT_UTIME];
+    double sTime = (double) statValues[PROC_STAT_STIME];
     double cpuTime = uTime + sTime;
     if(0){ //TODO:
-        double cuTime = (double) utils::stringToInt(statValues.at(PROC_STAT_CUTIME));
-        double csTime = (double) utils::stringToInt(statValues.at(PROC_STAT_CSTIME));
+        double cuTime = (double) statValues[PROC_STAT_CUTIME];
+        double csTime = (double) statValues[PROC_STAT_CSTIME];
         cpuTime += (cuTime + csTime);
     }
     return cpuTime;
@@ -121,8 +128,19 @@ bool ExecutionUnitLinux::isActive() const{
     //return !kill(_id, 0);
 }
 
-std::vector<std::string> ExecutionUnitLinux::getStatFields() const{
-    return utils::split(utils::readFirstLineFromFile(_path + "stat"), ' ');
+void ExecutionUnitLinux::getStatFields(int64_t* fields) const{
+    char buffer[1024];
+    size_t length = _statFile.read(buffer, sizeof(buffer));
+    // The command name may contain spaces and parentheses, the fields
+    // after it start after the last ')'.
+    const char* comm = (const char*) memrchr(buffer, ')', length);
+    if(!comm){
+        throw std::runtime_error("Wrong format of " + _statFile.getFileName());
+    }
+    memset(fields, 0, sizeof(int64_t) * PROC_STAT_NUM);
+    utils::parseS64(buffer, comm, fields[PROC_STAT_PID]);
+    utils::parseFields(comm + 1, buffer + length, fields + PROC_STAT_STATE,
+                       PROC_STAT_NUM - PROC_STAT_STATE);
 }
 
 bool ExecutionUnitLinux::getCoreUsage(double& coreUsage) const{
@@ -142,7 +160,9 @@ bool ExecutionUnitLinux::resetCoreUsage(){
 }
 
 bool ExecutionUnitLinux::getPriority(uint& priority) const{
-    EXECUTE_AND_CHECK_ACTIVE(priority = -(PRIO_MIN + utils::stringToInt(getStatFields().at(PROC_STAT_NICE))););
+    int64_t statValues[PROC_STAT_NUM];
+    EXECUTE_AND_CHECK_ACTIVE(getStatFields(statValues););
+    priority = -(PRIO_MIN + statValues[PROC_STAT_NICE]);
     return true;
 }
 
@@ -158,7 +178,9 @@ bool ExecutionUnitLinux::setPriority(uint priority) const{
 }
 
 bool ExecutionUnitLinux::getVirtualCoreId(topology::VirtualCoreId& virtualCoreId) const{
-    EXECUTE_AND_CHECK_ACTIVE(virtualCoreId = utils::stringToInt(getStatFields().at(PROC_STAT_PROCESSOR)););
+    int64_t statValues[PROC_STAT_NUM];
+    EXECUTE_AND_CHECK_ACTIVE(getStatFields(statValues););
+    virtualCoreId = statValues[PROC_STAT_PROCESSOR];
     return true;
 }
 
@@ -172,6 +194,16 @@ bool ExecutionUnitLinux::move(const topology::PhysicalCore* physicalCore) const{
     return move(std::vector<const topology::VirtualCore*>(v.begin(), v.end()));
 }
 
+bool ExecutionUnitLinux::move(const topology::NumaNode* numaNode) const{
+    std::vector<topology::VirtualCore*> v = numaNode->getVirtualCores();
+    return move(std::vector<const topology::VirtualCore*>(v.begin(), v.end()));
+}
+
+bool ExecutionUnitLinux::move(const topology::CacheDomain* cacheDomain) const{
+    std::vector<topology::VirtualCore*> v = cacheDomain->getVirtualCores();
+    return move(std::vector<const topology::VirtualCore*>(v.begin(), v.end()));
+}
+
 bool ExecutionUnitLinux::move(const topology::VirtualCore* virtualCore) const{
     std::vector<const topology::VirtualCore*> v;
     v.push_back(virtualCore);
@@ -357,6 +389,23 @@ bool ProcessHandlerLinux::move(const std::vector<topology::VirtualCoreId>& virtu
     return true;
 }
 
+bool ProcessHandlerLinux::moveThreads(const std::vector<TaskId>& threads,
+                                      const std::vector<std::vector<topology::VirtualCoreId> >& virtualCoresIds) const{
+    if(threads.size() != virtualCoresIds.size()){
+        throw std::runtime_error("moveThreads: threads and virtual cores must have the same size.");
+    }
+    cpu_set_t set;
+    for(size_t i = 0; i < threads.size(); i++){
+        CPU_ZERO(&set);
+        for(size_t j = 0; j < virtualCoresIds[i].size(); j++){
+            CPU_SET(virtualCoresIds[i][j], &set);
+        }
+        // Fails only if the thread terminated in the meantime.
+        sched_setaffinity(threads[i], sizeof(cpu_set_t), &set);
+    }
+    return isActive();
+}
+
 std::string ProcessHandlerLinux::getSetPriorityIdentifiers() const{
     std::vector<TaskId> ids = getActiveThreadsIdentifiers();
     std::string r;
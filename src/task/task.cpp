@@ -1,6 +1,10 @@
 #include <mammut/task/task.hpp>
 #include <mammut/task/task-linux.hpp>
 
+#include "algorithm"
+#include "map"
+#include "stdexcept"
+
 namespace mammut{
 namespace task{
 
@@ -22,5 +26,139 @@ void TasksManager::release(TasksManager* pm){
     }
 }
 
+/**
+ * Sorts the virtual cores so that the first virtual core of each
+ * physical core comes before the second one of any physical core,
+ * and so on. The relative order is otherwise preserved.
+ */
+static std::vector<topology::VirtualCore*> siblingsLast(const std::vector<topology::VirtualCore*>& virtualCores){
+    std::map<topology::PhysicalCoreId, size_t> used;
+    std::vector<std::pair<size_t, topology::VirtualCore*> > ranked;
+    ranked.reserve(virtualCores.size());
+    for(size_t i = 0; i < virtualCores.size(); i++){
+        topology::VirtualCore* vc = virtualCores[i];
+        ranked.push_back(std::pair<size_t, topology::VirtualCore*>(used[vc->getPhysicalCoreId()]++, vc));
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+                     [](const std::pair<size_t, topology::VirtualCore*>& a,
+                        const std::pair<size_t, topology::VirtualCore*>& b){
+                         return a.first < b.first;
+                     });
+    std::vector<topology::VirtualCore*> r;
+    r.reserve(ranked.size());
+    for(size_t i = 0; i < ranked.size(); i++){
+        r.push_back(ranked[i].second);
+    }
+    return r;
+}
+
+PlacementPlanner::PlacementPlanner(const topology::Topology* topology):
+        _topology(topology){
+    ;
+}
+
+std::vector<topology::VirtualCore*> PlacementPlanner::interleave(const std::vector<std::vector<topology::VirtualCore*> >& groups) const{
+    std::vector<std::vector<topology::VirtualCore*> > sorted;
+    size_t maxSize = 0;
+    for(size_t i = 0; i < groups.size(); i++){
+        sorted.push_back(siblingsLast(groups[i]));
+        maxSize = std::max(maxSize, groups[i].size());
+    }
+    std::vector<topology::VirtualCore*> r;
+    std::vector<bool> taken;
+    for(size_t j = 0; j < maxSize; j++){
+        for(size_t i = 0; i < sorted.size(); i++){
+            if(j >= sorted[i].size()){
+                continue;
+            }
+            topology::VirtualCoreId id = sorted[i][j]->getVirtualCoreId();
+            if(taken.size() <= id){
+                taken.resize(id + 1, false);
+            }
+            if(!taken[id]){
+                taken[id] = true;
+                r.push_back(sorted[i][j]);
+            }
+        }
+    }
+    return r;
+}
+
+std::vector<topology::VirtualCore*> PlacementPlanner::getOrder(PlacementPolicy policy) const{
+    std::vector<std::vector<topology::VirtualCore*> > groups;
+    switch(policy){
+        case PLACEMENT_COMPACT:{
+            return _topology->getVirtualCores();
+        }
+        case PLACEMENT_AVOID_SMT:{
+            return siblingsLast(_topology->getVirtualCores());
+        }
+        case PLACEMENT_PER_CACHE:{
+            // The highest level of cache is the last level one.
+            std::vector<topology::CacheDomain*> domains = _topology->getCacheDomains();
+            uint lastLevel = 0;
+            for(size_t i = 0; i < domains.size(); i++){
+                lastLevel = std::max(lastLevel, domains[i]->getLevel());
+            }
+            domains = _topology->getCacheDomainsAtLevel(lastLevel);
+            for(size_t i = 0; i < domains.size(); i++){
+                if(domains[i]->getType() != topology::CACHE_TYPE_INSTRUCTION){
+                    groups.push_back(domains[i]->getVirtualCores());
+                }
+            }
+            if(groups.empty()){
+                // Caches information not available, fall back to CPUs.
+                return getOrder(PLACEMENT_SCATTER);
+            }
+        }break;
+        case PLACEMENT_SCATTER:{
+            std::vector<topology::Cpu*> cpus = _topology->getCpus();
+            for(size_t i = 0; i < cpus.size(); i++){
+                groups.push_back(cpus[i]->getVirtualCores());
+            }
+        }break;
+        case PLACEMENT_PER_NUMA:{
+            std::vector<topology::NumaNode*> nodes = _topology->getNumaNodes();
+            for(size_t i = 0; i < nodes.size(); i++){
+                groups.push_back(nodes[i]->getVirtualCores());
+            }
+            if(groups.empty()){
+                groups.push_back(_topology->getVirtualCores());
+            }
+        }break;
+        default:{
+            throw std::runtime_error("PlacementPlanner: unknown policy.");
+        }
+    }
+    return interleave(groups);
+}
+
+std::vector<topology::VirtualCore*> PlacementPlanner::plan(size_t numThreads, PlacementPolicy policy) const{
+    std::vector<topology::VirtualCore*> order = getOrder(policy);
+    std::vector<topology::VirtualCore*> r;
+    if(order.empty()){
+        return r;
+    }
+    r.reserve(numThreads);
+    for(size_t i = 0; i < numThreads; i++){
+        r.push_back(order[i % order.size()]);
+    }
+    return r;
+}
+
+bool PlacementPlanner::apply(const ProcessHandler* process, PlacementPolicy policy) const{
+    std::vector<TaskId> threads = process->getActiveThreadsIdentifiers();
+    std::sort(threads.begin(), threads.end());
+    std::vector<topology::VirtualCore*> placement = plan(threads.size(), policy);
+    if(placement.empty()){
+        return process->isActive();
+    }
+    std::vector<std::vector<topology::VirtualCoreId> > virtualCoresIds(placement.size());
+    for(size_t i = 0; i < placement.size(); i++){
+        virtualCoresIds[i].push_back(placement[i]->getVirtualCoreId());
+    }
+    return process->moveThreads(threads, virtualCoresIds);
+}
+
 }
 }
@@ -2,9 +2,12 @@
 #include <mammut/topology/topology-linux.hpp>
 #include <mammut/utils.hpp>
 
+#include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <stdexcept>
+#include <unistd.h>
 //#include <arch/x86/include/asm/processor.h>
 
 using namespace mammut::utils;
@@ -13,8 +16,405 @@ namespace mammut{
 extern SimulationParameters simulationParameters;
 namespace topology{
 
-TopologyLinux::TopologyLinux():Topology(){
-    ;
+static VirtualCoreId getMaxVirtualCoreId(const std::vector<VirtualCore*>& virtualCores){
+    VirtualCoreId max = 0;
+    for(size_t i = 0; i < virtualCores.size(); i++){
+        if(virtualCores[i]->getVirtualCoreId() > max){
+            max = virtualCores[i]->getVirtualCoreId();
+        }
+    }
+    return max;
+}
+
+ProcStatSnapshot::ProcStatSnapshot(VirtualCoreId maxVirtualCoreId):
+        _file(simulationParameters.sysfsRootPrefix + "/proc/stat"),
+        // Aggregated line plus one line per virtual core, each one
+        // at most ~220 characters long. Grown if needed.
+        _buffer((maxVirtualCoreId + 2) * 256),
+        _present(maxVirtualCoreId + 1, false),
+        _clockTicksPerSecond(getClockTicksPerSecond()){
+    for(size_t i = 0; i < PROC_STAT_GUEST_NICE; i++){
+        _ticks[i].resize(maxVirtualCoreId + 1, 0);
+    }
+}
+
+void ProcStatSnapshot::update(){
+    size_t length;
+    const char* last;
+    const char* line;
+    // Only the 'cpu' lines are needed. If the buffer is filled by them,
+    // it is enlarged and the file read again.
+    while(true){
+        length = _file.read(&(_buffer[0]), _buffer.size());
+        last = &(_buffer[0]) + length;
+        line = &(_buffer[0]);
+        while(line < last && !strncmp(line, "cpu", 3)){
+            const char* next = (const char*) memchr(line, '\n', last - line);
+            line = next ? next + 1 : last;
+        }
+        if(line < last || length + 1 < _buffer.size()){
+            break;
+        }
+        _buffer.resize(_buffer.size() * 2);
+    }
+
+    std::fill(_present.begin(), _present.end(), false);
+    line = &(_buffer[0]);
+    while(line < last && !strncmp(line, "cpu", 3)){
+        uint64_t id;
+        // The aggregated line ("cpu  ...") has no id and must be skipped,
+        // otherwise its first field would overwrite the slot of a core.
+        const char* next = (line + 3 < last && line[3] != ' ') ? parseU64(line + 3, last, id) : NULL;
+        if(next && *next == ' ' && id < _present.size()){
+            int64_t fields[PROC_STAT_GUEST_NICE + 1];
+            size_t numFields = parseFields(line, last, fields, PROC_STAT_GUEST_NICE + 1);
+            for(size_t i = PROC_STAT_USER; i <= PROC_STAT_GUEST_NICE; i++){
+                _ticks[i - PROC_STAT_USER][id] = (i < numFields) ? fields[i] : 0;
+            }
+            _present[id] = true;
+        }
+        line = (const char*) memchr(line, '\n', last - line);
+        if(!line){
+            break;
+        }
+        ++line;
+    }
+}
+
+bool ProcStatSnapshot::isPresent(VirtualCoreId virtualCoreId) const{
+    return virtualCoreId < _present.size() && _present[virtualCoreId];
+}
+
+uint64_t ProcStatSnapshot::getTicks(VirtualCoreId virtualCoreId, ProcStatTimeType type) const{
+    return _ticks[type - PROC_STAT_USER][virtualCoreId];
+}
+
+double ProcStatSnapshot::getTime(VirtualCoreId virtualCoreId, ProcStatTimeType type) const{
+    if(!isPresent(virtualCoreId)){
+        return -1;
+    }
+    return (getTicks(virtualCoreId, type) / _clockTicksPerSecond) * MAMMUT_MICROSECS_IN_SEC;
+}
+
+CpuInfoLinux::CpuInfoLinux(VirtualCoreId maxVirtualCoreId):
+        _infos(maxVirtualCoreId + 1), _present(maxVirtualCoreId + 1, false){
+    if(!parseProcCpuInfo() && simulationParameters.sysfsRootPrefix.empty()){
+        parseCpuId();
+    }
+}
+
+void CpuInfoLinux::addFlag(VirtualCoreInfo& info, const std::string& flagName){
+    std::unordered_map<std::string, size_t>::const_iterator it = _flagsIndexes.find(flagName);
+    size_t index;
+    if(it == _flagsIndexes.end()){
+        index = _flagsIndexes.size();
+        _flagsIndexes[flagName] = index;
+    }else{
+        index = it->second;
+    }
+    if(info.flags.size() <= index / 64){
+        info.flags.resize(index / 64 + 1, 0);
+    }
+    info.flags[index / 64] |= ((uint64_t) 1 << (index % 64));
+}
+
+bool CpuInfoLinux::parseProcCpuInfo(){
+    std::string fileName = simulationParameters.sysfsRootPrefix + "/proc/cpuinfo";
+    if(!existsFile(fileName)){
+        return false;
+    }
+    std::vector<std::string> lines = readFile(fileName);
+    VirtualCoreInfo* info = NULL;
+    for(size_t i = 0; i < lines.size(); i++){
+        const std::string& line = lines[i];
+        size_t separator = line.find(':');
+        if(separator == std::string::npos){
+            continue;
+        }
+        std::string key = line.substr(0, separator);
+        std::string value = line.substr(separator + 1);
+        trim(key);
+        trim(value);
+        if(key == "processor"){
+            VirtualCoreId id = stringToInt(value);
+            if(id < _infos.size()){
+                info = &(_infos[id]);
+                _present[id] = true;
+            }else{
+                info = NULL;
+            }
+        }else if(!info){
+            continue;
+        }else if(key == "vendor_id"){
+            info->vendorId = value;
+        }else if(key == "cpu family"){
+            info->family = value;
+        }else if(key == "model"){
+            info->model = value;
+        }else if(key == "model name"){
+            info->modelName = value;
+        }else if(key == "flags"){
+            std::vector<std::string> flags = split(value, ' ');
+            for(size_t j = 0; j < flags.size(); j++){
+                if(!flags[j].empty()){
+                    addFlag(*info, flags[j]);
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void CpuInfoLinux::parseCpuId(){
+#if defined(__x86_64__)
+    // Same information for all the virtual cores, taken from the one
+    // we are running on.
+    VirtualCoreInfo info;
+    CpuIdAsm leaf0(0);
+    char vendor[13];
+    memcpy(vendor, &(leaf0.EBX()), 4);
+    memcpy(vendor + 4, &(leaf0.EDX()), 4);
+    memcpy(vendor + 8, &(leaf0.ECX()), 4);
+    vendor[12] = '\0';
+    info.vendorId = vendor;
+
+    CpuIdAsm leaf1(1);
+    uint32_t family = (leaf1.EAX() >> 8) & 0xF;
+    uint32_t model = (leaf1.EAX() >> 4) & 0xF;
+    if(family == 0xF){
+        family += (leaf1.EAX() >> 20) & 0xFF;
+    }
+    if(family == 0x6 || family >= 0xF){
+        model += ((leaf1.EAX() >> 16) & 0xF) << 4;
+    }
+    info.family = intToString(family);
+    info.model = intToString(model);
+
+    // Only the flags used by the library are reported.
+    if(leaf1.EDX() & (1 << 4)){
+        addFlag(info, "tsc");
+    }
+    if(leaf1.EDX() & (1 << 5)){
+        addFlag(info, "msr");
+    }
+    if(leaf1.EDX() & (1 << 22)){
+        addFlag(info, "acpi");
+    }
+    if(leaf1.ECX() & (1 << 7)){
+        addFlag(info, "est");
+    }
+    if(leaf0.EAX() >= 6){
+        CpuIdAsm leaf6(6);
+        if(leaf6.ECX() & 1){
+            addFlag(info, "aperfmperf");
+        }
+    }
+    CpuIdAsm extended(0x80000000);
+    if(extended.EAX() >= 0x80000004){
+        char name[49];
+        for(uint32_t i = 0; i < 3; i++){
+            CpuIdAsm leaf(0x80000002 + i);
+            memcpy(name + i * 16, &(leaf.EAX()), 4);
+            memcpy(name + i * 16 + 4, &(leaf.EBX()), 4);
+            memcpy(name + i * 16 + 8, &(leaf.ECX()), 4);
+            memcpy(name + i * 16 + 12, &(leaf.EDX()), 4);
+        }
+        name[48] = '\0';
+        info.modelName = name;
+        trim(info.modelName);
+    }
+    if(extended.EAX() >= 0x80000007){
+        CpuIdAsm leaf(0x80000007);
+        if(leaf.EDX() & (1 << 8)){
+            addFlag(info, "constant_tsc");
+            addFlag(info, "nonstop_tsc");
+        }
+    }
+    std::fill(_infos.begin(), _infos.end(), info);
+    std::fill(_present.begin(), _present.end(), true);
+#endif
+}
+
+const VirtualCoreInfo& CpuInfoLinux::getInfo(VirtualCoreId virtualCoreId) const{
+    if(virtualCoreId < _present.size() && _present[virtualCoreId]){
+        return _infos[virtualCoreId];
+    }
+    for(size_t i = 0; i < _present.size(); i++){
+        if(_present[i]){
+            return _infos[i];
+        }
+    }
+    return _infos.at(0);
+}
+
+bool CpuInfoLinux::hasFlag(VirtualCoreId virtualCoreId, const std::string& flagName) const{
+    std::unordered_map<std::string, size_t>::const_iterator it = _flagsIndexes.find(flagName);
+    if(it == _flagsIndexes.end()){
+        return false;
+    }
+    const std::vector<uint64_t>& flags = getInfo(virtualCoreId).flags;
+    size_t index = it->second;
+    return index / 64 < flags.size() &&
+           (flags[index / 64] & ((uint64_t) 1 << (index % 64)));
+}
+
+TopologyLinux::TopologyLinux():Topology(),
+        _cpuInfo(getMaxVirtualCoreId(_virtualCores)),
+        _procStat(getMaxVirtualCoreId(_virtualCores)){
+    for(size_t i = 0; i < _cpus.size(); i++){
+        static_cast<CpuLinux*>(_cpus[i])->_cpuInfo = &_cpuInfo;
+    }
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        static_cast<VirtualCoreLinux*>(_virtualCores[i])->_cpuInfo = &_cpuInfo;
+    }
+    buildNumaNodes();
+    buildCacheDomains();
+    indexLocalityDomains();
+    resetIdleTimes();
+}
+
+std::vector<VirtualCore*> TopologyLinux::getVirtualCores(const std::string& cpuList) const{
+    std::vector<uint> ids = rangesListToIntegers(cpuList);
+    std::vector<VirtualCore*> virtualCores;
+    virtualCores.reserve(ids.size());
+    for(size_t i = 0; i < ids.size(); i++){
+        // Offline virtual cores are not part of the topology.
+        VirtualCore* vc = getVirtualCore(ids[i]);
+        if(vc){
+            virtualCores.push_back(vc);
+        }
+    }
+    return virtualCores;
+}
+
+void TopologyLinux::buildNumaNodes(){
+    SysfsDirectory nodeDir(simulationParameters.sysfsRootPrefix +
+                           "/sys/devices/system/node");
+    std::vector<std::string> entries = nodeDir.getEntries(false, true);
+    std::vector<NumaNodeId> ids;
+    for(size_t i = 0; i < entries.size(); i++){
+        uint64_t id;
+        const std::string& name = entries[i];
+        const char* last = name.c_str() + name.size();
+        if(!name.compare(0, 4, "node") &&
+           parseU64(name.c_str() + 4, last, id) == last){
+            ids.push_back(id);
+        }
+    }
+    std::sort(ids.begin(), ids.end());
+
+    for(size_t i = 0; i < ids.size(); i++){
+        SysfsDirectory node(nodeDir, "node" + intToString(ids[i]));
+        std::string cpuList, distance;
+        node.readFirstLine("cpulist", cpuList);
+        node.readFirstLine("distance", distance);
+        // The distances are listed in the same order of the nodes.
+        std::vector<uint> distances(ids.back() + 1, 0);
+        std::vector<int64_t> fields(ids.size());
+        size_t numFields = parseFields(distance.c_str(), distance.c_str() + distance.size(),
+                                       &(fields[0]), fields.size());
+        for(size_t j = 0; j < numFields; j++){
+            distances[ids[j]] = fields[j];
+        }
+        std::vector<VirtualCore*> virtualCores = getVirtualCores(cpuList);
+        // Memory-only nodes (e.g. CXL memory) have no virtual cores.
+        if(virtualCores.size()){
+            _numaNodes.push_back(new NumaNode(ids[i], virtualCores, distances));
+        }
+    }
+
+    if(_numaNodes.empty()){
+        _numaNodes.push_back(new NumaNode(0, _virtualCores, std::vector<uint>(1, 10)));
+    }
+}
+
+void TopologyLinux::buildCacheDomains(){
+    SysfsDirectory cpuDir(simulationParameters.sysfsRootPrefix +
+                          "/sys/devices/system/cpu");
+    /**
+     * A cache shared by many virtual cores is listed by each of them. The
+     * virtual cores already included in a domain are skipped, so that
+     * each cache is read only once.
+     **/
+    std::vector<std::vector<bool> > covered;
+    VirtualCoreId maxVirtualCoreId = getMaxVirtualCoreId(_virtualCores);
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        VirtualCoreId virtualCoreId = _virtualCores[i]->getVirtualCoreId();
+        SysfsDirectory cacheDir(cpuDir, "cpu" + intToString(virtualCoreId) + "/cache");
+        std::vector<std::string> entries = cacheDir.getEntries(false, true);
+        for(size_t j = 0; j < entries.size(); j++){
+            uint64_t index;
+            const std::string& name = entries[j];
+            const char* last = name.c_str() + name.size();
+            if(name.compare(0, 5, "index") ||
+               parseU64(name.c_str() + 5, last, index) != last){
+                continue;
+            }
+            if(covered.size() <= index){
+                covered.resize(index + 1);
+            }
+            if(covered[index].empty()){
+                covered[index].resize(maxVirtualCoreId + 1, false);
+            }
+            if(covered[index][virtualCoreId]){
+                continue;
+            }
+
+            SysfsDirectory cache(cacheDir, name);
+            int64_t level = 0, lineSize = 0;
+            std::string type, size, sharedCpuList;
+            if(!cache.readInt("level", level) ||
+               !cache.readFirstLine("type", type) ||
+               !cache.readFirstLine("shared_cpu_list", sharedCpuList)){
+                continue;
+            }
+            cache.readInt("coherency_line_size", lineSize);
+            cache.readFirstLine("size", size);
+
+            CacheType cacheType = CACHE_TYPE_UNIFIED;
+            if(type == "Data"){
+                cacheType = CACHE_TYPE_DATA;
+            }else if(type == "Instruction"){
+                cacheType = CACHE_TYPE_INSTRUCTION;
+            }
+            uint64_t bytes = 0;
+            const char* sizeLast = size.c_str() + size.size();
+            const char* unit = parseU64(size.c_str(), sizeLast, bytes);
+            if(unit && unit < sizeLast){
+                switch(*unit){
+                    case 'K':{bytes <<= 10;}break;
+                    case 'M':{bytes <<= 20;}break;
+                    case 'G':{bytes <<= 30;}break;
+                }
+            }
+
+            std::vector<VirtualCore*> virtualCores = getVirtualCores(sharedCpuList);
+            if(std::find(virtualCores.begin(), virtualCores.end(), _virtualCores[i]) == virtualCores.end()){
+                virtualCores.push_back(_virtualCores[i]);
+            }
+            for(size_t k = 0; k < virtualCores.size(); k++){
+                covered[index][virtualCores[k]->getVirtualCoreId()] = true;
+            }
+            _cacheDomains.push_back(new CacheDomain(level, cacheType, bytes, lineSize, virtualCores));
+        }
+    }
+}
+
+void TopologyLinux::getIdleTimes(std::vector<double>& idleTimes) const{
+    ScopedLock scopedLock(_procStatLock);
+    _procStat.update();
+    idleTimes.resize(_virtualCores.size());
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        idleTimes[i] = static_cast<VirtualCoreLinux*>(_virtualCores[i])->getIdleTime(_procStat);
+    }
+}
+
+void TopologyLinux::resetIdleTimes(){
+    ScopedLock scopedLock(_procStatLock);
+    _procStat.update();
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        static_cast<VirtualCoreLinux*>(_virtualCores[i])->resetIdleTime(_procStat);
+    }
 }
 
 void TopologyLinux::maximizeUtilization() const{
@@ -35,37 +435,28 @@ std::string getTopologyPathFromVirtualCoreId(VirtualCoreId id){
 }
 
 CpuLinux::CpuLinux(CpuId cpuId, std::vector<PhysicalCore*> physicalCores):
-    Cpu(cpuId, physicalCores){
+    Cpu(cpuId, physicalCores), _cpuInfo(NULL), _idleResidency(NULL){
     ;
 }
 
-std::string CpuLinux::getCpuInfo(const std::string& infoName) const{
-    std::ifstream infile(simulationParameters.sysfsRootPrefix +
-                         "/proc/cpuinfo");
-    if(!infile){
-        throw std::runtime_error("Impossible to open /proc/cpuinfo.");
-    }
+CpuLinux::~CpuLinux(){
+    delete _idleResidency;
+}
 
-    //TODO: Non una linea qualsiasi ma quella di questa cpu
-    std::string line;
-    while(std::getline(infile, line)){
-        if(!line.compare(0, infoName.length(), infoName)){
-            return ltrim(split(line, ':').at(1));
-        }
-    }
-    return "";
+const VirtualCoreInfo& CpuLinux::getCpuInfo() const{
+    return _cpuInfo->getInfo(getVirtualCore()->getVirtualCoreId());
 }
 
 std::string CpuLinux::getVendorId() const{
-    return getCpuInfo("vendor_id");
+    return getCpuInfo().vendorId;
 }
 
 std::string CpuLinux::getFamily() const{
-    return getCpuInfo("cpu family");
+    return getCpuInfo().family;
 }
 
 std::string CpuLinux::getModel() const{
-    return getCpuInfo("model");
+    return getCpuInfo().model;
 }
 
 void CpuLinux::maximizeUtilization() const{
@@ -80,6 +471,25 @@ void CpuLinux::resetUtilization() const{
     }
 }
 
+IdleResidencyLinux* CpuLinux::getIdleResidency() const{
+    if(!_idleResidency){
+        _idleResidency = new IdleResidencyLinux(getVirtualCore()->getVirtualCoreId(), true);
+    }
+    return _idleResidency;
+}
+
+std::vector<IdleResidencyCounter*> CpuLinux::getIdleResidencyCounters() const{
+    return getIdleResidency()->getCounters();
+}
+
+void CpuLinux::getIdleResidencies(std::vector<double>& residencies) const{
+    getIdleResidency()->getResidencies(residencies);
+}
+
+void CpuLinux::resetIdleResidencies(){
+    getIdleResidency()->reset();
+}
+
 PhysicalCoreLinux::PhysicalCoreLinux(CpuId cpuId, PhysicalCoreId physicalCoreId,
                                      std::vector<VirtualCore*> virtualCores):
     PhysicalCore(cpuId, physicalCoreId, virtualCores){
@@ -103,9 +513,22 @@ VirtualCoreIdleLevelLinux::VirtualCoreIdleLevelLinux(const VirtualCoreLinux& vir
     _virtualCore(virtualCore),
     _path(simulationParameters.sysfsRootPrefix +
           "/sys/devices/system/cpu/cpu" + intToString(virtualCore.getVirtualCoreId()) +
-          "/cpuidle/state" + intToString(levelId) + "/"){
-    resetTime();
-    resetCount();
+          "/cpuidle/state" + intToString(levelId) + "/"),
+    _timeFile(_path + "time"),
+    _usageFile(_path + "usage"),
+    _lastAbsTime(0),
+    _lastAbsCount(0),
+    _baseline(false){
+    // The files are opened (and the baseline taken) at the first access,
+    // to not keep open two files per level per virtual core.
+}
+
+void VirtualCoreIdleLevelLinux::takeBaseline() const{
+    if(!_baseline){
+        _baseline = true;
+        _lastAbsTime = getAbsoluteTime();
+        _lastAbsCount = getAbsoluteCount();
+    }
 }
 
 std::string VirtualCoreIdleLevelLinux::getName() const{
@@ -144,27 +567,39 @@ uint VirtualCoreIdleLevelLinux::getConsumedPower() const{
     return stringToInt(readFirstLineFromFile(_path + "power"));
 }
 
-uint VirtualCoreIdleLevelLinux::getAbsoluteTime() const{
-    return stringToInt(readFirstLineFromFile(_path + "time"));
+uint64_t VirtualCoreIdleLevelLinux::getAbsoluteTime() const{
+    char buffer[32];
+    size_t length = _timeFile.read(buffer, sizeof(buffer));
+    uint64_t value = 0;
+    parseU64(buffer, buffer + length, value);
+    return value;
 }
 
-uint VirtualCoreIdleLevelLinux::getTime() const{
+uint64_t VirtualCoreIdleLevelLinux::getTime() const{
+    takeBaseline();
     return getAbsoluteTime() - _lastAbsTime;
 }
 
 void VirtualCoreIdleLevelLinux::resetTime(){
+    takeBaseline();
     _lastAbsTime = getAbsoluteTime();
 }
 
-uint VirtualCoreIdleLevelLinux::getAbsoluteCount() const{
-    return stringToInt(readFirstLineFromFile(_path + "usage"));
+uint64_t VirtualCoreIdleLevelLinux::getAbsoluteCount() const{
+    char buffer[32];
+    size_t length = _usageFile.read(buffer, sizeof(buffer));
+    uint64_t value = 0;
+    parseU64(buffer, buffer + length, value);
+    return value;
 }
 
-uint VirtualCoreIdleLevelLinux::getCount() const{
+uint64_t VirtualCoreIdleLevelLinux::getCount() const{
+    takeBaseline();
     return getAbsoluteCount() - _lastAbsCount;
 }
 
 void VirtualCoreIdleLevelLinux::resetCount(){
+    takeBaseline();
     _lastAbsCount = getAbsoluteCount();
 }
 
@@ -196,27 +631,32 @@ void SpinnerThread::run(){
 
 VirtualCoreLinux::VirtualCoreLinux(CpuId cpuId, PhysicalCoreId physicalCoreId, VirtualCoreId virtualCoreId):
             VirtualCore(cpuId, physicalCoreId, virtualCoreId),
+            _cpuInfo(NULL),
             _hotplugFile(simulationParameters.sysfsRootPrefix +
                          "/sys/devices/system/cpu/cpu" + intToString(virtualCoreId) +
                          "/online"),
+            _lastProcIdleTime(0),
+            _procStatFile(simulationParameters.sysfsRootPrefix + "/proc/stat"),
             _utilizationThread(new SpinnerThread()),
-            _clkModMsr(virtualCoreId, O_RDWR){
-    std::vector<std::string> levelsNames;
-    if(existsDirectory(simulationParameters.sysfsRootPrefix +
-                       "/sys/devices/system/cpu/cpu0/cpuidle")){
-        levelsNames = getFilesNamesInDir(simulationParameters.sysfsRootPrefix +
-                                         "/sys/devices/system/cpu/cpu" +
-                                         intToString(getVirtualCoreId()) +
-                                         "/cpuidle", false, true);
-    }
+            _clkModMsr(virtualCoreId, O_RDWR),
+            _idleResidency(NULL){
+    SysfsDirectory cpuIdleDir(simulationParameters.sysfsRootPrefix +
+                              "/sys/devices/system/cpu/cpu" +
+                              intToString(getVirtualCoreId()) + "/cpuidle");
+    std::vector<std::string> levelsNames = cpuIdleDir.getEntries(false, true);
+    std::vector<uint> levelsIds;
     for(size_t i = 0; i < levelsNames.size(); i++){
         std::string levelName = levelsNames.at(i);
         if(levelName.compare(0, 5, "state") == 0){
-            uint levelId = stringToInt(levelName.substr(5));
-            _idleLevels.push_back(new VirtualCoreIdleLevelLinux(*this, levelId));
+            levelsIds.push_back(stringToInt(levelName.substr(5)));
         }
     }
-    resetIdleTime();
+    std::sort(levelsIds.begin(), levelsIds.end());
+    for(size_t i = 0; i < levelsIds.size(); i++){
+        _idleLevels.push_back(new VirtualCoreIdleLevelLinux(*this, levelsIds[i]));
+    }
+    // The idle time is reset by TopologyLinux with a single snapshot
+    // of /proc/stat for all the virtual cores.
 
     uint possibleValues;
     CpuIdAsm cia(6);
@@ -242,38 +682,13 @@ VirtualCoreLinux::VirtualCoreLinux(CpuId cpuId, PhysicalCoreId physicalCoreId, V
 
 VirtualCoreLinux::~VirtualCoreLinux(){
     deleteVectorElements<VirtualCoreIdleLevel*>(_idleLevels);
+    delete _idleResidency;
     resetUtilization();
     delete _utilizationThread;
 }
 
 bool VirtualCoreLinux::hasFlag(const std::string& flagName) const{
-    if(!existsFile(simulationParameters.sysfsRootPrefix + "/proc/cpuinfo")){
-        return false;
-    }
-    std::vector<std::string> file = readFile(simulationParameters.sysfsRootPrefix +
-                                             "/proc/cpuinfo");
-    bool procFound = false;
-    for(size_t i = 0; i < file.size(); i++){
-        /** Find the section of this virtual core. **/
-        if(!procFound && file.at(i).find("processor") == 0 &&
-           file.at(i).find(" " + intToString(_virtualCoreId))){
-            procFound = true;
-            continue;
-        }
-
-        if(procFound){
-            if(file.at(i).find("flags") == 0 &&
-               (file.at(i).find(" " + flagName + " ") != std::string::npos ||
-                file.at(i).find(" " + flagName + "\n") != std::string::npos )){
-                return true;
-            }
-            /** We finished the section of this virtual core. **/
-            if(file.at(i).find("processor") == 0){
-                return false;
-            }
-        }
-    }
-    return false;
+    return _cpuInfo->hasFlag(_virtualCoreId, flagName);
 }
 
 uint64_t VirtualCoreLinux::getAbsoluteTicks() const{
@@ -314,24 +729,36 @@ void VirtualCoreLinux::resetUtilization() const{
 }
 
 double VirtualCoreLinux::getProcStatTime(ProcStatTimeType type) const{
-    std::vector<std::string> lines = readFile(simulationParameters.sysfsRootPrefix +
-                                              "/proc/stat");
-    std::string line;
-    double field = 0;
-    bool found = false;
-    for(size_t i = 0; i < lines.size(); i++){
-        line = lines.at(i);
-        if(line.find("cpu" + intToString(getVirtualCoreId())) != std::string::npos){
-            found = true;
-            field = stringToInt(split(line, ' ')[type]);
-        }
+    // Only the lines up to the one of this virtual core are needed:
+    // the aggregated line plus one line per virtual core up to this one,
+    // each one at most ~220 characters long. Allocated at the first use,
+    // since it is proportional to the identifier of the virtual core.
+    if(_procStatBuffer.empty()){
+        _procStatBuffer.resize((getVirtualCoreId() + 2) * 256);
     }
-
-    if(!found){
-        return -1;
-    }else{
-        return (field / getClockTicksPerSecond()) * MAMMUT_MICROSECS_IN_SEC;
+    char* buffer = &(_procStatBuffer[0]);
+    size_t length = _procStatFile.read(buffer, _procStatBuffer.size());
+    const char* last = buffer + length;
+    const char* line = buffer;
+    while(line < last && !strncmp(line, "cpu", 3)){
+        uint64_t id;
+        // The aggregated line ("cpu  ...") has no id and must be skipped,
+        // since parseU64 would read its first field as the id.
+        const char* next = (line + 3 < last && line[3] != ' ') ? parseU64(line + 3, last, id) : NULL;
+        if(next && *next == ' ' && id == getVirtualCoreId()){
+            int64_t fields[PROC_STAT_GUEST_NICE + 1];
+            if(parseFields(line, last, fields, PROC_STAT_GUEST_NICE + 1) <= (size_t) type){
+                return -1;
+            }
+            return ((double) fields[type] / getClockTicksPerSecond()) * MAMMUT_MICROSECS_IN_SEC;
+        }
+        line = (const char*) memchr(line, '\n', last - line);
+        if(!line){
+            break;
+        }
+        ++line;
     }
+    return -1;
 }
 
 double VirtualCoreLinux::getAbsoluteIdleTime() const{
@@ -356,6 +783,17 @@ void VirtualCoreLinux::resetIdleTime(){
     _lastProcIdleTime = getAbsoluteIdleTime();
 }
 
+double VirtualCoreLinux::getIdleTime(const ProcStatSnapshot& snapshot) const{
+    if(!snapshot.isPresent(_virtualCoreId)){
+        return -1;
+    }
+    return snapshot.getTime(_virtualCoreId, PROC_STAT_IDLE) - _lastProcIdleTime;
+}
+
+void VirtualCoreLinux::resetIdleTime(const ProcStatSnapshot& snapshot){
+    _lastProcIdleTime = snapshot.getTime(_virtualCoreId, PROC_STAT_IDLE);
+}
+
 bool VirtualCoreLinux::isHotPluggable() const{
     return existsFile(_hotplugFile);
 }
@@ -417,5 +855,206 @@ std::vector<VirtualCoreIdleLevel*> VirtualCoreLinux::getIdleLevels() const{
     return _idleLevels;
 }
 
+IdleResidencyLinux* VirtualCoreLinux::getIdleResidency() const{
+    if(!_idleResidency){
+        _idleResidency = new IdleResidencyLinux(_virtualCoreId, false);
+    }
+    return _idleResidency;
+}
+
+std::vector<IdleResidencyCounter*> VirtualCoreLinux::getIdleResidencyCounters() const{
+    return getIdleResidency()->getCounters();
+}
+
+void VirtualCoreLinux::getIdleResidencies(std::vector<double>& residencies) const{
+    getIdleResidency()->getResidencies(residencies);
+}
+
+void VirtualCoreLinux::resetIdleResidencies(){
+    getIdleResidency()->reset();
+}
+
+static double computeResidency(uint64_t ticks, uint64_t tscTicks){
+    if(!tscTicks){
+        return 0;
+    }
+    double r = (double) ticks / (double) tscTicks;
+    // Counters and TSC are not read atomically.
+    return r > 1.0 ? 1.0 : r;
+}
+
+IdleResidencyCounterLinux::IdleResidencyCounterLinux(const utils::Msr& msr, uint32_t reg,
+                                                     uint levelId, bool package):
+        IdleResidencyCounter(levelId, package), _msr(msr), _register(reg),
+        _lastTicks(0), _lastTsc(0){
+    resetTicks();
+}
+
+uint64_t IdleResidencyCounterLinux::getAbsoluteTicks() const{
+    uint64_t ticks = 0;
+    _msr.read(_register, ticks);
+    return ticks;
+}
+
+uint64_t IdleResidencyCounterLinux::getTicks() const{
+    return getAbsoluteTicks() - _lastTicks;
+}
+
+double IdleResidencyCounterLinux::getResidency() const{
+    // Registers which can't be read are considered 0.
+    uint64_t tsc = 0, ticks = 0;
+    if(!_msr.read(MSR_TSC, tsc)){
+        tsc = 0;
+    }
+    if(!_msr.read(_register, ticks)){
+        ticks = 0;
+    }
+    return computeResidency(ticks - _lastTicks, tsc - _lastTsc);
+}
+
+void IdleResidencyCounterLinux::resetTicks(){
+    _msr.read(MSR_TSC, _lastTsc);
+    _msr.read(_register, _lastTicks);
+}
+
+typedef struct{
+    uint levelId;
+    uint32_t reg;
+}IdleResidencyRegister;
+
+static const IdleResidencyRegister coreResidencyRegisters[] = {
+    {3, MSR_CORE_C3_RESIDENCY},
+    {6, MSR_CORE_C6_RESIDENCY},
+    {7, MSR_CORE_C7_RESIDENCY},
+};
+
+static const IdleResidencyRegister packageResidencyRegisters[] = {
+    {2, MSR_PKG_C2_RESIDENCY},
+    {3, MSR_PKG_C3_RESIDENCY},
+    {6, MSR_PKG_C6_RESIDENCY},
+    {7, MSR_PKG_C7_RESIDENCY},
+    {8, MSR_PKG_C8_RESIDENCY},
+    {9, MSR_PKG_C9_RESIDENCY},
+    {10, MSR_PKG_C10_RESIDENCY},
+};
+
+IdleResidencyLinux::IdleResidencyLinux(VirtualCoreId virtualCoreId, bool package):
+        _msr(virtualCoreId){
+    const IdleResidencyRegister* candidates = package ? packageResidencyRegisters :
+                                                        coreResidencyRegisters;
+    size_t numCandidates = package ?
+                sizeof(packageResidencyRegisters) / sizeof(IdleResidencyRegister) :
+                sizeof(coreResidencyRegisters) / sizeof(IdleResidencyRegister);
+    uint64_t value;
+    _registers.push_back(MSR_TSC);
+    if(!_msr.available() || !_msr.read(MSR_TSC, value)){
+        return;
+    }
+    for(size_t i = 0; i < numCandidates; i++){
+        // Counters not supported by the CPU model fail to be read.
+        if(_msr.read(candidates[i].reg, value)){
+            _registers.push_back(candidates[i].reg);
+            _counters.push_back(new IdleResidencyCounterLinux(_msr, candidates[i].reg,
+                                                              candidates[i].levelId, package));
+        }
+    }
+}
+
+IdleResidencyLinux::~IdleResidencyLinux(){
+    deleteVectorElements<IdleResidencyCounter*>(_counters);
+}
+
+std::vector<IdleResidencyCounter*> IdleResidencyLinux::getCounters() const{
+    return _counters;
+}
+
+void IdleResidencyLinux::getResidencies(std::vector<double>& residencies) const{
+    residencies.resize(_counters.size());
+    if(_counters.empty()){
+        return;
+    }
+    _msr.read(_registers, _values);
+    for(size_t i = 0; i < _counters.size(); i++){
+        IdleResidencyCounterLinux* c = static_cast<IdleResidencyCounterLinux*>(_counters[i]);
+        residencies[i] = computeResidency(_values[i + 1] - c->_lastTicks, _values[0] - c->_lastTsc);
+    }
+}
+
+void IdleResidencyLinux::reset(){
+    if(_counters.empty()){
+        return;
+    }
+    _msr.read(_registers, _values);
+    for(size_t i = 0; i < _counters.size(); i++){
+        IdleResidencyCounterLinux* c = static_cast<IdleResidencyCounterLinux*>(_counters[i]);
+        c->_lastTsc = _values[0];
+        c->_lastTicks = _values[i + 1];
+    }
+}
+
+IdleLatencyGuard::IdleLatencyGuard(uint latency):_fd(-1), _active(false){
+    _fd = open((simulationParameters.sysfsRootPrefix + "/dev/cpu_dma_latency").c_str(), O_WRONLY);
+    _active = setLatency(latency);
+}
+
+IdleLatencyGuard::IdleLatencyGuard(const std::vector<VirtualCore*>& virtualCores, uint latency):
+        _fd(-1), _active(false){
+    for(size_t i = 0; i < virtualCores.size(); i++){
+        SysfsFile* file = new SysfsFile(simulationParameters.sysfsRootPrefix +
+                                        "/sys/devices/system/cpu/cpu" +
+                                        intToString(virtualCores[i]->getVirtualCoreId()) +
+                                        "/power/pm_qos_resume_latency_us", O_RDWR);
+        if(!file->available()){
+            delete file;
+            continue;
+        }
+        _oldValues.push_back(file->readFirstLine());
+        _files.push_back(file);
+    }
+    _active = _files.size() == virtualCores.size() && setLatency(latency);
+}
+
+IdleLatencyGuard::~IdleLatencyGuard(){
+    // Closing the file removes the constraint.
+    if(_fd != -1){
+        close(_fd);
+    }
+    for(size_t i = 0; i < _files.size(); i++){
+        _files[i]->write(_oldValues[i].c_str(), _oldValues[i].size());
+    }
+    deleteVectorElements<SysfsFile*>(_files);
+}
+
+bool IdleLatencyGuard::isActive() const{
+    return _active;
+}
+
+bool IdleLatencyGuard::setLatency(uint latency){
+    if(_fd != -1){
+        // The device expects a binary 32 bits integer.
+        int32_t value = latency;
+        lseek(_fd, 0, SEEK_SET);
+        return write(_fd, &value, sizeof(value)) == sizeof(value);
+    }
+    if(_files.empty()){
+        return false;
+    }
+    char buffer[32];
+    size_t length;
+    if(latency){
+        length = formatU64(latency, buffer, sizeof(buffer));
+    }else{
+        // For pm_qos_resume_latency_us "0" means no constraint, while
+        // "n/a" is the zero latency one.
+        length = 3;
+        memcpy(buffer, "n/a", length);
+    }
+    bool r = true;
+    for(size_t i = 0; i < _files.size(); i++){
+        r = _files[i]->write(buffer, length) && r;
+    }
+    return r;
+}
+
 }
 }
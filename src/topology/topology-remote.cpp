@@ -68,6 +68,11 @@ void CpuRemote::resetUtilization() const{
     setUtilization(_communicator, SetUtilization_Type_RESET, SetUtilization_UnitType_CPU, getCpuId());
 }
 
+std::vector<IdleResidencyCounter*> CpuRemote::getIdleResidencyCounters() const{
+    // Not yet supported on remote machines.
+    return std::vector<IdleResidencyCounter*>();
+}
+
 PhysicalCoreRemote::PhysicalCoreRemote(Communicator* const communicator, CpuId cpuId, PhysicalCoreId physicalCoreId,
                                        std::vector<VirtualCore*> virtualCores)
     :PhysicalCore(cpuId, physicalCoreId, virtualCores), _communicator(communicator){
@@ -158,7 +163,7 @@ uint VirtualCoreIdleLevelRemote::getConsumedPower() const{
     return r.consumed_power();
 }
 
-uint VirtualCoreIdleLevelRemote::getAbsoluteTime() const{
+uint64_t VirtualCoreIdleLevelRemote::getAbsoluteTime() const{
     IdleLevelGetAbsTime ilgat;
     IdleLevelGetTimeRes r;
     ilgat.set_virtual_core_id(getVirtualCoreId());
@@ -167,7 +172,7 @@ uint VirtualCoreIdleLevelRemote::getAbsoluteTime() const{
     return r.time();
 }
 
-uint VirtualCoreIdleLevelRemote::getTime() const{
+uint64_t VirtualCoreIdleLevelRemote::getTime() const{
     IdleLevelGetTime ilgt;
     IdleLevelGetTimeRes r;
     ilgt.set_virtual_core_id(getVirtualCoreId());
@@ -184,7 +189,7 @@ void VirtualCoreIdleLevelRemote::resetTime() {
     _communicator->remoteCall(ilrt, r);
 }
 
-uint VirtualCoreIdleLevelRemote::getAbsoluteCount() const{
+uint64_t VirtualCoreIdleLevelRemote::getAbsoluteCount() const{
     IdleLevelGetAbsCount ilgac;
     IdleLevelGetCountRes r;
     ilgac.set_virtual_core_id(getVirtualCoreId());
@@ -193,7 +198,7 @@ uint VirtualCoreIdleLevelRemote::getAbsoluteCount() const{
     return r.count();
 }
 
-uint VirtualCoreIdleLevelRemote::getCount() const{
+uint64_t VirtualCoreIdleLevelRemote::getCount() const{
     IdleLevelGetCount ilgc;
     IdleLevelGetCountRes r;
     ilgc.set_virtual_core_id(getVirtualCoreId());
@@ -297,6 +302,11 @@ std::vector<VirtualCoreIdleLevel*> VirtualCoreRemote::getIdleLevels() const{
     return _idleLevels;
 }
 
+std::vector<IdleResidencyCounter*> VirtualCoreRemote::getIdleResidencyCounters() const{
+    // Not yet supported on remote machines.
+    return std::vector<IdleResidencyCounter*>();
+}
+
 bool VirtualCoreRemote::hasClockModulation() const{
     throw std::runtime_error("Unsupported remote function.");
 }
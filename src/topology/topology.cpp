@@ -6,6 +6,7 @@
 #endif
 #include <mammut/utils.hpp>
 
+#include "algorithm"
 #include "map"
 #include "stddef.h"
 #include "stdexcept"
@@ -16,37 +17,53 @@ extern SimulationParameters simulationParameters;
 
 namespace topology{
 
-Topology::Topology():_communicator(NULL){
+Topology::Topology():_numIdleLevels(0), _communicator(NULL){
 #if defined(__linux__)
     std::vector<VirtualCoreCoordinates> coord;
-    std::string range;
-    std::string path;
     int lowestCoreId, highestCoreId;
     std::map<std::pair<CpuId, PhysicalCoreId>, PhysicalCoreId> uniquePhysicalCoreIds;
     PhysicalCoreId nextIdToUse = 0;
 
-    const std::string coresListFile = simulationParameters.sysfsRootPrefix +
-                                      "/sys/devices/system/cpu/possible";
+    /**
+     * All the files are accessed relatively to the descriptor of the
+     * cpu directory, to avoid resolving the whole path at each read.
+     */
+    utils::SysfsDirectory cpuDir(simulationParameters.sysfsRootPrefix +
+                                 "/sys/devices/system/cpu");
+    const std::string coresListFile = cpuDir.getPath() + "/possible";
     if(utils::existsFile(coresListFile)){
-        range = utils::readFirstLineFromFile(coresListFile);
+        std::string range = utils::readFirstLineFromFile(coresListFile);
         utils::dashedRangeToIntegers(range, lowestCoreId, highestCoreId);
     }else{
-        std::vector<std::string> coresIdentifiers;
-        coresIdentifiers = utils::getCommandOutput("ls " +
-            simulationParameters.sysfsRootPrefix + "/sys/devices/system/cpu/ | "
-            "grep cpu | sed  's/cpu//g' | sort -n");
-        lowestCoreId = utils::stringToInt(coresIdentifiers.front());
-        highestCoreId = utils::stringToInt(coresIdentifiers.back());
+        std::vector<std::string> entries = cpuDir.getEntries(false, true);
+        lowestCoreId = -1;
+        highestCoreId = -1;
+        for(size_t i = 0; i < entries.size(); i++){
+            uint64_t id;
+            const std::string& name = entries[i];
+            const char* last = name.c_str() + name.size();
+            if(!name.compare(0, 3, "cpu") &&
+               utils::parseU64(name.c_str() + 3, last, id) == last){
+                if(lowestCoreId == -1 || (int) id < lowestCoreId){
+                    lowestCoreId = id;
+                }
+                if((int) id > highestCoreId){
+                    highestCoreId = id;
+                }
+            }
+        }
     }
 
-
+    coord.reserve(highestCoreId - lowestCoreId + 1);
     for(unsigned int virtualCoreId = (uint) lowestCoreId; virtualCoreId <= (uint) highestCoreId; virtualCoreId++){
-        path = getTopologyPathFromVirtualCoreId(virtualCoreId);
+        utils::SysfsDirectory topologyDir(cpuDir, "cpu" + utils::intToString(virtualCoreId) + "/topology");
+        int64_t packageId, coreId;
         /** If path doesn't exist, the virtual core is not online. **/
-        if(utils::existsFile(path)){
+        if(topologyDir.readInt("physical_package_id", packageId) &&
+           topologyDir.readInt("core_id", coreId)){
             VirtualCoreCoordinates vcc;
-            vcc.cpuId = utils::stringToInt(utils::readFirstLineFromFile(path + "physical_package_id"));
-            vcc.physicalCoreId = utils::stringToInt(utils::readFirstLineFromFile(path + "core_id"));
+            vcc.cpuId = packageId;
+            vcc.physicalCoreId = coreId;
             vcc.virtualCoreId = virtualCoreId;
 
             /**
@@ -83,7 +100,7 @@ Topology* Topology::local(){
 }
 
 #ifdef MAMMUT_REMOTE
-Topology::Topology(Communicator* const communicator):_communicator(communicator){
+Topology::Topology(Communicator* const communicator):_numIdleLevels(0), _communicator(communicator){
     GetTopology gt;
     GetTopologyRes r;
 
@@ -113,6 +130,8 @@ Topology* Topology::remote(Communicator* const communicator){
 
 
 Topology::~Topology(){
+    utils::deleteVectorElements<NumaNode*>(_numaNodes);
+    utils::deleteVectorElements<CacheDomain*>(_cacheDomains);
     utils::deleteVectorElements<Cpu*>(_cpus);
     utils::deleteVectorElements<PhysicalCore*>(_physicalCores);
     utils::deleteVectorElements<VirtualCore*>(_virtualCores);
@@ -185,19 +204,41 @@ VirtualCore* Topology::getVirtualCore(VirtualCoreId virtualCoreId) const{
     return NULL;
 }
 
-void Topology::buildCpuVector(std::vector<VirtualCoreCoordinates> coord){
+void Topology::buildCpuVector(const std::vector<VirtualCoreCoordinates>& coord){
     std::vector<CpuId> uniqueCpuIds;
+    /**
+     * For each CPU, the indexes (in coord) of the virtual cores of each of
+     * its physical cores. CPUs, physical cores and virtual cores are kept
+     * in the order in which they appear in coord.
+     */
+    std::vector<std::vector<std::vector<size_t> > > groups;
+    std::map<CpuId, size_t> cpuIndexes;
+    std::vector<std::map<PhysicalCoreId, size_t> > physicalCoreIndexes;
 
     for(size_t i = 0; i < coord.size(); i++){
-        if(!utils::contains<CpuId>(uniqueCpuIds, coord.at(i).cpuId)){
-            uniqueCpuIds.push_back(coord.at(i).cpuId);
+        const VirtualCoreCoordinates& vcc = coord[i];
+        std::map<CpuId, size_t>::iterator cit = cpuIndexes.find(vcc.cpuId);
+        if(cit == cpuIndexes.end()){
+            cit = cpuIndexes.insert(std::pair<CpuId, size_t>(vcc.cpuId, uniqueCpuIds.size())).first;
+            uniqueCpuIds.push_back(vcc.cpuId);
+            groups.push_back(std::vector<std::vector<size_t> >());
+            physicalCoreIndexes.push_back(std::map<PhysicalCoreId, size_t>());
+        }
+        std::vector<std::vector<size_t> >& cpuGroup = groups[cit->second];
+        std::map<PhysicalCoreId, size_t>& pIndexes = physicalCoreIndexes[cit->second];
+        std::map<PhysicalCoreId, size_t>::iterator pit = pIndexes.find(vcc.physicalCoreId);
+        if(pit == pIndexes.end()){
+            pit = pIndexes.insert(std::pair<PhysicalCoreId, size_t>(vcc.physicalCoreId, cpuGroup.size())).first;
+            cpuGroup.push_back(std::vector<size_t>());
         }
+        cpuGroup[pit->second].push_back(i);
     }
 
     _cpus.reserve(uniqueCpuIds.size());
+    _virtualCores.reserve(coord.size());
     for(size_t i = 0; i < uniqueCpuIds.size(); i++){
         Cpu* c = NULL;
-        std::vector<PhysicalCore*> phy = buildPhysicalCoresVector(coord, uniqueCpuIds.at(i));
+        std::vector<PhysicalCore*> phy = buildPhysicalCoresVector(coord, groups[i]);
         if(_communicator){
 #ifdef MAMMUT_REMOTE
             c = new CpuRemote(_communicator, uniqueCpuIds.at(i), phy);
@@ -216,59 +257,57 @@ void Topology::buildCpuVector(std::vector<VirtualCoreCoordinates> coord){
     }
 }
 
-std::vector<PhysicalCore*> Topology::buildPhysicalCoresVector(std::vector<VirtualCoreCoordinates> coord, CpuId cpuId){
+std::vector<PhysicalCore*> Topology::buildPhysicalCoresVector(const std::vector<VirtualCoreCoordinates>& coord,
+                                                              const std::vector<std::vector<size_t> >& physicalCoresIndexes){
     std::vector<PhysicalCore*> physicalCores;
-    std::vector<PhysicalCoreId> usedIdentifiers;
-    for(size_t i = 0; i < coord.size(); i++){
-        VirtualCoreCoordinates vcc = coord.at(i);
-        if(vcc.cpuId == cpuId && !utils::contains<PhysicalCoreId>(usedIdentifiers, vcc.physicalCoreId)){
-            PhysicalCore* p =  NULL;
-            std::vector<VirtualCore*> vir = buildVirtualCoresVector(coord, vcc.cpuId, vcc.physicalCoreId);
-            if(_communicator){
+    physicalCores.reserve(physicalCoresIndexes.size());
+    for(size_t i = 0; i < physicalCoresIndexes.size(); i++){
+        const VirtualCoreCoordinates& vcc = coord[physicalCoresIndexes[i].front()];
+        PhysicalCore* p =  NULL;
+        std::vector<VirtualCore*> vir = buildVirtualCoresVector(coord, physicalCoresIndexes[i]);
+        if(_communicator){
 #ifdef MAMMUT_REMOTE
-                p = new PhysicalCoreRemote(_communicator, vcc.cpuId, vcc.physicalCoreId, vir);
+            p = new PhysicalCoreRemote(_communicator, vcc.cpuId, vcc.physicalCoreId, vir);
 #else
-                throw std::runtime_error("You need to define MAMMUT_REMOTE macro to use "
-                                         "remote capabilities.");
+            throw std::runtime_error("You need to define MAMMUT_REMOTE macro to use "
+                                     "remote capabilities.");
 #endif
-            }else{
+        }else{
 #if defined (__linux__)
-                p = new PhysicalCoreLinux(vcc.cpuId, vcc.physicalCoreId, vir);
+            p = new PhysicalCoreLinux(vcc.cpuId, vcc.physicalCoreId, vir);
 #else
-                throw std::runtime_error("buildPhysicalCoresVector: OS not supported");
+            throw std::runtime_error("buildPhysicalCoresVector: OS not supported");
 #endif
-            }
-            physicalCores.push_back(p);
-            _physicalCores.push_back(p);
-            usedIdentifiers.push_back(vcc.physicalCoreId);
         }
+        physicalCores.push_back(p);
+        _physicalCores.push_back(p);
     }
     return physicalCores;
 }
 
-std::vector<VirtualCore*> Topology::buildVirtualCoresVector(std::vector<VirtualCoreCoordinates> coord, CpuId cpuId, PhysicalCoreId physicalCoreId){
+std::vector<VirtualCore*> Topology::buildVirtualCoresVector(const std::vector<VirtualCoreCoordinates>& coord,
+                                                            const std::vector<size_t>& virtualCoresIndexes){
     std::vector<VirtualCore*> virtualCores;
-    for(size_t i = 0; i < coord.size(); i++){
-        VirtualCoreCoordinates vcc = coord.at(i);
-        if(vcc.cpuId == cpuId && vcc.physicalCoreId == physicalCoreId){
-            VirtualCore* v = NULL;
-            if(_communicator){
+    virtualCores.reserve(virtualCoresIndexes.size());
+    for(size_t i = 0; i < virtualCoresIndexes.size(); i++){
+        const VirtualCoreCoordinates& vcc = coord[virtualCoresIndexes[i]];
+        VirtualCore* v = NULL;
+        if(_communicator){
 #ifdef MAMMUT_REMOTE
-                v = new VirtualCoreRemote(_communicator, vcc.cpuId, vcc.physicalCoreId, vcc.virtualCoreId);
+            v = new VirtualCoreRemote(_communicator, vcc.cpuId, vcc.physicalCoreId, vcc.virtualCoreId);
 #else
-                throw std::runtime_error("You need to define MAMMUT_REMOTE macro to use "
-                                         "remote capabilities.");
+            throw std::runtime_error("You need to define MAMMUT_REMOTE macro to use "
+                                     "remote capabilities.");
 #endif
-            }else{
+        }else{
 #if defined (__linux__)
-                v = new VirtualCoreLinux(vcc.cpuId, vcc.physicalCoreId, vcc.virtualCoreId);;
+            v = new VirtualCoreLinux(vcc.cpuId, vcc.physicalCoreId, vcc.virtualCoreId);
 #else
-                throw std::runtime_error("buildVirtualCoresVector: OS not supported");
+            throw std::runtime_error("buildVirtualCoresVector: OS not supported");
 #endif
-            }
-            virtualCores.push_back(v);
-            _virtualCores.push_back(v);
         }
+        virtualCores.push_back(v);
+        _virtualCores.push_back(v);
     }
     return virtualCores;
 }
@@ -281,6 +320,161 @@ VirtualCore* Topology::getVirtualCore() const{
     }
 }
 
+void Topology::indexLocalityDomains(){
+    VirtualCoreId maxId = 0;
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        if(_virtualCores[i]->getVirtualCoreId() > maxId){
+            maxId = _virtualCores[i]->getVirtualCoreId();
+        }
+    }
+    _virtualCoreNumaNode.assign(maxId + 1, NULL);
+    _virtualCoreCacheDomains.assign(maxId + 1, std::vector<CacheDomain*>());
+    for(size_t i = 0; i < _numaNodes.size(); i++){
+        std::vector<VirtualCore*> v = _numaNodes[i]->getVirtualCores();
+        for(size_t j = 0; j < v.size(); j++){
+            _virtualCoreNumaNode[v[j]->getVirtualCoreId()] = _numaNodes[i];
+        }
+    }
+    for(size_t i = 0; i < _cacheDomains.size(); i++){
+        std::vector<VirtualCore*> v = _cacheDomains[i]->getVirtualCores();
+        for(size_t j = 0; j < v.size(); j++){
+            std::vector<CacheDomain*>& domains = _virtualCoreCacheDomains[v[j]->getVirtualCoreId()];
+            // Keep them sorted by level.
+            std::vector<CacheDomain*>::iterator it = domains.begin();
+            while(it != domains.end() && (*it)->getLevel() <= _cacheDomains[i]->getLevel()){
+                ++it;
+            }
+            domains.insert(it, _cacheDomains[i]);
+        }
+    }
+}
+
+std::vector<NumaNode*> Topology::getNumaNodes() const{
+    return _numaNodes;
+}
+
+NumaNode* Topology::getNumaNode(NumaNodeId numaNodeId) const{
+    for(size_t i = 0; i < _numaNodes.size(); i++){
+        if(_numaNodes[i]->getNumaNodeId() == numaNodeId){
+            return _numaNodes[i];
+        }
+    }
+    return NULL;
+}
+
+NumaNode* Topology::getNumaNode(const VirtualCore* virtualCore) const{
+    VirtualCoreId id = virtualCore->getVirtualCoreId();
+    if(id < _virtualCoreNumaNode.size()){
+        return _virtualCoreNumaNode[id];
+    }
+    return NULL;
+}
+
+std::vector<CacheDomain*> Topology::getCacheDomains() const{
+    return _cacheDomains;
+}
+
+std::vector<CacheDomain*> Topology::getCacheDomainsAtLevel(uint level) const{
+    std::vector<CacheDomain*> r;
+    for(size_t i = 0; i < _cacheDomains.size(); i++){
+        if(_cacheDomains[i]->getLevel() == level){
+            r.push_back(_cacheDomains[i]);
+        }
+    }
+    return r;
+}
+
+std::vector<CacheDomain*> Topology::getCacheDomains(const VirtualCore* virtualCore) const{
+    VirtualCoreId id = virtualCore->getVirtualCoreId();
+    if(id < _virtualCoreCacheDomains.size()){
+        return _virtualCoreCacheDomains[id];
+    }
+    return std::vector<CacheDomain*>();
+}
+
+CacheDomain* Topology::getCacheDomain(const VirtualCore* virtualCore, uint level) const{
+    VirtualCoreId id = virtualCore->getVirtualCoreId();
+    if(id >= _virtualCoreCacheDomains.size()){
+        return NULL;
+    }
+    const std::vector<CacheDomain*>& domains = _virtualCoreCacheDomains[id];
+    for(size_t i = 0; i < domains.size(); i++){
+        if(domains[i]->getLevel() == level &&
+           domains[i]->getType() != CACHE_TYPE_INSTRUCTION){
+            return domains[i];
+        }
+    }
+    return NULL;
+}
+
+void Topology::getIdleTimes(std::vector<double>& idleTimes) const{
+    idleTimes.resize(_virtualCores.size());
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        idleTimes[i] = _virtualCores[i]->getIdleTime();
+    }
+}
+
+void Topology::resetIdleTimes(){
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        _virtualCores[i]->resetIdleTime();
+    }
+}
+
+void Topology::buildIdleLevelsMatrix(){
+    std::vector<std::vector<VirtualCoreIdleLevel*> > levels(_virtualCores.size());
+    _numIdleLevels = 0;
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        levels[i] = _virtualCores[i]->getIdleLevels();
+        for(size_t j = 0; j < levels[i].size(); j++){
+            _numIdleLevels = std::max(_numIdleLevels, (size_t) levels[i][j]->getLevelId() + 1);
+        }
+    }
+    _idleLevels.assign(_virtualCores.size() * _numIdleLevels, NULL);
+    for(size_t i = 0; i < levels.size(); i++){
+        for(size_t j = 0; j < levels[i].size(); j++){
+            _idleLevels[i * _numIdleLevels + levels[i][j]->getLevelId()] = levels[i][j];
+        }
+    }
+}
+
+void Topology::readIdleLevels(IdleLevelsSample& sample){
+    if(_idleLevels.empty() && _virtualCores.size()){
+        buildIdleLevelsMatrix();
+    }
+    sample.numLevels = _numIdleLevels;
+    sample.time.resize(_idleLevels.size());
+    sample.count.resize(_idleLevels.size());
+    for(size_t i = 0; i < _idleLevels.size(); i++){
+        VirtualCoreIdleLevel* level = _idleLevels[i];
+        sample.time[i] = level ? level->getAbsoluteTime() : 0;
+        sample.count[i] = level ? level->getAbsoluteCount() : 0;
+    }
+}
+
+void Topology::sampleIdleLevels(IdleLevelsSample& sample){
+    readIdleLevels(sample);
+    if(_lastIdleLevelsTime.size() != sample.time.size()){
+        // First call, the baseline is taken now.
+        _lastIdleLevelsTime = sample.time;
+        _lastIdleLevelsCount = sample.count;
+    }
+    for(size_t i = 0; i < sample.time.size(); i++){
+        uint64_t time = sample.time[i], count = sample.count[i];
+        // Counters restart if the virtual core is hotplugged.
+        sample.time[i] = (time >= _lastIdleLevelsTime[i]) ? time - _lastIdleLevelsTime[i] : time;
+        sample.count[i] = (count >= _lastIdleLevelsCount[i]) ? count - _lastIdleLevelsCount[i] : count;
+        _lastIdleLevelsTime[i] = time;
+        _lastIdleLevelsCount[i] = count;
+    }
+}
+
+void Topology::resetIdleLevels(){
+    IdleLevelsSample sample;
+    readIdleLevels(sample);
+    _lastIdleLevelsTime.swap(sample.time);
+    _lastIdleLevelsCount.swap(sample.count);
+}
+
 RollbackPoint Topology::getRollbackPoint() const{
     RollbackPoint rp;
     for(VirtualCore* v :_virtualCores){
@@ -428,6 +622,28 @@ double Cpu::getClockModulation() const{
     return max;
 }
 
+static void getResidencies(const std::vector<IdleResidencyCounter*>& counters,
+                           std::vector<double>& residencies){
+    residencies.resize(counters.size());
+    for(size_t i = 0; i < counters.size(); i++){
+        residencies[i] = counters[i]->getResidency();
+    }
+}
+
+static void resetResidencies(const std::vector<IdleResidencyCounter*>& counters){
+    for(size_t i = 0; i < counters.size(); i++){
+        counters[i]->resetTicks();
+    }
+}
+
+void Cpu::getIdleResidencies(std::vector<double>& residencies) const{
+    getResidencies(getIdleResidencyCounters(), residencies);
+}
+
+void Cpu::resetIdleResidencies(){
+    resetResidencies(getIdleResidencyCounters());
+}
+
 PhysicalCore::PhysicalCore(CpuId cpuId, PhysicalCoreId physicalCoreId, std::vector<VirtualCore*> virtualCores):
     _cpuId(cpuId), _physicalCoreId(physicalCoreId), _virtualCores(virtualCores){
     ;
@@ -523,6 +739,94 @@ double PhysicalCore::getClockModulation() const{
     return max;
 }
 
+NumaNode::NumaNode(NumaNodeId numaNodeId, std::vector<VirtualCore*> virtualCores,
+                   std::vector<uint> distances):
+        _numaNodeId(numaNodeId), _virtualCores(virtualCores), _distances(distances){
+    ;
+}
+
+NumaNodeId NumaNode::getNumaNodeId() const{
+    return _numaNodeId;
+}
+
+std::vector<VirtualCore*> NumaNode::getVirtualCores() const{
+    return _virtualCores;
+}
+
+VirtualCore* NumaNode::getVirtualCore() const{
+    if(_virtualCores.size()){
+        return _virtualCores.at(0);
+    }else{
+        return NULL;
+    }
+}
+
+uint NumaNode::getDistance(NumaNodeId numaNodeId) const{
+    if(numaNodeId < _distances.size()){
+        return _distances[numaNodeId];
+    }
+    return 0;
+}
+
+void NumaNode::maximizeUtilization() const{
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        _virtualCores.at(i)->maximizeUtilization();
+    }
+}
+
+void NumaNode::resetUtilization() const{
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        _virtualCores.at(i)->resetUtilization();
+    }
+}
+
+CacheDomain::CacheDomain(uint level, CacheType type, uint64_t size, uint lineSize,
+                         std::vector<VirtualCore*> virtualCores):
+        _level(level), _type(type), _size(size), _lineSize(lineSize),
+        _virtualCores(virtualCores){
+    ;
+}
+
+uint CacheDomain::getLevel() const{
+    return _level;
+}
+
+CacheType CacheDomain::getType() const{
+    return _type;
+}
+
+uint64_t CacheDomain::getSize() const{
+    return _size;
+}
+
+uint CacheDomain::getLineSize() const{
+    return _lineSize;
+}
+
+std::vector<VirtualCore*> CacheDomain::getVirtualCores() const{
+    return _virtualCores;
+}
+
+VirtualCore* CacheDomain::getVirtualCore() const{
+    if(_virtualCores.size()){
+        return _virtualCores.at(0);
+    }else{
+        return NULL;
+    }
+}
+
+void CacheDomain::maximizeUtilization() const{
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        _virtualCores.at(i)->maximizeUtilization();
+    }
+}
+
+void CacheDomain::resetUtilization() const{
+    for(size_t i = 0; i < _virtualCores.size(); i++){
+        _virtualCores.at(i)->resetUtilization();
+    }
+}
+
 VirtualCoreIdleLevel::VirtualCoreIdleLevel(VirtualCoreId virtualCoreId, uint levelId):
         _virtualCoreId(virtualCoreId), _levelId(levelId){
     ;
@@ -536,6 +840,23 @@ uint VirtualCoreIdleLevel::getLevelId() const{
     return _levelId;
 }
 
+IdleResidencyCounter::IdleResidencyCounter(uint levelId, bool package):
+        _levelId(levelId), _package(package){
+    ;
+}
+
+uint IdleResidencyCounter::getLevelId() const{
+    return _levelId;
+}
+
+bool IdleResidencyCounter::isPackage() const{
+    return _package;
+}
+
+std::string IdleResidencyCounter::getName() const{
+    return (_package ? "PC" : "C") + utils::intToString(_levelId);
+}
+
 VirtualCore::VirtualCore(CpuId cpuId, PhysicalCoreId physicalCoreId, VirtualCoreId virtualCoreId):
         _cpuId(cpuId), _physicalCoreId(physicalCoreId), _virtualCoreId(virtualCoreId){
     ;
@@ -557,6 +878,14 @@ bool VirtualCore::areTicksConstant() const{
     return hasFlag("constant_tsc");
 }
 
+void VirtualCore::getIdleResidencies(std::vector<double>& residencies) const{
+    getResidencies(getIdleResidencyCounters(), residencies);
+}
+
+void VirtualCore::resetIdleResidencies(){
+    resetResidencies(getIdleResidencyCounters());
+}
+
 
 size_t getNumPhysicalCores(const std::vector<VirtualCore*>& virtualCores){
     return getOneVirtualPerPhysical(virtualCores).size();
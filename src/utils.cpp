@@ -19,6 +19,8 @@
 #include "unistd.h"
 #include "sys/syscall.h"
 #include "sys/time.h"
+#include "sys/vfs.h"
+#include "linux/magic.h"
 
 namespace mammut{
 extern SimulationParameters simulationParameters;
@@ -80,7 +82,7 @@ ScopedLock::~ScopedLock(){
     _lock.unlock();
 }
 
-Thread::Thread():_thread(0), _running(false){
+Thread::Thread():_thread(0), _running(false), _pid(0), _tid(0){
     ;
 }
 
@@ -289,6 +291,77 @@ double stringToDouble(const string& s){
     return atof(s.c_str());
 }
 
+const char* parseU64(const char* first, const char* last, uint64_t& value){
+    while(first != last && (*first == ' ' || *first == '\t')){
+        ++first;
+    }
+    if(first == last || *first < '0' || *first > '9'){
+        return NULL;
+    }
+    uint64_t r = 0;
+    while(first != last && *first >= '0' && *first <= '9'){
+        r = r*10 + (*first - '0');
+        ++first;
+    }
+    value = r;
+    return first;
+}
+
+const char* parseS64(const char* first, const char* last, int64_t& value){
+    while(first != last && (*first == ' ' || *first == '\t')){
+        ++first;
+    }
+    bool negative = false;
+    if(first != last && *first == '-'){
+        negative = true;
+        ++first;
+    }
+    uint64_t r;
+    first = parseU64(first, last, r);
+    if(first){
+        value = negative ? -((int64_t) r) : (int64_t) r;
+    }
+    return first;
+}
+
+size_t parseFields(const char* first, const char* last, int64_t* fields,
+                   size_t maxFields, char delim){
+    size_t numFields = 0;
+    while(first != last && *first != '\n' && numFields < maxFields){
+        if(*first == delim){
+            ++first;
+            continue;
+        }
+        const char* end = parseS64(first, last, fields[numFields]);
+        if(!end || (end != last && *end != delim && *end != '\n')){
+            fields[numFields] = 0;
+            end = first;
+            while(end != last && *end != delim && *end != '\n'){
+                ++end;
+            }
+        }
+        ++numFields;
+        first = end;
+    }
+    return numFields;
+}
+
+size_t formatU64(uint64_t value, char* buffer, size_t size){
+    char tmp[20];
+    size_t length = 0;
+    do{
+        tmp[length++] = '0' + (value % 10);
+        value /= 10;
+    }while(value);
+    if(length > size){
+        return 0;
+    }
+    for(size_t i = 0; i < length; i++){
+        buffer[i] = tmp[length - 1 - i];
+    }
+    return length;
+}
+
 string readFirstLineFromFile(const string& fileName){
     string r;
     ifstream file(fileName.c_str());
@@ -344,10 +417,47 @@ void dashedRangeToIntegers(const string& dashedRange, int& rangeStart, int& rang
     rangeStop = stringToInt(dashedRange.substr(dashPos + 1));
 }
 
+vector<uint> rangesListToIntegers(const string& rangesList){
+    vector<uint> r;
+    const char* first = rangesList.c_str();
+    const char* last = first + rangesList.size();
+    while(first < last){
+        uint64_t start, stop;
+        first = parseU64(first, last, start);
+        if(!first){
+            break;
+        }
+        stop = start;
+        if(first < last && *first == '-'){
+            first = parseU64(first + 1, last, stop);
+            if(!first){
+                break;
+            }
+        }
+        for(uint64_t i = start; i <= stop; i++){
+            r.push_back(i);
+        }
+        if(first < last && *first == ','){
+            ++first;
+        }else{
+            break;
+        }
+    }
+    return r;
+}
+
 string intToString(int x){
-    stringstream out;
-    out << x;
-    return out.str();
+    // Short enough to fit in the string internal buffer, so no
+    // allocations are performed.
+    char buffer[12];
+    size_t length = 0;
+    uint64_t absolute = x;
+    if(x < 0){
+        buffer[length++] = '-';
+        absolute = -((int64_t) x);
+    }
+    length += formatU64(absolute, buffer + length, sizeof(buffer) - length);
+    return string(buffer, length);
 }
 
 vector<string>& split(const string& s, char delim, vector<string>& elems){
@@ -437,29 +547,164 @@ uint getClockTicksPerSecond(){
     return sysconf(_SC_CLK_TCK);
 }
 
-Msr::Msr(uint32_t id, int flags){
-    string msrFileName = "/dev/cpu/" + intToString(id) + "/msr";
+MsrBackendSimulated::MsrBackendSimulated(uint32_t numVirtualCores, bool realTime):
+        _numVirtualCores(numVirtualCores), _realTime(realTime), _time(0){
+    if(_realTime){
+        _time = getMillisecondsTime();
+    }
+}
+
+double MsrBackendSimulated::now() const{
+    return _realTime ? getMillisecondsTime() : _time;
+}
+
+MsrBackendSimulated::EnergyRegister* MsrBackendSimulated::findEnergyRegister(uint32_t id, uint32_t which){
+    std::map<RegisterId, EnergyRegister>::iterator it = _energyRegisters.find(RegisterId(id, which));
+    if(it == _energyRegisters.end()){
+        it = _energyRegisters.find(RegisterId(MSR_SIMULATED_ALL_CORES, which));
+    }
+    return it == _energyRegisters.end() ? NULL : &(it->second);
+}
+
+void MsrBackendSimulated::setRegister(uint32_t which, uint64_t value, uint32_t id){
+    ScopedLock sLock(_lock);
+    _registers[RegisterId(id, which)] = value;
+}
+
+void MsrBackendSimulated::setEnergyRegister(uint32_t which, double watts, double energyPerUnit,
+                                            uint32_t id){
+    ScopedLock sLock(_lock);
+    EnergyRegister& r = _energyRegisters[RegisterId(id, which)];
+    r.watts = watts;
+    r.energyPerUnit = energyPerUnit;
+    // Real counters are never zero.
+    r.joules = energyPerUnit;
+    r.lastUpdate = now();
+}
+
+void MsrBackendSimulated::setPower(uint32_t which, double watts, uint32_t id){
+    ScopedLock sLock(_lock);
+    std::map<RegisterId, EnergyRegister>::iterator it = _energyRegisters.find(RegisterId(id, which));
+    if(it == _energyRegisters.end()){
+        throw runtime_error("MsrBackendSimulated: Energy register not set.");
+    }
+    double t = now();
+    it->second.joules += it->second.watts * ((t - it->second.lastUpdate) / MAMMUT_MILLISECS_IN_SEC);
+    it->second.lastUpdate = t;
+    it->second.watts = watts;
+}
+
+void MsrBackendSimulated::setRaplIntel(double thermalSpecPower, double packageWatts,
+                                       double coresWatts, double graphicWatts, double dramWatts){
+    const double energyPerUnit = 1.0 / (1 << 14);
+    const double powerPerUnit = 1.0 / (1 << 3);
+    // Time unit: 2^-10 seconds.
+    setRegister(MSR_RAPL_POWER_UNIT_INTEL, (10 << 16) | (14 << 8) | 3);
+    setRegister(MSR_PKG_POWER_INFO_INTEL, ((uint64_t) (thermalSpecPower / powerPerUnit)) & 0x7FFF);
+    setEnergyRegister(MSR_PKG_ENERGY_STATUS_INTEL, packageWatts, energyPerUnit);
+    uint32_t registers[] = {MSR_PP0_ENERGY_STATUS_INTEL, MSR_PP1_ENERGY_STATUS_INTEL, MSR_DRAM_ENERGY_STATUS_INTEL};
+    double watts[] = {coresWatts, graphicWatts, dramWatts};
+    for(size_t i = 0; i < 3; i++){
+        if(watts[i] > 0){
+            setEnergyRegister(registers[i], watts[i], energyPerUnit);
+        }
+    }
+}
+
+void MsrBackendSimulated::advanceTime(double milliseconds){
+    ScopedLock sLock(_lock);
+    if(_realTime){
+        throw runtime_error("MsrBackendSimulated: advanceTime can't be used in real time mode.");
+    }
+    _time += milliseconds;
+}
+
+bool MsrBackendSimulated::available(uint32_t id){
+    return id < _numVirtualCores;
+}
+
+bool MsrBackendSimulated::read(uint32_t id, uint32_t which, uint64_t& value){
+    if(!available(id)){
+        return false;
+    }
+    ScopedLock sLock(_lock);
+    EnergyRegister* er = findEnergyRegister(id, which);
+    if(er){
+        double joules = er->joules + er->watts * ((now() - er->lastUpdate) / MAMMUT_MILLISECS_IN_SEC);
+        value = ((uint64_t) (joules / er->energyPerUnit)) & 0xFFFFFFFF;
+        return true;
+    }
+    std::map<RegisterId, uint64_t>::const_iterator it = _registers.find(RegisterId(id, which));
+    if(it == _registers.end()){
+        it = _registers.find(RegisterId(MSR_SIMULATED_ALL_CORES, which));
+    }
+    if(it == _registers.end()){
+        return false;
+    }
+    value = it->second;
+    return true;
+}
+
+bool MsrBackendSimulated::write(uint32_t id, uint32_t which, uint64_t value){
+    if(!available(id)){
+        return false;
+    }
+    ScopedLock sLock(_lock);
+    // Energy counters are read only.
+    if(findEnergyRegister(id, which)){
+        return false;
+    }
+    if(_registers.find(RegisterId(id, which)) == _registers.end() &&
+       _registers.find(RegisterId(MSR_SIMULATED_ALL_CORES, which)) == _registers.end()){
+        return false;
+    }
+    _registers[RegisterId(id, which)] = value;
+    return true;
+}
+
+Msr::Msr(uint32_t id, int flags):
+        _fd(-1), _opened(false), _id(id), _flags(flags),
+        _backend(simulationParameters.msrBackend){
+    ;
+}
+
+void Msr::open() const{
+    if(_opened.load(std::memory_order_acquire) || _backend){
+        return;
+    }
+    string msrFileName = "/dev/cpu/" + intToString(_id) + "/msr";
     string msrSafeFileName = msrFileName + "_safe";
-    _fd = -1;
-    if(existsFile(msrSafeFileName)){
-        _fd = open(msrSafeFileName.c_str(), flags);
+    int fd = ::open(msrSafeFileName.c_str(), _flags);
+    if(fd == -1){
+        fd = ::open(msrFileName.c_str(), _flags);
     }
-    if(_fd == -1 && existsFile(msrFileName)){
-        _fd =  open(msrFileName.c_str(), flags);
+    // If another thread opened the file in the meantime, its descriptor is kept.
+    int expected = -1;
+    if(!_fd.compare_exchange_strong(expected, fd) && fd != -1){
+        close(fd);
     }
+    _opened.store(true, std::memory_order_release);
 }
 
 Msr::~Msr(){
-    if(available()){
-        close(_fd);
+    if(_fd.load() != -1){
+        close(_fd.load());
     }
 }
 
 bool Msr::available() const{
+    if(_backend){
+        return _backend->available(_id);
+    }
+    open();
     return _fd != -1;
 }
 
 bool Msr::read(uint32_t which, uint64_t& value) const{
+    if(_backend){
+        return _backend->read(_id, which, value);
+    }
+    open();
     ssize_t r = pread(_fd, (void*) &value, sizeof(value), (off_t) which);
     if(r != sizeof(value)){
         return false;
@@ -468,7 +713,23 @@ bool Msr::read(uint32_t which, uint64_t& value) const{
     }
 }
 
+bool Msr::read(const std::vector<uint32_t>& which, std::vector<uint64_t>& values) const{
+    values.resize(which.size());
+    bool r = true;
+    for(size_t i = 0; i < which.size(); i++){
+        if(!read(which[i], values[i])){
+            values[i] = 0;
+            r = false;
+        }
+    }
+    return r;
+}
+
 bool Msr::write(uint32_t which, uint64_t value){
+    if(_backend){
+        return _backend->write(_id, which, value);
+    }
+    open();
     if(pwrite(_fd, &value, sizeof(value), which) != sizeof value){
         return false;
     }else{
@@ -519,6 +780,196 @@ bool Msr::writeBits(uint32_t which, unsigned int highBit,
     return write(which, oldValue | value);
 }
 
+SysfsFile::SysfsFile(const string& fileName, int flags):
+        _fileName(fileName), _flags(flags), _fd(-1), _truncate(false){
+    ;
+}
+
+SysfsFile::~SysfsFile(){
+    if(_fd != -1){
+        close(_fd);
+    }
+}
+
+bool SysfsFile::open() const{
+    if(_fd == -1){
+        _fd = ::open(_fileName.c_str(), _flags);
+        struct statfs fs;
+        if(_fd != -1 && (_flags & (O_WRONLY | O_RDWR)) &&
+           !fstatfs(_fd, &fs)){
+            _truncate = fs.f_type != SYSFS_MAGIC &&
+                        fs.f_type != PROC_SUPER_MAGIC;
+        }
+    }
+    return _fd != -1;
+}
+
+const string& SysfsFile::getFileName() const{
+    return _fileName;
+}
+
+bool SysfsFile::available() const{
+    return open();
+}
+
+int SysfsFile::acquire() const{
+    if(open()){
+        return _fd;
+    }
+    if(errno == EMFILE || errno == ENFILE){
+        // Too many open files, do not keep this one open.
+        return ::open(_fileName.c_str(), _flags);
+    }
+    return -1;
+}
+
+void SysfsFile::release(int fd) const{
+    if(fd != _fd){
+        close(fd);
+    }
+}
+
+size_t SysfsFile::read(char* buffer, size_t size) const{
+    int fd = acquire();
+    if(fd == -1){
+        throw runtime_error("Impossible to open file " + _fileName);
+    }
+    ssize_t r = pread(fd, buffer, size - 1, 0);
+    release(fd);
+    if(r < 0){
+        throw runtime_error("Impossible to read file " + _fileName + ": " +
+                            errnoToStr());
+    }
+    buffer[r] = '\0';
+    return r;
+}
+
+string SysfsFile::readFirstLine() const{
+    char buffer[256];
+    size_t length = read(buffer, sizeof(buffer));
+    char* newLine = (char*) memchr(buffer, '\n', length);
+    if(newLine){
+        length = newLine - buffer;
+    }
+    return string(buffer, length);
+}
+
+bool SysfsFile::write(const char* buffer, size_t length) const{
+    int fd = acquire();
+    if(fd == -1){
+        return false;
+    }
+    bool r = pwrite(fd, buffer, length, 0) == (ssize_t) length &&
+             !(_truncate && ftruncate(fd, length));
+    release(fd);
+    return r;
+}
+
+// Not exported by all the libc versions.
+typedef struct{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+}LinuxDirent64;
+
+SysfsDirectory::SysfsDirectory(const string& path):
+        _path(path){
+    _fd = ::open(_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+SysfsDirectory::SysfsDirectory(const SysfsDirectory& parent, const string& name):
+        _path(parent._path + "/" + name), _fd(-1){
+    if(parent._fd != -1){
+        _fd = openat(parent._fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+}
+
+SysfsDirectory::~SysfsDirectory(){
+    if(_fd != -1){
+        close(_fd);
+    }
+}
+
+const string& SysfsDirectory::getPath() const{
+    return _path;
+}
+
+bool SysfsDirectory::available() const{
+    return _fd != -1;
+}
+
+bool SysfsDirectory::read(const string& name, char* buffer, size_t size, size_t& length) const{
+    if(_fd == -1){
+        return false;
+    }
+    int fd = openat(_fd, name.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd == -1){
+        return false;
+    }
+    ssize_t r = ::read(fd, buffer, size - 1);
+    close(fd);
+    if(r < 0){
+        return false;
+    }
+    buffer[r] = '\0';
+    length = r;
+    return true;
+}
+
+bool SysfsDirectory::readInt(const string& name, int64_t& value) const{
+    char buffer[32];
+    size_t length;
+    return read(name, buffer, sizeof(buffer), length) &&
+           parseS64(buffer, buffer + length, value);
+}
+
+bool SysfsDirectory::readFirstLine(const string& name, string& line) const{
+    char buffer[4096];
+    size_t length;
+    if(!read(name, buffer, sizeof(buffer), length)){
+        return false;
+    }
+    char* newLine = (char*) memchr(buffer, '\n', length);
+    if(newLine){
+        length = newLine - buffer;
+    }
+    line.assign(buffer, length);
+    return true;
+}
+
+vector<string> SysfsDirectory::getEntries(bool files, bool directories) const{
+    vector<string> names;
+    if(_fd == -1 || lseek(_fd, 0, SEEK_SET) == -1){
+        return names;
+    }
+    char buffer[4096];
+    long r;
+    while((r = syscall(SYS_getdents64, _fd, buffer, sizeof(buffer))) > 0){
+        for(long offset = 0; offset < r;){
+            const LinuxDirent64* d = (const LinuxDirent64*) (buffer + offset);
+            offset += d->d_reclen;
+            if(!strcmp(d->d_name, ".") || !strcmp(d->d_name, "..")){
+                continue;
+            }
+            bool isDirectory = d->d_type == DT_DIR;
+            if(d->d_type == DT_UNKNOWN || d->d_type == DT_LNK){
+                struct stat st;
+                if(fstatat(_fd, d->d_name, &st, 0)){
+                    // Entry disappeared after the listing, just skip.
+                    continue;
+                }
+                isDirectory = S_ISDIR(st.st_mode);
+            }
+            if((isDirectory && directories) || (!isDirectory && files)){
+                names.push_back(d->d_name);
+            }
+        }
+    }
+    return names;
+}
+
 #ifndef AMESTER_ROOT
 #define AMESTER_ROOT simulationParameters.sysfsRootPrefix + "/tmp/amester"
 #endif
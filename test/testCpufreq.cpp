@@ -2,9 +2,12 @@
  *  Different tests on topology module.
  **/
 #include <algorithm>
+#include <fstream>
 #include <limits.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include <mammut/mammut.hpp>
 #include "gtest/gtest.h"
 
@@ -104,3 +107,609 @@ TEST(CpufreqTest, GeneralTest) {
         }
     }
 }
+
+TEST(CpufreqTest, SetFrequenciesTest) {
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    m.setSimulationParameters(p);
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    std::vector<Domain*> domains = frequency->getDomains();
+    RollbackPoint rp = frequency->getRollbackPoint();
+
+    vector<pair<Domain*, Frequency> > target;
+    for(Domain* domain : domains){
+        EXPECT_TRUE(domain->setGovernor(GOVERNOR_USERSPACE));
+        target.push_back(pair<Domain*, Frequency>(domain, domain->getAvailableFrequencies().at(0)));
+    }
+    EXPECT_TRUE(frequency->setFrequencies(target));
+    for(Domain* domain : domains){
+        EXPECT_EQ(domain->getCurrentFrequencyUserspace(), (Frequency) 1200000);
+    }
+    target.back().second = 1234567;
+    EXPECT_FALSE(frequency->setFrequencies(target));
+
+    /** Not in userspace governor. **/
+    EXPECT_TRUE(domains.at(0)->setGovernor(GOVERNOR_PERFORMANCE));
+    target.back().second = 2401000;
+    EXPECT_FALSE(frequency->setFrequencies(target));
+    EXPECT_EQ(domains.back()->getCurrentFrequencyUserspace(), (Frequency) 2401000);
+    frequency->rollback(rp);
+}
+
+TEST(CpufreqTest, ParallelSetFrequenciesTest) {
+    /** One domain per virtual core, so that the domains are changed in parallel. **/
+    vector<string> domainsFiles, oldDomains;
+    for(size_t i = 0; i < 48; i++){
+        domainsFiles.push_back("./archs/repara/sys/devices/system/cpu/cpu" + utils::intToString(i) +
+                               "/cpufreq/freqdomain_cpus");
+        oldDomains.push_back(utils::readFirstLineFromFile(domainsFiles.back()));
+        utils::writeFile(domainsFiles.back(), utils::intToString(i));
+    }
+    {
+        Mammut m;
+        SimulationParameters p;
+        p.sysfsRootPrefix = "./archs/repara/";
+        m.setSimulationParameters(p);
+        CpuFreq* frequency = m.getInstanceCpuFreq();
+        std::vector<Domain*> domains = frequency->getDomains();
+        ASSERT_EQ(domains.size(), (size_t) 48);
+        RollbackPoint rp = frequency->getRollbackPoint();
+
+        vector<pair<Domain*, Frequency> > target;
+        for(Domain* domain : domains){
+            EXPECT_TRUE(domain->setGovernor(GOVERNOR_USERSPACE));
+            target.push_back(pair<Domain*, Frequency>(domain, domain->getAvailableFrequencies().at(0)));
+        }
+        EXPECT_TRUE(frequency->setFrequencies(target));
+        for(Domain* domain : domains){
+            EXPECT_EQ(domain->getCurrentFrequencyUserspace(), (Frequency) 1200000);
+        }
+
+        /** The threads are reused. A failure doesn't stop the other changes. **/
+        for(size_t i = 0; i < target.size(); i++){
+            target[i].second = domains[i]->getAvailableFrequencies().back();
+        }
+        target[17].second = 1234567;
+        EXPECT_FALSE(frequency->setFrequencies(target));
+        for(size_t i = 0; i < domains.size(); i++){
+            if(i != 17){
+                EXPECT_EQ(domains[i]->getCurrentFrequencyUserspace(), target[i].second);
+            }
+        }
+        EXPECT_EQ(domains[17]->getCurrentFrequencyUserspace(), (Frequency) 1200000);
+
+        target[17].second = domains[17]->getAvailableFrequencies().back();
+        EXPECT_TRUE(frequency->setFrequencies(target));
+        frequency->rollback(rp);
+        /** The threads are stopped when the module is released. **/
+    }
+    for(size_t i = 0; i < domainsFiles.size(); i++){
+        utils::writeFile(domainsFiles[i], oldDomains[i]);
+    }
+}
+
+TEST(CpufreqTest, CachingTest) {
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    m.setSimulationParameters(p);
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    Domain* domain = frequency->getDomains().at(0);
+    string governorFile = p.sysfsRootPrefix + "/sys/devices/system/cpu/cpu0/cpufreq/scaling_governor";
+
+    /** Without watching, external changes are not seen. **/
+    EXPECT_TRUE(frequency->enableCaching(false));
+    EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_PERFORMANCE);
+    utils::writeFile(governorFile, "ondemand");
+    EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_PERFORMANCE);
+    /** Changes performed through Mammut are. **/
+    EXPECT_TRUE(domain->setGovernor(GOVERNOR_USERSPACE));
+    EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_USERSPACE);
+    EXPECT_TRUE(domain->setFrequencyUserspace(1200000));
+    EXPECT_EQ(domain->getCurrentFrequencyUserspace(), (Frequency) 1200000);
+    EXPECT_TRUE(domain->setGovernorBounds(1300000, 2000000));
+    Frequency lb, ub;
+    EXPECT_TRUE(domain->getCurrentGovernorBounds(lb, ub));
+    EXPECT_EQ(lb, (Frequency) 1300000);
+    EXPECT_EQ(ub, (Frequency) 2000000);
+
+    /** With watching, external changes invalidate the cache. **/
+    EXPECT_TRUE(frequency->enableCaching(true));
+    EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_USERSPACE);
+    utils::writeFile(governorFile, "ondemand");
+    for(size_t i = 0; i < 100 && domain->getCurrentGovernor() != GOVERNOR_ONDEMAND; i++){
+        usleep(10000);
+    }
+    EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_ONDEMAND);
+
+    frequency->disableCaching();
+    EXPECT_TRUE(domain->setGovernorBounds(1200000, 2401000));
+    EXPECT_TRUE(domain->setGovernor(GOVERNOR_PERFORMANCE));
+    EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_PERFORMANCE);
+}
+
+TEST(CpufreqTest, PstateTest) {
+    string path = "./archs/repara/sys/devices/system/cpu/cpu0/cpufreq/";
+    vector<string> availableFrequencies = utils::readFile(path + "scaling_available_frequencies");
+    utils::writeFile(path + "scaling_driver", "intel_pstate");
+    remove((path + "scaling_available_frequencies").c_str());
+    utils::writeFile(path + "energy_performance_available_preferences",
+                     "default performance balance_performance balance_power power ");
+    for(size_t i = 0; i < 48; i++){
+        utils::writeFile("./archs/repara/sys/devices/system/cpu/cpu" + utils::intToString(i) +
+                         "/cpufreq/energy_performance_preference", "balance_performance");
+    }
+
+    utils::MsrBackendSimulated backend(48);
+    backend.setRegister(MSR_PM_ENABLE, 1);
+    backend.setRegister(MSR_HWP_CAPABILITIES, 0x0C0A1824);
+    backend.setRegister(MSR_HWP_REQUEST, 0x000000038000240C);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    Domain* domain = frequency->getDomains().at(0);
+
+    /** Frequencies between the hardware bounds. **/
+    vector<Frequency> frequencies = domain->getAvailableFrequencies();
+    EXPECT_EQ(frequencies.size(), (size_t) 14);
+    EXPECT_EQ(frequencies.front(), (Frequency) 1200000);
+    EXPECT_EQ(frequencies.at(1), (Frequency) 1300000);
+    EXPECT_EQ(frequencies.back(), (Frequency) 2401000);
+    EXPECT_TRUE(domain->setGovernorBounds(1250000, 2000000));
+    Frequency lb, ub;
+    EXPECT_TRUE(domain->getCurrentGovernorBounds(lb, ub));
+    EXPECT_EQ(lb, (Frequency) 1250000);
+    EXPECT_EQ(ub, (Frequency) 2000000);
+    EXPECT_FALSE(domain->setGovernorBounds(1000000, 2000000));
+    EXPECT_FALSE(domain->setGovernorBounds(2000000, 1250000));
+
+    /** Energy performance preference. **/
+    EXPECT_EQ(domain->getAvailableEnergyPerformancePreferences().size(), (size_t) 5);
+    EXPECT_STREQ(domain->getEnergyPerformancePreference().c_str(), "balance_performance");
+    EXPECT_TRUE(domain->setEnergyPerformancePreference("power"));
+    EXPECT_STREQ(domain->getEnergyPerformancePreference().c_str(), "power");
+    EXPECT_TRUE(domain->setEnergyPerformancePreference("128"));
+    EXPECT_FALSE(domain->setEnergyPerformancePreference("fast"));
+    EXPECT_FALSE(domain->setEnergyPerformancePreference("256"));
+
+    /** Performance hints. **/
+    PerformanceCapabilities capabilities;
+    EXPECT_TRUE(domain->getPerformanceCapabilities(capabilities));
+    EXPECT_EQ(capabilities.highest, 0x24);
+    EXPECT_EQ(capabilities.guaranteed, 0x18);
+    EXPECT_EQ(capabilities.efficient, 0x0A);
+    EXPECT_EQ(capabilities.lowest, 0x0C);
+
+    PerformanceHint hint;
+    EXPECT_TRUE(domain->getPerformanceHint(hint));
+    EXPECT_EQ(hint.minimum, 0x0C);
+    EXPECT_EQ(hint.maximum, 0x24);
+    EXPECT_EQ(hint.desired, 0);
+    EXPECT_EQ(hint.energyPerformancePreference, 0x80);
+
+    hint.minimum = 0x10;
+    hint.maximum = 0x20;
+    hint.desired = 0x18;
+    hint.energyPerformancePreference = 0xFF;
+    EXPECT_TRUE(domain->setPerformanceHint(hint));
+    uint64_t value;
+    EXPECT_TRUE(backend.read(24, MSR_HWP_REQUEST, value));
+    EXPECT_EQ(value, (uint64_t) 0x00000003FF182010);
+
+    hint.energyPerformancePreference = 0;
+    topology::VirtualCore* vc = m.getInstanceTopology()->getVirtualCore(1);
+    EXPECT_TRUE(domain->setPerformanceHint(vc, hint));
+    EXPECT_TRUE(backend.read(1, MSR_HWP_REQUEST, value));
+    EXPECT_EQ(value, (uint64_t) 0x0000000300182010);
+    EXPECT_TRUE(backend.read(0, MSR_HWP_REQUEST, value));
+    EXPECT_EQ(value, (uint64_t) 0x00000003FF182010);
+    /** Virtual core not in the domain. **/
+    EXPECT_FALSE(domain->setPerformanceHint(m.getInstanceTopology()->getVirtualCore(12), hint));
+    hint.minimum = 0x30;
+    EXPECT_FALSE(domain->setPerformanceHint(hint));
+
+    /** Restore the original files. **/
+    EXPECT_TRUE(domain->setGovernorBounds(1200000, 2401000));
+    utils::writeFile(path + "scaling_driver", "acpi-cpufreq");
+    utils::writeFile(path + "scaling_available_frequencies", availableFrequencies);
+    for(size_t i = 0; i < 48; i++){
+        remove(("./archs/repara/sys/devices/system/cpu/cpu" + utils::intToString(i) +
+                "/cpufreq/energy_performance_preference").c_str());
+    }
+    remove((path + "energy_performance_available_preferences").c_str());
+}
+
+TEST(CpufreqTest, DirectControlTest) {
+    utils::MsrBackendSimulated backend(48);
+    backend.setRegister(MSR_PERF_CTL, 0x100001800);
+    backend.setRegister(MSR_PERF_STATUS, 0x1800);
+    backend.setRegister(MSR_TURBO_RATIO_LIMIT, 0x1C1C1D1E);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    Domain* domain = frequency->getDomains().at(0);
+    RollbackPoint rp = frequency->getRollbackPoint();
+    ASSERT_TRUE(domain->setGovernor(GOVERNOR_ONDEMAND));
+
+    EXPECT_FALSE(domain->isDirectControlEnabled());
+    EXPECT_TRUE(domain->setDirectControl(true));
+    EXPECT_TRUE(domain->isDirectControlEnabled());
+    EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_USERSPACE);
+    EXPECT_EQ(domain->getCurrentFrequency(), (Frequency) 2400000);
+    EXPECT_EQ(domain->getCurrentFrequencyUserspace(), (Frequency) 2400000);
+
+    EXPECT_TRUE(domain->setFrequencyUserspace(1200000));
+    uint64_t value;
+    EXPECT_TRUE(backend.read(24, MSR_PERF_CTL, value));
+    EXPECT_EQ(value, (uint64_t) 0x100000C00);
+    EXPECT_EQ(domain->getCurrentFrequencyUserspace(), (Frequency) 1200000);
+    /** Turbo frequency. **/
+    EXPECT_TRUE(domain->setFrequencyUserspace(2401000));
+    EXPECT_TRUE(backend.read(35, MSR_PERF_CTL, value));
+    EXPECT_EQ(value, (uint64_t) 0x100001E00);
+    EXPECT_EQ(domain->getCurrentFrequencyUserspace(), (Frequency) 2401000);
+    EXPECT_FALSE(domain->setFrequencyUserspace(1234567));
+    /** Cores of the other domain are not changed. **/
+    EXPECT_TRUE(backend.read(12, MSR_PERF_CTL, value));
+    EXPECT_EQ(value, (uint64_t) 0x100001800);
+
+    EXPECT_TRUE(domain->setDirectControl(false));
+    EXPECT_FALSE(domain->isDirectControlEnabled());
+    /** The previous governor is restored. **/
+    EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_ONDEMAND);
+    frequency->rollback(rp);
+
+    /** Not possible with HWP. **/
+    backend.setRegister(MSR_PM_ENABLE, 1);
+    EXPECT_FALSE(domain->setDirectControl(true));
+    backend.setRegister(MSR_PM_ENABLE, 0);
+
+    /** Not possible if the governor can't be parked. **/
+    string governorsFile = "./archs/repara/sys/devices/system/cpu/cpu0/cpufreq/scaling_available_governors";
+    string governors = utils::readFirstLineFromFile(governorsFile);
+    utils::writeFile(governorsFile, "ondemand performance");
+    {
+        Mammut m2;
+        Domain* d = m2.getInstanceCpuFreq()->getDomain(m2.getInstanceTopology()->getVirtualCore(0));
+        EXPECT_FALSE(d->setDirectControl(true));
+        EXPECT_FALSE(d->isDirectControlEnabled());
+    }
+    utils::writeFile(governorsFile, governors);
+}
+
+TEST(CpufreqTest, EffectiveFrequencyTest) {
+    utils::MsrBackendSimulated backend(48);
+    backend.setRegister(MSR_TSC, 1000);
+    backend.setRegister(MSR_APERF, 1000);
+    backend.setRegister(MSR_MPERF, 1000);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    Domain* domain = frequency->getDomains().at(0);
+    topology::VirtualCore* vc = m.getInstanceTopology()->getVirtualCore(1);
+
+    EXPECT_EQ(domain->getEffectiveFrequency(vc), (Frequency) 0);
+    vector<Frequency> frequencies = domain->getEffectiveFrequencies();
+    EXPECT_EQ(frequencies.size(), (size_t) 24);
+    EXPECT_EQ(frequencies.at(0), (Frequency) 0);
+
+    /** 2.4GHz TSC for 200ms, running 50% of the time at 1.5x. **/
+    usleep(200000);
+    backend.setRegister(MSR_TSC, 1000 + 480000000ul);
+    backend.setRegister(MSR_MPERF, 1000 + 240000000ul);
+    backend.setRegister(MSR_APERF, 1000 + 360000000ul);
+    EXPECT_NEAR(domain->getEffectiveFrequency(vc), 3600000, 400000);
+    /** Always idle. **/
+    EXPECT_EQ(domain->getEffectiveFrequency(vc), (Frequency) 0);
+    /** Not in the domain. **/
+    EXPECT_EQ(domain->getEffectiveFrequency(m.getInstanceTopology()->getVirtualCore(12)), (Frequency) 0);
+}
+
+TEST(CpufreqTest, VoltageTableBuilderTest) {
+    utils::MsrBackendSimulated backend(48);
+    // 1V
+    backend.setRegister(MSR_PERF_STATUS, (uint64_t) 8192 << 32);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    Domain* domain = frequency->getDomains().at(0);
+    vector<Frequency> frequencies = domain->getAvailableFrequencies();
+
+    vector<Domain*> domains;
+    domains.push_back(domain);
+    VoltageTableBuilder builder(domains);
+    builder.setSampling(1, 3, 10, 0.01);
+    builder.setCheckpoint("./archs/repara/voltageTable");
+    string checkpointFile = builder.getCheckpointFile(domain);
+
+    /** Simulates an interrupted run, where only the idle points are missing. **/
+    VoltageTable partial;
+    for(size_t n = 1; n <= 12; n++){
+        for(Frequency f : frequencies){
+            partial[VoltageTableKey(n, f)] = 0.9;
+        }
+    }
+    dumpVoltageTable(partial, checkpointFile);
+    EXPECT_FALSE(utils::existsFile(checkpointFile + ".tmp"));
+    /** Empty and truncated lines are skipped. **/
+    ofstream out(checkpointFile.c_str(), ios_base::app);
+    out << endl << "0;12";
+    out.close();
+
+    vector<VoltageTable> tables = builder.build();
+    EXPECT_EQ(tables.size(), (size_t) 1);
+    VoltageTable& table = tables.at(0);
+    EXPECT_EQ(table.size(), (size_t) 13 * frequencies.size());
+    EXPECT_DOUBLE_EQ(table[VoltageTableKey(0, 1200000)], 1.0);
+    EXPECT_DOUBLE_EQ(table[VoltageTableKey(12, 1200000)], 0.9);
+
+    VoltageTable checkpoint;
+    loadVoltageTable(checkpoint, checkpointFile);
+    EXPECT_EQ(checkpoint.size(), table.size());
+    EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_PERFORMANCE);
+}
+
+/**
+ * Simulates the busy loop timed while measuring the transition latencies.
+ * An iteration takes 500ns at the fast frequency and 1000ns otherwise.
+ * The fast frequency takes effect 2ms or 8ms (alternately) after it is
+ * set, the others 12ms after they are set (less than the time waited
+ * before each measurement).
+ */
+class SimulatedTransitionProbe: public TransitionProbe, public utils::Thread{
+private:
+    const Domain* _domain;
+    Frequency _fast;
+    std::atomic<bool> _stop;
+    std::atomic<size_t> _count;
+    vector<double> _starts;
+    vector<double> _durations;
+
+    static double now(){
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000.0 + ts.tv_nsec;
+    }
+public:
+    SimulatedTransitionProbe(const Domain* domain, Frequency fast):
+        _domain(domain), _fast(fast), _stop(false), _count(0),
+        _starts(1 << 16), _durations(1 << 16){;}
+
+    void run(){
+        Frequency current = 0;
+        bool fast = false;
+        double changed = 0, latency = 0;
+        size_t switches = 0;
+        while(!_stop){
+            double start = now();
+            Frequency f = _domain->getCurrentFrequencyUserspace();
+            if(f && f != current){
+                current = f;
+                changed = start;
+                if(current == _fast){
+                    latency = (switches++ % 2) ? 8000000 : 2000000;
+                }else{
+                    latency = 12000000;
+                }
+            }
+            if(fast != (current == _fast) && start - changed >= latency){
+                fast = !fast;
+            }
+            size_t count = _count.load();
+            _starts[count % _starts.size()] = start;
+            _durations[count % _durations.size()] = fast ? 500 : 1000;
+            _count.store(count + 1);
+            usleep(10);
+        }
+    }
+
+    void stop(){_stop = true;}
+    size_t getCount() const{return _count.load();}
+    size_t getCapacity() const{return _starts.size();}
+    double getStart(size_t i) const{return _starts[i % _starts.size()];}
+    double getDuration(size_t i) const{return _durations[i % _durations.size()];}
+};
+
+TEST(CpufreqTest, TransitionLatencyTest) {
+    /** Only two frequencies, to keep the measurement short. **/
+    string frequenciesFile = "./archs/repara/sys/devices/system/cpu/cpu0/cpufreq/scaling_available_frequencies";
+    string frequencies = utils::readFirstLineFromFile(frequenciesFile);
+    utils::writeFile(frequenciesFile, "2401000 1200000");
+    {
+        Mammut m;
+        SimulationParameters p;
+        p.sysfsRootPrefix = "./archs/repara/";
+        m.setSimulationParameters(p);
+        CpuFreq* frequency = m.getInstanceCpuFreq();
+        Domain* domain = frequency->getDomains().at(0);
+        ASSERT_EQ(domain->getAvailableFrequencies().size(), (size_t) 2);
+
+        EXPECT_TRUE(frequency->getTransitionLatencies(domain).empty());
+        EXPECT_DOUBLE_EQ(frequency->getTransitionLatency(domain, 1200000, 2401000), 10000);
+
+        SimulatedTransitionProbe probe(domain, 2401000);
+        probe.start();
+        TransitionLatencyMatrix matrix = frequency->measureTransitionLatencies(domain, 2, &probe);
+        probe.stop();
+        probe.join();
+
+        /**
+         * The two repetitions are averaged. The switch is noticed by the
+         * probe up to an iteration (plus the time to write the files) late.
+         **/
+        ASSERT_EQ(matrix.size(), (size_t) 2);
+        EXPECT_GT(matrix[TransitionLatencyKey(1200000, 2401000)], 4900000);
+        EXPECT_LT(matrix[TransitionLatencyKey(1200000, 2401000)], 7500000);
+        EXPECT_GT(matrix[TransitionLatencyKey(2401000, 1200000)], 11900000);
+        EXPECT_LT(matrix[TransitionLatencyKey(2401000, 1200000)], 14500000);
+        EXPECT_DOUBLE_EQ(frequency->getTransitionLatency(domain, 2401000, 1200000),
+                         matrix[TransitionLatencyKey(2401000, 1200000)]);
+        EXPECT_EQ(frequency->getTransitionLatencies(domain).size(), matrix.size());
+        EXPECT_EQ(domain->getCurrentGovernor(), GOVERNOR_PERFORMANCE);
+    }
+    utils::writeFile(frequenciesFile, frequencies);
+}
+
+TEST(CpufreqTest, FrequencyResidencyTest) {
+    string path = "./archs/repara/sys/devices/system/cpu/cpu0/cpufreq/stats/";
+    long hz = sysconf(_SC_CLK_TCK);
+    mkdir(path.c_str(), 0755);
+    utils::writeFile(path + "time_in_state", "2400000 " + utils::intToString(hz) + "\n"
+                                             "1200000 0\n"
+                                             "1800000 " + utils::intToString(hz * 2) + "\n");
+    utils::writeFile(path + "trans_table", "   From  :    To\n"
+                                           "         :   2400000   1200000   1800000\n"
+                                           "  2400000:         0         1         2\n"
+                                           "  1200000:         3         0         4\n"
+                                           "  1800000:         5         6         0\n");
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    m.setSimulationParameters(p);
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    Domain* domain = frequency->getDomains().at(0);
+
+    vector<Frequency> frequencies = domain->getResidencyFrequencies();
+    ASSERT_EQ(frequencies.size(), (size_t) 3);
+    EXPECT_EQ(frequencies.front(), (Frequency) 1200000);
+    EXPECT_EQ(frequencies.back(), (Frequency) 2400000);
+
+    /** Deltas since the construction of the domain. **/
+    vector<uint64_t> times, transitions;
+    EXPECT_TRUE(domain->getFrequencyResidency(times));
+    EXPECT_EQ(times, vector<uint64_t>(3, 0));
+    utils::writeFile(path + "time_in_state", "2400000 " + utils::intToString(hz * 3) + "\n"
+                                             "1200000 " + utils::intToString(hz / 2) + "\n"
+                                             "1800000 " + utils::intToString(hz * 2) + "\n");
+    utils::writeFile(path + "trans_table", "   From  :    To\n"
+                                           "         :   2400000   1200000   1800000\n"
+                                           "  2400000:         0         2         2\n"
+                                           "  1200000:         3         0         4\n"
+                                           "  1800000:         7         6         0\n");
+    EXPECT_TRUE(domain->getFrequencyResidency(times));
+    EXPECT_EQ(times.at(0), (uint64_t) 500);
+    EXPECT_EQ(times.at(1), (uint64_t) 0);
+    EXPECT_EQ(times.at(2), (uint64_t) 2000);
+    EXPECT_TRUE(domain->getFrequencyTransitions(transitions));
+    ASSERT_EQ(transitions.size(), (size_t) 9);
+    /** 2400000 -> 1200000 and 1800000 -> 2400000. **/
+    EXPECT_EQ(transitions.at(2 * 3 + 0), (uint64_t) 1);
+    EXPECT_EQ(transitions.at(1 * 3 + 2), (uint64_t) 2);
+    EXPECT_EQ(transitions.at(0 * 3 + 1), (uint64_t) 0);
+
+    domain->resetFrequencyResidency();
+    EXPECT_TRUE(domain->getFrequencyResidency(times));
+    EXPECT_EQ(times, vector<uint64_t>(3, 0));
+    EXPECT_TRUE(domain->getFrequencyTransitions(transitions));
+    EXPECT_EQ(transitions, vector<uint64_t>(9, 0));
+
+    /** Statistics not available. **/
+    EXPECT_TRUE(frequency->getDomains().at(1)->getResidencyFrequencies().empty());
+    EXPECT_FALSE(frequency->getDomains().at(1)->getFrequencyResidency(times));
+
+    remove((path + "trans_table").c_str());
+
+    /** The kernel fails to read tables larger than a page. **/
+    mkdir((path + "trans_table").c_str(), 0755);
+    {
+        Mammut m2;
+        m2.setSimulationParameters(p);
+        Domain* d = m2.getInstanceCpuFreq()->getDomains().at(0);
+        EXPECT_TRUE(d->getFrequencyResidency(times));
+        EXPECT_FALSE(d->getFrequencyTransitions(transitions));
+    }
+    rmdir((path + "trans_table").c_str());
+
+    remove((path + "time_in_state").c_str());
+    rmdir(path.c_str());
+}
+
+TEST(CpufreqTest, UncoreTest) {
+    utils::MsrBackendSimulated backend(48);
+    backend.setRegister(MSR_UNCORE_RATIO_LIMIT, 0x0C1E);
+    backend.setRegister(MSR_UNCORE_PERF_STATUS, 0x14);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    CpuFreq* frequency = m.getInstanceCpuFreq();
+    topology::Topology* topology = m.getInstanceTopology();
+
+    /** Through MSR_UNCORE_RATIO_LIMIT. **/
+    vector<UncoreDomain*> uncores = frequency->getUncoreDomains();
+    ASSERT_EQ(uncores.size(), topology->getCpus().size());
+    UncoreDomain* uncore = frequency->getUncoreDomain(topology->getCpus().at(1));
+    ASSERT_TRUE(uncore != NULL);
+    EXPECT_EQ(uncore->getCpu()->getCpuId(), topology->getCpus().at(1)->getCpuId());
+    EXPECT_EQ(uncore->getCurrentFrequency(), (Frequency) 2000000);
+    Frequency lb, ub;
+    EXPECT_TRUE(uncore->getHardwareBounds(lb, ub));
+    EXPECT_EQ(lb, (Frequency) 1200000);
+    EXPECT_EQ(ub, (Frequency) 3000000);
+
+    RollbackPoint rp = frequency->getRollbackPoint();
+    EXPECT_FALSE(uncore->setBounds(1000000, 2000000));
+    EXPECT_FALSE(uncore->setBounds(2000000, 1500000));
+    EXPECT_TRUE(uncore->setBounds(1500000, 2000000));
+    EXPECT_TRUE(uncore->getBounds(lb, ub));
+    EXPECT_EQ(lb, (Frequency) 1500000);
+    EXPECT_EQ(ub, (Frequency) 2000000);
+    uint64_t value;
+    uint32_t id = uncore->getCpu()->getVirtualCore()->getVirtualCoreId();
+    EXPECT_TRUE(backend.read(id, MSR_UNCORE_RATIO_LIMIT, value));
+    EXPECT_EQ(value, (uint64_t) 0x0F14);
+    frequency->rollback(rp);
+    EXPECT_TRUE(uncore->getBounds(lb, ub));
+    EXPECT_EQ(lb, (Frequency) 1200000);
+    EXPECT_EQ(ub, (Frequency) 3000000);
+
+    /** Through the intel_uncore_frequency driver. **/
+    string path = "./archs/repara/sys/devices/system/cpu/intel_uncore_frequency/";
+    mkdir(path.c_str(), 0755);
+    for(topology::Cpu* c : topology->getCpus()){
+        string package = path + "package_0" + utils::intToString(c->getCpuId()) + "_die_00/";
+        mkdir(package.c_str(), 0755);
+        utils::writeFile(package + "initial_min_freq_khz", "800000");
+        utils::writeFile(package + "initial_max_freq_khz", "2400000");
+        utils::writeFile(package + "min_freq_khz", "800000");
+        utils::writeFile(package + "max_freq_khz", "2400000");
+        utils::writeFile(package + "current_freq_khz", "1800000");
+    }
+    CpuFreq* frequencySysfs = CpuFreq::local();
+    uncore = frequencySysfs->getUncoreDomains().at(0);
+    EXPECT_EQ(uncore->getCurrentFrequency(), (Frequency) 1800000);
+    EXPECT_TRUE(uncore->getHardwareBounds(lb, ub));
+    EXPECT_EQ(lb, (Frequency) 800000);
+    EXPECT_EQ(ub, (Frequency) 2400000);
+    EXPECT_TRUE(uncore->setBounds(1000000, 1600000));
+    EXPECT_TRUE(uncore->getBounds(lb, ub));
+    EXPECT_EQ(lb, (Frequency) 1000000);
+    EXPECT_EQ(ub, (Frequency) 1600000);
+    CpuFreq::release(frequencySysfs);
+
+    for(topology::Cpu* c : topology->getCpus()){
+        string package = path + "package_0" + utils::intToString(c->getCpuId()) + "_die_00/";
+        utils::getCommandOutput("rm -rf " + package);
+    }
+    rmdir(path.c_str());
+}
@@ -0,0 +1,196 @@
+/**
+ *  Different tests on energy module.
+ **/
+#include <mammut/mammut.hpp>
+#include "gtest/gtest.h"
+
+using namespace mammut;
+using namespace mammut::energy;
+using namespace mammut::utils;
+using namespace std;
+
+TEST(EnergyTest, PowerEstimatorTest) {
+    PowerEstimator estimator;
+    EXPECT_DOUBLE_EQ(estimator.update(0, 0, 1000).watts, 0);
+    EXPECT_DOUBLE_EQ(estimator.update(500, 25, 1000).watts, 50);
+    EXPECT_DOUBLE_EQ(estimator.update(1000, 50, 1000).watts, 50);
+    // Only the last second is considered.
+    PowerSample s = estimator.update(2000, 150, 1000);
+    EXPECT_DOUBLE_EQ(s.timestampMs, 2000);
+    EXPECT_DOUBLE_EQ(s.joules, 150);
+    EXPECT_DOUBLE_EQ(s.watts, 100);
+    // Joules decreased (reset).
+    EXPECT_DOUBLE_EQ(estimator.update(2100, 10, 1000).watts, 0);
+    EXPECT_DOUBLE_EQ(estimator.update(2200, 30, 1000).watts, 200);
+}
+
+TEST(EnergyTest, SimulatedRaplTest) {
+    MsrBackendSimulated backend(48);
+    backend.setRaplIntel(130, 50, 30, 0, 10);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    Energy* energy = m.getInstanceEnergy();
+    CounterCpus* counter = dynamic_cast<CounterCpus*>(energy->getCounter(COUNTER_CPUS));
+    ASSERT_TRUE(counter != NULL);
+    EXPECT_TRUE(counter->hasJoulesCores());
+    EXPECT_FALSE(counter->hasJoulesGraphic());
+    EXPECT_TRUE(counter->hasJoulesDram());
+
+    counter->reset();
+    backend.advanceTime(2000);
+    JoulesCpu j = counter->getJoulesComponents((topology::CpuId) 0);
+    EXPECT_NEAR(j.cpu, 100, 0.001);
+    EXPECT_NEAR(j.cores, 60, 0.001);
+    EXPECT_NEAR(j.graphic, 0, 0.001);
+    EXPECT_NEAR(j.dram, 20, 0.001);
+
+    JoulesCpuSnapshot snapshot;
+    counter->sampleAll(snapshot);
+    EXPECT_EQ(snapshot.joules.size(), (size_t) 2);
+    EXPECT_NEAR(snapshot.getTotal().cpu, 200, 0.001);
+
+    /** The 32 bits counters wrap after 2^18 joules. **/
+    counter->reset();
+    backend.advanceTime(4000 * 1000);
+    EXPECT_NEAR(counter->getJoulesCpu((topology::CpuId) 1), 200000, 0.001);
+    backend.advanceTime(2000 * 1000);
+    EXPECT_NEAR(counter->getJoulesCpu((topology::CpuId) 1), 300000, 0.001);
+}
+
+TEST(EnergyTest, RefresherBurstTest) {
+    MsrBackendSimulated backend(48, true);
+    // Energy unit of 2^-31 joules, so that the counters wrap after ~2 joules.
+    backend.setRegister(MSR_RAPL_POWER_UNIT_INTEL, (10 << 16) | (31 << 8) | 3);
+    // TDP of 4 watts, the counters wrap after ~500 milliseconds at TDP.
+    backend.setRegister(MSR_PKG_POWER_INFO_INTEL, 4 * 8);
+    backend.setEnergyRegister(MSR_PKG_ENERGY_STATUS_INTEL, 0, 1.0 / (1u << 31));
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    CounterCpus* counter = dynamic_cast<CounterCpus*>(m.getInstanceEnergy()->getCounter(COUNTER_CPUS));
+    ASSERT_TRUE(counter != NULL);
+    counter->reset();
+
+    // While idle, the counters are still read at least every half wrap.
+    sleep(1);
+    RefresherStats stats = counter->getRefresherStats();
+    EXPECT_GT(stats.refreshes, (uint64_t) 0);
+    EXPECT_LE(stats.lastIntervalMs, 260);
+
+    // A burst above TDP must not wrap the counters between two reads.
+    backend.setPower(MSR_PKG_ENERGY_STATUS_INTEL, 6);
+    sleep(1);
+    backend.setPower(MSR_PKG_ENERGY_STATUS_INTEL, 0);
+    EXPECT_NEAR(counter->getJoulesCpu((topology::CpuId) 0), 6, 0.2);
+}
+
+TEST(EnergyTest, RefresherPowerLimitTest) {
+    MsrBackendSimulated backend(48, true);
+    // Energy unit of 2^-31 joules, so that the counters wrap after ~2 joules.
+    backend.setRegister(MSR_RAPL_POWER_UNIT_INTEL, (10 << 16) | (31 << 8) | 3);
+    backend.setRegister(MSR_PKG_POWER_INFO_INTEL, 4 * 8);
+    // PL1 of 4 watts and PL2 of 5 watts, both enabled.
+    backend.setRegister(MSR_PKG_RAPL_POWER_LIMIT_INTEL,
+                        (4 * 8) | (1 << 15) | ((uint64_t) (5 * 8) << 32) | ((uint64_t) 1 << 47));
+    backend.setEnergyRegister(MSR_PKG_ENERGY_STATUS_INTEL, 0, 1.0 / (1u << 31));
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    CounterCpus* counter = dynamic_cast<CounterCpus*>(m.getInstanceEnergy()->getCounter(COUNTER_CPUS));
+    ASSERT_TRUE(counter != NULL);
+    counter->reset();
+
+    // While idle, the counters are read less often than half the
+    // wrapping interval at TDP (250 milliseconds).
+    sleep(1);
+    RefresherStats stats = counter->getRefresherStats();
+    EXPECT_GT(stats.lastIntervalMs, 300);
+    EXPECT_LE(stats.lastIntervalMs, 360);
+
+    // A burst at PL2 must not wrap the counters between two reads.
+    backend.setPower(MSR_PKG_ENERGY_STATUS_INTEL, 5);
+    sleep(1);
+    backend.setPower(MSR_PKG_ENERGY_STATUS_INTEL, 0);
+    EXPECT_NEAR(counter->getJoulesCpu((topology::CpuId) 0), 5, 0.2);
+}
+
+TEST(EnergyTest, SamplerTest) {
+    MsrBackendSimulated backend(48);
+    backend.setRaplIntel(130, 50, 30, 0, 10);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    Energy* energy = m.getInstanceEnergy();
+
+    EnergySampler sampler(energy, 1, 8);
+    EnergySamplerCursor cursor = sampler.getCursor();
+    EXPECT_EQ(cursor.next, (uint64_t) 0);
+    sampler.start();
+    usleep(100 * 1000);
+    sampler.stop();
+    EXPECT_EQ(sampler.getError(), "");
+
+    // The reader was too slow, only the last 8 records are available.
+    vector<EnergySamplerRecord> records;
+    EXPECT_EQ(sampler.read(cursor, records), (size_t) 8);
+    EXPECT_GT(cursor.lost, (uint64_t) 0);
+    EXPECT_EQ(cursor.lost + records.size(), cursor.next);
+    // Records are stored in order, one sample after the other.
+    for(size_t i = 1; i < records.size(); i++){
+        EXPECT_GE(records[i].sample, records[i - 1].sample);
+        EXPECT_LE(records[i].sample, records[i - 1].sample + 1);
+    }
+    EXPECT_FALSE(sampler.read(cursor, records[0]));
+
+    // A cursor taken now only sees the new records.
+    EnergySamplerCursor last = sampler.getCursor();
+    EXPECT_EQ(last.next, cursor.next);
+    EXPECT_EQ(last.lost, (uint64_t) 0);
+
+    // Started again through the base class, it is still joined by stop().
+    Thread* thread = &sampler;
+    thread->start();
+    usleep(10 * 1000);
+    sampler.stop();
+    EXPECT_GT(sampler.getCursor().next, last.next);
+    EXPECT_EQ(sampler.getError(), "");
+}
+
+TEST(EnergyTest, SamplerPinningTest) {
+    MsrBackendSimulated backend(48);
+    backend.setRaplIntel(130, 50, 30, 0, 10);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    Energy* energy = m.getInstanceEnergy();
+    topology::VirtualCore* vc = m.getInstanceTopology()->getVirtualCore(47);
+
+    // Pinning fails if the machine has less virtual cores than the
+    // simulated one. The sampler must terminate without aborting.
+    EnergySampler sampler(energy, 1, 8, vc);
+    sampler.start();
+    usleep(10 * 1000);
+    sampler.stop();
+    if(sysconf(_SC_NPROCESSORS_CONF) <= 47){
+        EXPECT_NE(sampler.getError(), "");
+        EXPECT_EQ(sampler.getCursor().next, (uint64_t) 0);
+    }else{
+        EXPECT_EQ(sampler.getError(), "");
+    }
+}
@@ -145,3 +145,44 @@ TEST(TaskTest, ThrottlingTest) {
         std::cout << "Dummy: " << x << std::endl;
     }
 }
+
+static vector<VirtualCoreId> toIds(const vector<VirtualCore*>& virtualCores){
+    vector<VirtualCoreId> ids;
+    for(size_t i = 0; i < virtualCores.size(); i++){
+        ids.push_back(virtualCores[i]->getVirtualCoreId());
+    }
+    return ids;
+}
+
+TEST(TaskTest, PlacementTest) {
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    m.setSimulationParameters(p);
+    Topology* topology = m.getInstanceTopology();
+    PlacementPlanner planner(topology);
+
+    // On repara, virtual cores i and i + 24 are SMT siblings and
+    // virtual cores 0-11 belong to the first CPU.
+    EXPECT_EQ(toIds(planner.plan(3, PLACEMENT_COMPACT)), vector<VirtualCoreId>({0, 24, 1}));
+    EXPECT_EQ(toIds(planner.plan(3, PLACEMENT_AVOID_SMT)), vector<VirtualCoreId>({0, 1, 2}));
+    EXPECT_EQ(planner.plan(25, PLACEMENT_AVOID_SMT).back()->getVirtualCoreId(), (VirtualCoreId) 24);
+    EXPECT_EQ(toIds(planner.plan(4, PLACEMENT_SCATTER)), vector<VirtualCoreId>({0, 12, 1, 13}));
+    EXPECT_EQ(toIds(planner.plan(4, PLACEMENT_PER_CACHE)), vector<VirtualCoreId>({0, 12, 1, 13}));
+    // No NUMA information, a single node.
+    EXPECT_EQ(toIds(planner.plan(3, PLACEMENT_PER_NUMA)), vector<VirtualCoreId>({0, 1, 2}));
+
+    vector<VirtualCore*> order = planner.getOrder(PLACEMENT_SCATTER);
+    EXPECT_EQ(order.size(), (size_t) 48);
+    vector<VirtualCore*> oversubscribed = planner.plan(50, PLACEMENT_SCATTER);
+    EXPECT_EQ(oversubscribed[48], order[0]);
+    EXPECT_EQ(oversubscribed[49], order[1]);
+
+    TasksManager* task = m.getInstanceTask();
+    ProcessHandler* ph = task->getProcessHandler(getpid());
+    EXPECT_TRUE(planner.apply(ph, PLACEMENT_COMPACT));
+    VirtualCoreId virtualCoreId;
+    ph->getVirtualCoreId(virtualCoreId);
+    EXPECT_EQ(virtualCoreId, (VirtualCoreId) 0);
+    task->releaseProcessHandler(ph);
+}
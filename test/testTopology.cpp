@@ -4,8 +4,10 @@
 #include <algorithm>
 #include <limits.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <mammut/mammut.hpp>
+#include <mammut/topology/topology-linux.hpp>
 #include "gtest/gtest.h"
 
 using namespace mammut;
@@ -38,6 +40,9 @@ TEST(TopologyTest, GeneralTest) {
         EXPECT_TRUE(vc->isHotPluggable());
         EXPECT_TRUE(vc->isHotPlugged());
         EXPECT_TRUE(vc->areTicksConstant());
+        EXPECT_TRUE(vc->hasFlag("aperfmperf"));
+        EXPECT_FALSE(vc->hasFlag("tsc_dead"));
+        EXPECT_FALSE(vc->hasFlag("nonexistent"));
     }
 
     /*******************************************/
@@ -132,3 +137,239 @@ TEST(TopologyTest, GeneralTest) {
         EXPECT_GT(sleepingSecs - (totalTime / 1000000.0), 9.99);
     }
 }
+
+TEST(TopologyTest, ProcStatTest) {
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    m.setSimulationParameters(p);
+    Topology* topology = m.getInstanceTopology();
+
+    ProcStatSnapshot snapshot(47);
+    snapshot.update();
+    // "cpu1" must not match the line of "cpu10".
+    EXPECT_TRUE(snapshot.isPresent(1));
+    EXPECT_EQ(snapshot.getTicks(1, PROC_STAT_IDLE), (uint64_t) 220674229);
+    EXPECT_EQ(snapshot.getTicks(10, PROC_STAT_IDLE), (uint64_t) 227505283);
+    EXPECT_EQ(snapshot.getTicks(47, PROC_STAT_USER), (uint64_t) 1923347);
+
+    vector<double> idleTimes;
+    topology->resetIdleTimes();
+    topology->getIdleTimes(idleTimes);
+    EXPECT_EQ(idleTimes.size(), topology->getVirtualCores().size());
+    for(size_t i = 0; i < idleTimes.size(); i++){
+        EXPECT_EQ(idleTimes[i], 0);
+    }
+
+    // An offline virtual core is not in /proc/stat.
+    const std::string procStat = "./archs/repara/proc/stat";
+    vector<string> lines = utils::readFile(procStat), offline;
+    for(size_t i = 0; i < lines.size(); i++){
+        if(lines[i].compare(0, 6, "cpu47 ")){
+            offline.push_back(lines[i]);
+        }
+    }
+    utils::writeFile(procStat, offline);
+    topology->getIdleTimes(idleTimes);
+    for(size_t i = 0; i < idleTimes.size(); i++){
+        if(topology->getVirtualCores()[i]->getVirtualCoreId() == 47){
+            EXPECT_EQ(idleTimes[i], -1);
+        }else{
+            EXPECT_EQ(idleTimes[i], 0);
+        }
+    }
+    utils::writeFile(procStat, lines);
+}
+
+TEST(TopologyTest, LocalityTest) {
+    // repara does not export NUMA information, add two nodes (one per CPU).
+    const std::string nodePath = "./archs/repara/sys/devices/system/node/";
+    ASSERT_EQ(system(("mkdir -p " + nodePath + "node0 " + nodePath + "node1").c_str()), 0);
+    utils::writeFile(nodePath + "node0/cpulist", "0-11,24-35");
+    utils::writeFile(nodePath + "node0/distance", "10 21");
+    utils::writeFile(nodePath + "node1/cpulist", "12-23,36-47");
+    utils::writeFile(nodePath + "node1/distance", "21 10");
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    m.setSimulationParameters(p);
+    Topology* topology = m.getInstanceTopology();
+
+    vector<NumaNode*> nodes = topology->getNumaNodes();
+    ASSERT_EQ(nodes.size(), (size_t) 2);
+    EXPECT_EQ(nodes[1]->getNumaNodeId(), (NumaNodeId) 1);
+    EXPECT_EQ(nodes[1]->getVirtualCores().size(), (size_t) 24);
+    EXPECT_EQ(nodes[0]->getDistance(0), (uint) 10);
+    EXPECT_EQ(nodes[0]->getDistance(1), (uint) 21);
+    EXPECT_EQ(nodes[0]->getDistance(2), (uint) 0);
+    EXPECT_EQ(topology->getNumaNode(topology->getVirtualCore(36)), nodes[1]);
+
+    // L1 data, L1 instruction and L2 for each physical core, L3 for each CPU.
+    EXPECT_EQ(topology->getCacheDomains().size(), (size_t) (24 * 3 + 2));
+    vector<CacheDomain*> l3 = topology->getCacheDomainsAtLevel(3);
+    ASSERT_EQ(l3.size(), (size_t) 2);
+    EXPECT_EQ(l3[0]->getSize(), (uint64_t) 30720 * 1024);
+    EXPECT_EQ(l3[0]->getLineSize(), (uint) 64);
+    EXPECT_EQ(l3[0]->getVirtualCores().size(), (size_t) 24);
+
+    VirtualCore* vc = topology->getVirtualCore(24);
+    vector<CacheDomain*> caches = topology->getCacheDomains(vc);
+    ASSERT_EQ(caches.size(), (size_t) 4);
+    EXPECT_EQ(caches[0]->getLevel(), (uint) 1);
+    EXPECT_EQ(caches[3], l3[0]);
+    CacheDomain* l1 = topology->getCacheDomain(vc, 1);
+    ASSERT_TRUE(l1 != NULL);
+    EXPECT_EQ(l1->getType(), CACHE_TYPE_DATA);
+    EXPECT_EQ(l1->getSize(), (uint64_t) 32 * 1024);
+    EXPECT_EQ(l1->getVirtualCores().size(), (size_t) 2);
+    EXPECT_EQ(topology->getCacheDomain(vc, 2)->getVirtualCores(),
+              topology->getPhysicalCore(vc->getPhysicalCoreId())->getVirtualCores());
+    EXPECT_TRUE(topology->getCacheDomain(vc, 4) == NULL);
+
+    // So that the following tests still see a single node.
+    utils::getCommandOutput("rm -rf " + nodePath);
+}
+
+TEST(TopologyTest, IdleLevelsSampleTest) {
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    m.setSimulationParameters(p);
+    Topology* topology = m.getInstanceTopology();
+
+    VirtualCoreIdleLevel* c6 = topology->getVirtualCore(0)->getIdleLevels().at(4);
+    // Does not fit in 32 bits.
+    EXPECT_EQ(c6->getAbsoluteTime(), (uint64_t) 2172893585705);
+    c6->resetTime();
+
+    IdleLevelsSample sample;
+    topology->sampleIdleLevels(sample);
+    EXPECT_EQ(sample.numLevels, (size_t) 5);
+    EXPECT_EQ(sample.time.size(), topology->getVirtualCores().size() * 5);
+    for(size_t i = 0; i < sample.time.size(); i++){
+        EXPECT_EQ(sample.time[i], (uint64_t) 0);
+        EXPECT_EQ(sample.count[i], (uint64_t) 0);
+    }
+
+    utils::writeFile("./archs/repara/sys/devices/system/cpu/cpu0/cpuidle/state4/time", "2172893586705");
+    utils::writeFile("./archs/repara/sys/devices/system/cpu/cpu0/cpuidle/state4/usage", "62610125");
+    topology->sampleIdleLevels(sample);
+    EXPECT_EQ(sample.getTime(0, 4), (uint64_t) 1000);
+    EXPECT_EQ(sample.getCount(0, 4), (uint64_t) 2);
+    EXPECT_EQ(sample.getTime(0, 3), (uint64_t) 0);
+    EXPECT_EQ(c6->getTime(), (uint64_t) 1000);
+
+    // Deltas are computed against the previous sample.
+    topology->sampleIdleLevels(sample);
+    EXPECT_EQ(sample.getTime(0, 4), (uint64_t) 0);
+}
+
+TEST(TopologyTest, IdleLatencyGuardTest) {
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    m.setSimulationParameters(p);
+    Topology* topology = m.getInstanceTopology();
+
+    ASSERT_EQ(system("mkdir -p ./archs/repara/dev"), 0);
+    utils::writeFile("./archs/repara/dev/cpu_dma_latency", "");
+    {
+        IdleLatencyGuard guard(20);
+        EXPECT_TRUE(guard.isActive());
+        int32_t value = 0;
+        FILE* f = fopen("./archs/repara/dev/cpu_dma_latency", "rb");
+        ASSERT_TRUE(f != NULL);
+        ASSERT_EQ(fread(&value, sizeof(value), 1, f), (size_t) 1);
+        fclose(f);
+        EXPECT_EQ(value, 20);
+    }
+
+    std::string powerPath = "./archs/repara/sys/devices/system/cpu/cpu1/power/";
+    ASSERT_EQ(system(("mkdir -p " + powerPath).c_str()), 0);
+    // No constraint.
+    utils::writeFile(powerPath + "pm_qos_resume_latency_us", "0");
+    vector<VirtualCore*> virtualCores;
+    virtualCores.push_back(topology->getVirtualCore(1));
+    {
+        // Zero latency is written as "n/a".
+        IdleLatencyGuard guard(virtualCores, 0);
+        EXPECT_TRUE(guard.isActive());
+        EXPECT_EQ(utils::readFirstLineFromFile(powerPath + "pm_qos_resume_latency_us"), "n/a");
+        EXPECT_TRUE(guard.setLatency(100));
+        EXPECT_EQ(utils::readFirstLineFromFile(powerPath + "pm_qos_resume_latency_us"), "100");
+    }
+    // The previous value is restored.
+    EXPECT_EQ(utils::readFirstLineFromFile(powerPath + "pm_qos_resume_latency_us"), "0");
+
+    // Virtual core 0 does not support the constraint.
+    virtualCores.push_back(topology->getVirtualCore(0));
+    IdleLatencyGuard guard(virtualCores, 0);
+    EXPECT_FALSE(guard.isActive());
+}
+
+TEST(TopologyTest, IdleResidencyTest) {
+    utils::MsrBackendSimulated backend(48);
+    backend.setRegister(MSR_TSC, 1000);
+    backend.setRegister(MSR_CORE_C6_RESIDENCY, 100);
+    backend.setRegister(MSR_PKG_C2_RESIDENCY, 0);
+    backend.setRegister(MSR_PKG_C6_RESIDENCY, 0);
+
+    Mammut m;
+    SimulationParameters p;
+    p.sysfsRootPrefix = "./archs/repara/";
+    p.msrBackend = &backend;
+    m.setSimulationParameters(p);
+    Topology* topology = m.getInstanceTopology();
+
+    VirtualCore* vc = topology->getVirtualCore(0);
+    vector<IdleResidencyCounter*> coreCounters = vc->getIdleResidencyCounters();
+    ASSERT_EQ(coreCounters.size(), (size_t) 1);
+    EXPECT_EQ(coreCounters[0]->getName(), "C6");
+    EXPECT_FALSE(coreCounters[0]->isPackage());
+    EXPECT_EQ(coreCounters[0]->getAbsoluteTicks(), (uint64_t) 100);
+
+    Cpu* cpu = topology->getCpu(0);
+    vector<IdleResidencyCounter*> packageCounters = cpu->getIdleResidencyCounters();
+    ASSERT_EQ(packageCounters.size(), (size_t) 2);
+    EXPECT_EQ(packageCounters[0]->getName(), "PC2");
+    EXPECT_EQ(packageCounters[1]->getName(), "PC6");
+    EXPECT_TRUE(packageCounters[1]->isPackage());
+
+    backend.setRegister(MSR_TSC, 2000);
+    backend.setRegister(MSR_CORE_C6_RESIDENCY, 350);
+    backend.setRegister(MSR_PKG_C6_RESIDENCY, 500);
+    EXPECT_EQ(coreCounters[0]->getTicks(), (uint64_t) 250);
+    EXPECT_DOUBLE_EQ(coreCounters[0]->getResidency(), 0.25);
+
+    vector<double> residencies;
+    cpu->getIdleResidencies(residencies);
+    ASSERT_EQ(residencies.size(), (size_t) 2);
+    EXPECT_DOUBLE_EQ(residencies[0], 0);
+    EXPECT_DOUBLE_EQ(residencies[1], 0.5);
+
+    cpu->resetIdleResidencies();
+    backend.setRegister(MSR_TSC, 2100);
+    backend.setRegister(MSR_PKG_C6_RESIDENCY, 590);
+    cpu->getIdleResidencies(residencies);
+    EXPECT_DOUBLE_EQ(residencies[1], 0.9);
+}
+
+TEST(TopologyTest, FileDescriptorsTest) {
+    struct rlimit oldLimit, limit;
+    ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &oldLimit), 0);
+    limit = oldLimit;
+    limit.rlim_cur = 64;
+    ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &limit), 0);
+    {
+        Mammut m;
+        SimulationParameters p;
+        p.sysfsRootPrefix = "./archs/repara/";
+        m.setSimulationParameters(p);
+        // The idle levels files are not opened when building the topology.
+        Topology* topology = m.getInstanceTopology();
+        VirtualCoreIdleLevel* level = topology->getVirtualCore(36)->getIdleLevels().at(0);
+        EXPECT_EQ(level->getCount(), (uint64_t) 0);
+    }
+    ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &oldLimit), 0);
+}
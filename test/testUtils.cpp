@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <mammut/mammut.hpp>
 #include "gtest/gtest.h"
@@ -85,3 +86,55 @@ TEST(UtilitiesTest, Generic) {
     v.erase(v.begin(), v.begin() + 1);
     EXPECT_TRUE(z.empty());
 }
+
+TEST(UtilitiesTest, Parsing) {
+    const char* line = "cpu10 4705 -356 (a b) 3699176\n0";
+    const char* last = line + strlen(line);
+    uint64_t value = 0;
+    EXPECT_TRUE(parseU64(line, last, value) == NULL);
+    EXPECT_EQ(parseU64(line + 3, last, value), line + 5);
+    EXPECT_EQ(value, 10);
+
+    int64_t fields[8];
+    EXPECT_EQ(parseFields(line, last, fields, 8), 6);
+    EXPECT_EQ(fields[0], 0);
+    EXPECT_EQ(fields[1], 4705);
+    EXPECT_EQ(fields[2], -356);
+    EXPECT_EQ(fields[3], 0);
+    EXPECT_EQ(fields[4], 0);
+    EXPECT_EQ(fields[5], 3699176);
+
+    char buffer[8];
+    EXPECT_EQ(formatU64(2401000, buffer, sizeof(buffer)), 7);
+    EXPECT_EQ(std::string(buffer, 7), "2401000");
+    EXPECT_EQ(formatU64(0, buffer, sizeof(buffer)), 1);
+    EXPECT_EQ(buffer[0], '0');
+    EXPECT_EQ(formatU64(123456789, buffer, sizeof(buffer)), 0);
+    EXPECT_EQ(intToString(-42), "-42");
+
+    std::vector<uint> ids = rangesListToIntegers("0-2,8,10-11");
+    ASSERT_EQ(ids.size(), (size_t) 6);
+    EXPECT_EQ(ids[2], (uint) 2);
+    EXPECT_EQ(ids[3], (uint) 8);
+    EXPECT_EQ(ids[5], (uint) 11);
+    EXPECT_TRUE(rangesListToIntegers("").empty());
+}
+
+TEST(UtilitiesTest, SysfsDirectory) {
+    SysfsDirectory cpuDir("./archs/repara/sys/devices/system/cpu");
+    ASSERT_TRUE(cpuDir.available());
+    SysfsDirectory topologyDir(cpuDir, "cpu13/topology");
+    ASSERT_TRUE(topologyDir.available());
+    int64_t value = -1;
+    EXPECT_TRUE(topologyDir.readInt("physical_package_id", value));
+    EXPECT_EQ(value, 1);
+    EXPECT_FALSE(topologyDir.readInt("nonexistent", value));
+    EXPECT_FALSE(SysfsDirectory(cpuDir, "nonexistent").available());
+
+    std::vector<std::string> levels = SysfsDirectory(cpuDir, "cpu0/cpuidle").getEntries(false, true);
+    std::sort(levels.begin(), levels.end());
+    ASSERT_EQ(levels.size(), (size_t) 5);
+    EXPECT_EQ(levels.front(), "state0");
+    EXPECT_EQ(levels.back(), "state4");
+    EXPECT_TRUE(SysfsDirectory(cpuDir, "cpu0/cpuidle/state0").getEntries(false, true).empty());
+}